@@ -0,0 +1,249 @@
+#!/usr/bin/env python3
+# Feeds the same generated input to the C, Zig and Odin decoders, checks that
+# their outputs agree and reports throughput, peak RSS and startup time.
+#
+# Example:
+#   python3 bench/compare_decoders.py --size-mb 16 --runs 5
+#
+# Each decoder is built optimized into a scratch directory first. A decoder
+# whose toolchain is missing is skipped. Every decoder reads its input from a
+# fixed name in the working directory, so each one runs in its own directory
+# holding a copy of the input under the name it expects.
+
+import argparse
+import os
+import random
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# Forms every decoder prints the same way: reg/mem mov/add/sub/cmp, immediate
+# to register, immediate to accumulator and the short jumps. Same mix as
+# zig_decoder/src/bench.zig, less two corners where the decoders disagree:
+# the C decoder prints immediates to registers signed and the others
+# unsigned, so those stay below the sign bit, and it swaps the operands of a
+# reg/mem store with a 16-bit displacement (mod 10, d 0), so those are
+# generated as loads.
+REG_MEM_OPCODES = [0x88, 0x00, 0x28, 0x38]
+ACCUMULATOR_OPCODES = [0x04, 0x2C, 0x3C]
+JUMP_OPCODES = list(range(0x70, 0x80)) + [0xE0, 0xE1, 0xE2, 0xE3]
+
+
+def generate_input(size, seed):
+    rng = random.Random(seed)
+    out = bytearray()
+    while len(out) + 6 <= size:
+        kind = rng.randrange(4)
+        if kind == 0:
+            modrm = rng.randrange(256)
+            mod = modrm >> 6
+            rm = modrm & 0b111
+            opcode = rng.choice(REG_MEM_OPCODES) | rng.randrange(4)
+            if mod == 0b10:
+                opcode |= 0b0000_0010
+            out.append(opcode)
+            out.append(modrm)
+            if (mod == 0b00 and rm == 0b110) or mod == 0b10:
+                out += rng.randbytes(2)
+            elif mod == 0b01:
+                out += rng.randbytes(1)
+        elif kind == 1:
+            opcode = 0b1011_0000 | rng.randrange(16)
+            out.append(opcode)
+            if opcode & 0b0000_1000:
+                out += rng.randrange(0x8000).to_bytes(2, "little")
+            else:
+                out.append(rng.randrange(0x80))
+        elif kind == 2:
+            opcode = rng.choice(ACCUMULATOR_OPCODES) | rng.randrange(2)
+            out.append(opcode)
+            out += rng.randbytes(2 if opcode & 0b0000_0001 else 1)
+        else:
+            out.append(rng.choice(JUMP_OPCODES))
+            out += rng.randbytes(1)
+    return bytes(out)
+
+
+class Decoder:
+    def __init__(self, name, input_name, build):
+        self.name = name
+        self.input_name = input_name
+        self.build = build
+        self.binary = None
+
+
+def build_c(scratch):
+    if not shutil.which("gcc"):
+        return None, "gcc not found"
+    binary = os.path.join(scratch, "c_decoder")
+    subprocess.run(["gcc", "main.c", "-std=c11", "-O2", "-pthread", "-o", binary],
+                   cwd=os.path.join(REPO, "c_decoder_linux"), check=True)
+    return binary, None
+
+
+def build_zig(scratch):
+    if not shutil.which("zig"):
+        return None, "zig not found"
+    prefix = os.path.join(scratch, "zig-out")
+    # Without the per-byte dump to stderr, which would be timed and thrown away.
+    subprocess.run(["zig", "build", "-Drelease-fast=true", "-Ddump-bytes=false", "--prefix", prefix],
+                   cwd=os.path.join(REPO, "zig_decoder"), check=True)
+    return os.path.join(prefix, "bin", "zig_decoder"), None
+
+
+def build_odin(scratch):
+    if not shutil.which("odin"):
+        return None, "odin not found"
+    binary = os.path.join(scratch, "odin_decoder")
+    subprocess.run(["odin", "build", os.path.join(REPO, "odin_decoder"), "-o:speed",
+                    "-out:" + binary], check=True)
+    return binary, None
+
+
+DECODERS = [
+    Decoder("c", "instructions", build_c),
+    Decoder("zig", "instruction_list", build_zig),
+    Decoder("odin", "instructions", build_odin),
+]
+
+
+# Runs binary in directory with stdout to output_path. Returns wall seconds
+# and peak RSS in KB. A decoder that writes to stderr on valid input is
+# timing a dump beside the decode, so that is warned about.
+def run_once(binary, directory, output_path):
+    error_path = output_path + ".err"
+    with open(output_path, "wb") as output, open(error_path, "wb") as error:
+        start = time.perf_counter()
+        process = subprocess.Popen([binary], cwd=directory, stdout=output, stderr=error)
+        _, status, usage = os.wait4(process.pid, 0)
+        seconds = time.perf_counter() - start
+    process.returncode = os.waitstatus_to_exitcode(status)
+    if process.returncode != 0:
+        print(f"warning: {binary} exited with {process.returncode}", file=sys.stderr)
+    error_size = os.path.getsize(error_path)
+    if error_size:
+        print(f"warning: {binary} wrote {error_size} bytes to stderr, timed with the decode", file=sys.stderr)
+    return seconds, usage.ru_maxrss
+
+
+def best_run(binary, directory, output_path, runs):
+    best_seconds = None
+    peak_rss = 0
+    for _ in range(runs):
+        seconds, rss = run_once(binary, directory, output_path)
+        best_seconds = seconds if best_seconds is None else min(best_seconds, seconds)
+        peak_rss = max(peak_rss, rss)
+    return best_seconds, peak_rss
+
+
+# Only instruction and error lines are compared, with whitespace collapsed.
+# Headers, byte dumps and blank lines differ between the decoders.
+INSTRUCTION_LINE = re.compile(r"^(?:[a-z]+ |Error)")
+
+
+def normalized_lines(path):
+    with open(path, "r", errors="replace") as f:
+        for line in f:
+            line = " ".join(line.split())
+            if INSTRUCTION_LINE.match(line):
+                yield line
+
+
+# Returns None when equal, otherwise (line number, reference line, line).
+def first_difference(reference_path, path):
+    reference = normalized_lines(reference_path)
+    other = normalized_lines(path)
+    number = 0
+    while True:
+        number += 1
+        a = next(reference, None)
+        b = next(other, None)
+        if a != b:
+            return number, a, b
+        if a is None:
+            return None
+
+
+def prepare_directory(scratch, decoder, label, data):
+    directory = os.path.join(scratch, f"{decoder.name}-{label}")
+    os.makedirs(directory, exist_ok=True)
+    with open(os.path.join(directory, decoder.input_name), "wb") as f:
+        f.write(data)
+    return directory
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--size-mb", type=float, default=16, help="generated input size")
+    parser.add_argument("--runs", type=int, default=5, help="runs per decoder, best is reported")
+    parser.add_argument("--seed", type=int, default=0x8086)
+    parser.add_argument("--keep", action="store_true", help="keep the scratch directory")
+    args = parser.parse_args()
+
+    scratch = tempfile.mkdtemp(prefix="decoder-compare-")
+    try:
+        available = []
+        for decoder in DECODERS:
+            try:
+                decoder.binary, reason = decoder.build(scratch)
+            except subprocess.CalledProcessError as e:
+                decoder.binary, reason = None, f"build failed ({e.returncode})"
+            if decoder.binary:
+                available.append(decoder)
+            else:
+                print(f"skipping {decoder.name}: {reason}")
+
+        if not available:
+            print("no decoder could be built")
+            return 1
+
+        data = generate_input(int(args.size_mb * 1024 * 1024), args.seed)
+        # One short instruction, so the run is all process startup.
+        tiny = bytes([0x89, 0xD9])
+
+        print(f"input: {len(data)} bytes, seed {args.seed:#x}, best of {args.runs} runs\n")
+        print(f"{'decoder':<8} {'time':>9} {'MB/s':>9} {'peak RSS':>11} {'startup':>10}")
+
+        outputs = {}
+        for decoder in available:
+            directory = prepare_directory(scratch, decoder, "large", data)
+            output_path = os.path.join(scratch, f"{decoder.name}.out")
+            seconds, rss = best_run(decoder.binary, directory, output_path, args.runs)
+            outputs[decoder.name] = output_path
+
+            tiny_directory = prepare_directory(scratch, decoder, "tiny", tiny)
+            startup, _ = best_run(decoder.binary, tiny_directory,
+                                  os.path.join(scratch, f"{decoder.name}.tiny.out"), args.runs)
+
+            print(f"{decoder.name:<8} {seconds:>8.3f}s {len(data) / 1e6 / seconds:>9.1f} "
+                  f"{rss / 1024:>8.1f} MB {startup * 1e3:>8.2f}ms")
+
+        print()
+        mismatches = 0
+        reference = available[0].name
+        for decoder in available[1:]:
+            difference = first_difference(outputs[reference], outputs[decoder.name])
+            if difference is None:
+                print(f"{decoder.name}: output matches {reference}")
+            else:
+                mismatches += 1
+                number, a, b = difference
+                print(f"{decoder.name}: output differs from {reference} at instruction {number}")
+                print(f"  {reference}: {a}")
+                print(f"  {decoder.name}: {b}")
+
+        if args.keep:
+            print(f"\nscratch directory: {scratch}")
+        return 1 if mismatches else 0
+    finally:
+        if not args.keep:
+            shutil.rmtree(scratch, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
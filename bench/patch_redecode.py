@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+# Measures --patch: small byte patches into inputs of growing size, each
+# followed by an incremental re-decode, as against decoding the whole input
+# again after every patch.
+#
+# Example:
+#   python3 bench/patch_redecode.py --sizes-mb 1 4 16 --patches 2000
+#
+# The inputs are the instruction mix of compare_decoders.py. Half of the
+# patches write a few instructions of the same mix, the other half random
+# bytes, so some of them shift the instruction boundaries after them until
+# the decode lines up again. With random bytes in the input, --resilient
+# keeps the listing going past undecodable bytes.
+
+import argparse
+import os
+import random
+import re
+import subprocess
+import tempfile
+
+from compare_decoders import REPO, generate_input
+
+
+def generate_patches(size, count, seed):
+    rng = random.Random(seed)
+    lines = []
+    for _ in range(count):
+        data = generate_input(rng.randrange(8, 24), rng.randrange(1 << 30)) if rng.random() < 0.5 else \
+            rng.randbytes(rng.randrange(1, 8))
+        offset = rng.randrange(size - len(data))
+        lines.append(f"{offset:#x} " + " ".join(f"{b:02X}" for b in data))
+    return "\n".join(lines) + "\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--sizes-mb", type=float, nargs="+", default=[1, 4, 16])
+    parser.add_argument("--patches", type=int, default=2000)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as scratch:
+        binary = os.path.join(scratch, "decoder")
+        subprocess.run(["gcc", "main.c", "-std=c11", "-O2", "-pthread", "-o", binary],
+                       cwd=os.path.join(REPO, "c_decoder_linux"), check=True)
+
+        print(f"{'size':>8} {'full decode':>12} {'per patch':>10} {'decoded again':>22} {'speedup':>8}")
+        for size_mb in args.sizes_mb:
+            size = int(size_mb * 1024 * 1024)
+            image = os.path.join(scratch, "image")
+            with open(image, "wb") as f:
+                f.write(generate_input(size, args.seed))
+            patches = os.path.join(scratch, "patches")
+            with open(patches, "w") as f:
+                f.write(generate_patches(size, args.patches, args.seed))
+
+            result = subprocess.run([binary, "--patch", patches, "--resilient", "--output-stats", image],
+                                    stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True, check=True)
+            full = float(re.search(r"([0-9.]+) ms full decode", result.stderr).group(1))
+            per_patch = float(re.search(r"([0-9.]+) us per patch", result.stderr).group(1))
+            decoded = re.search(r"([0-9.]+) bytes and ([0-9.]+) instructions decoded again", result.stderr)
+            print(f"{size_mb:>6g}MB {full:>9.2f} ms {per_patch:>7.2f} us "
+                  f"{decoded.group(1):>7} B {decoded.group(2):>6} inst {full * 1e3 / per_patch:>7.0f}x")
+
+
+if __name__ == "__main__":
+    main()
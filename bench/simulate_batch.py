@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+# Runs one loop-heavy routine over many input vectors with --batch and
+# compares the total instruction rate with a single --simulate run of the
+# same routine, and checks that instance's result against it.
+#
+# Example:
+#   python3 bench/simulate_batch.py --instances 4096 --runs 3
+#
+# The routine is two nested loops around the random add/sub/cmp/mov body of
+# simulate_flags.py. The inner loop count comes from sp, which the body
+# leaves alone. With --same-count every instance loops equally often and the
+# lanes never diverge; otherwise sp is random per instance and the lanes of
+# a group split at the loop end.
+
+import argparse
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+
+from simulate_flags import REPO, body_instruction
+
+
+def generate_routine(seed, body_length, outer):
+    rng = random.Random(seed)
+    code = bytearray()
+    code += bytes([0xBD, 0x00, 0x80])  # mov bp, 0x8000
+    code += bytes([0xBA]) + outer.to_bytes(2, "little")  # mov dx, outer
+    outer_start = len(code)
+    code += bytes([0x89, 0xE1])  # mov cx, sp
+    inner_start = len(code)
+    for _ in range(body_length):
+        code += body_instruction(rng)
+    code += bytes([0xE2, (inner_start - (len(code) + 2)) & 0xFF])  # loop inner
+    code += bytes([0x83, 0xEA, 0x01])  # sub dx, 1
+    code += bytes([0x75, (outer_start - (len(code) + 2)) & 0xFF])  # jne outer
+    return bytes(code)
+
+
+def rate(stderr, label):
+    return float(re.search(label + r": .* ([0-9.]+) M instructions/s", stderr).group(1))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--instances", type=int, default=4096)
+    parser.add_argument("--inner", type=int, default=200, help="inner loop count, the mean when random")
+    parser.add_argument("--outer", type=int, default=20)
+    parser.add_argument("--body", type=int, default=12, help="instructions per loop body")
+    parser.add_argument("--same-count", action="store_true")
+    parser.add_argument("--runs", type=int, default=3)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    with tempfile.TemporaryDirectory() as scratch:
+        binary = os.path.join(scratch, "decoder")
+        subprocess.run(["gcc", "main.c", "-std=c11", "-O2", "-pthread", "-o", binary],
+                       cwd=os.path.join(REPO, "c_decoder_linux"), check=True)
+
+        routine = os.path.join(scratch, "routine")
+        with open(routine, "wb") as f:
+            f.write(generate_routine(args.seed, args.body, args.outer))
+
+        inputs = os.path.join(scratch, "inputs")
+        with open(inputs, "w") as f:
+            for _ in range(args.instances):
+                count = args.inner if args.same_count else rng.randrange(1, 2 * args.inner)
+                f.write(f"sp={count} ax={rng.randrange(65536)} bx={rng.randrange(65536)} di={rng.randrange(65536)}\n")
+
+        batch = []
+        for _ in range(args.runs):
+            result = subprocess.run([binary, "--batch", inputs, "--output-stats", routine],
+                                    capture_output=True, text=True, check=True)
+            batch.append(rate(result.stderr, "batch"))
+            lanes = re.search(r"([0-9.]+) of [0-9]+ lanes per step", result.stderr).group(1)
+            first = result.stdout.splitlines()[0]
+
+        # The first instance alone, as --simulate sees it: its inputs moved
+        # into the routine as movs.
+        registers = {"ax": 0xB8, "sp": 0xBC, "bx": 0xBB, "di": 0xBF}
+        with open(inputs) as f:
+            setup = bytearray()
+            values = dict(pair.split("=") for pair in f.readline().split())
+            for name, value in values.items():
+                setup += bytes([registers[name]]) + int(value).to_bytes(2, "little")
+        single_routine = os.path.join(scratch, "single")
+        with open(single_routine, "wb") as f:
+            f.write(bytes(setup) + generate_routine(args.seed, args.body, args.outer))
+        result = subprocess.run([binary, "--simulate", single_routine], capture_output=True, text=True, check=True)
+        final = dict(re.findall(r"(\w\w): 0x([0-9a-f]{4})", result.stdout))
+        expected = dict(re.findall(r"(\w\w)=0x([0-9a-f]{4})", first))
+        final.pop("ip")
+        expected.pop("ip")
+        if final != expected:
+            sys.exit(f"instance 0 differs from --simulate:\n{first}\n{result.stdout}")
+
+        # The scalar rate, from a run long enough to measure.
+        with open(single_routine, "wb") as f:
+            f.write(bytes(setup) + generate_routine(args.seed, args.body, min(args.outer * 100, 0xFFFF)))
+        single = []
+        for _ in range(args.runs):
+            result = subprocess.run([binary, "--simulate", "--output-stats", single_routine],
+                                    capture_output=True, text=True, check=True)
+            single.append(rate(result.stderr, "simulate"))
+
+        print(f"{args.instances} instances, {lanes} lanes per step")
+        print(f"simulate MIPS {max(single):.1f}, batch MIPS {max(batch):.1f}, {max(batch) / max(single):.2f}x")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+# Compares lazy and eager flag evaluation in the C simulator (--simulate)
+# on generated loop-heavy programs, and checks both end in the same state.
+#
+# Example:
+#   python3 bench/simulate_flags.py --iterations 2000000 --runs 5
+#
+# Each program is two nested loops around a body of random add/sub/cmp/mov
+# instructions on registers and memory. A body with conditional jumps reads
+# the flags inside the loop, one without only at the loop ends.
+
+import argparse
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# Registers the body may touch: ax, bx, si, di. cx and dx count the loops,
+# bp points at scratch memory.
+BODY_REGISTERS = [0, 3, 6, 7]
+
+
+def body_instruction(rng):
+    kind = rng.randrange(5)
+    reg = rng.choice(BODY_REGISTERS)
+    rm = rng.choice(BODY_REGISTERS)
+    if kind == 0:
+        # add/sub/cmp reg, reg
+        opcode = rng.choice([0x01, 0x29, 0x39])
+        return bytes([opcode, 0xC0 | reg << 3 | rm])
+    if kind == 1:
+        # add/sub/cmp reg, imm8 (sign-extended)
+        ext = rng.choice([0, 5, 7])
+        return bytes([0x83, 0xC0 | ext << 3 | rm, rng.randrange(256)])
+    if kind == 2:
+        # add/sub [bp + disp8], reg
+        opcode = rng.choice([0x01, 0x29])
+        return bytes([opcode, 0x46 | reg << 3, rng.randrange(0, 64, 2)])
+    if kind == 3:
+        # mov reg, [bp + disp8]
+        return bytes([0x8B, 0x46 | reg << 3, rng.randrange(0, 64, 2)])
+    # add ax, imm16
+    return bytes([0x05]) + rng.randbytes(2)
+
+
+def generate_program(seed, body_length, outer, inner, branches):
+    rng = random.Random(seed)
+    body = bytearray()
+    for _ in range(body_length):
+        body += body_instruction(rng)
+        if branches and rng.randrange(3) == 0:
+            # Conditional jump to the next instruction: reads flags, goes on
+            # either way.
+            body += bytes([rng.choice(list(range(0x70, 0x80))), 0x00])
+
+    code = bytearray()
+    code += bytes([0xBD, 0x00, 0x80])  # mov bp, 0x8000
+    code += bytes([0xBA]) + outer.to_bytes(2, "little")  # mov dx, outer
+    outer_start = len(code)
+    code += bytes([0xB9]) + inner.to_bytes(2, "little")  # mov cx, inner
+    inner_start = len(code)
+    code += body
+    code += bytes([0xE2, (inner_start - (len(code) + 2)) & 0xFF])  # loop inner
+    code += bytes([0x83, 0xEA, 0x01])  # sub dx, 1
+    code += bytes([0x75, (outer_start - (len(code) + 2)) & 0xFF])  # jne outer
+    if inner_start - len(code) < -128 or outer_start - len(code) < -128:
+        sys.exit("body too long for short jumps, lower --body")
+    return bytes(code)
+
+
+def run(binary, program, eager):
+    args = [binary, "--simulate", "--output-stats", program]
+    if eager:
+        args.append("--eager-flags")
+    result = subprocess.run(args, capture_output=True, text=True, check=True)
+    rate = float(re.search(r"([0-9.]+) M instructions/s", result.stderr).group(1))
+    reads = re.search(r"\(([0-9.]+)%\)", result.stderr).group(1)
+    return rate, reads, result.stdout
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--iterations", type=int, default=1000000, help="inner loop iterations in total")
+    parser.add_argument("--body", type=int, default=12, help="instructions per loop body")
+    parser.add_argument("--runs", type=int, default=3)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as scratch:
+        binary = os.path.join(scratch, "decoder")
+        subprocess.run(["gcc", "main.c", "-std=c11", "-O2", "-pthread", "-o", binary],
+                       cwd=os.path.join(REPO, "c_decoder_linux"), check=True)
+
+        inner = 1000
+        outer = max(1, args.iterations // inner)
+        print(f"{'program':<12} {'reads/write':>11} {'eager MIPS':>11} {'lazy MIPS':>10} {'speedup':>8}")
+        for name, branches in [("straight", False), ("branchy", True)]:
+            program = os.path.join(scratch, name)
+            with open(program, "wb") as f:
+                f.write(generate_program(args.seed, args.body, outer, inner, branches))
+
+            eager = max(run(binary, program, True)[0] for _ in range(args.runs))
+            lazy_runs = [run(binary, program, False) for _ in range(args.runs)]
+            lazy = max(rate for rate, _, _ in lazy_runs)
+            _, reads, lazy_state = lazy_runs[0]
+            _, _, eager_state = run(binary, program, True)
+            if lazy_state != eager_state:
+                sys.exit(f"{name}: lazy and eager final state differ:\n{lazy_state}\n{eager_state}")
+            print(f"{name:<12} {reads + '%':>11} {eager:>11.1f} {lazy:>10.1f} {lazy / eager:>7.2f}x")
+
+
+if __name__ == "__main__":
+    main()
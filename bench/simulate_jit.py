@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+# Compares the simulator's interpreter with its block translator (--jit) on
+# the loop-heavy programs of simulate_flags.py, and checks both end in the
+# same state.
+#
+# Example:
+#   python3 bench/simulate_jit.py --iterations 5000000 --runs 5
+#
+# Rates are emulated instructions per second over the whole run, so the
+# interpreted warm-up and the translation itself are included.
+#
+# Before timing, the programs of JIT_CHECKS run translated from their first
+# pass and must end like the interpreter does.
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+from simulate_flags import REPO, generate_program
+
+
+def self_modifying_blocks():
+    # Near-full blocks of word stores to memory with the host flags live,
+    # the largest code per instruction, and a loop that stores into its own
+    # block every pass. Blocks this size once overran the per-block reserve
+    # of the translation buffer.
+    code = bytearray([0xBB, 0x00, 0x80])  # mov bx, 0x8000
+    code += bytes([0x01, 0x00]) * 49  # add [bx + si], ax
+    code += bytes([0x74, 0x00])  # je +0
+    loop = len(code)
+    code += bytes([0x88, 0x16]) + (loop + 5).to_bytes(2, "little")  # mov [loop + 5], dl
+    code += bytes([0x01, 0x00]) * 61
+    code += bytes([0x74, (loop - (len(code) + 2)) & 0xFF])  # je loop
+    return bytes(code)
+
+
+# Programs and the extra arguments to run them with.
+JIT_CHECKS = [
+    ("self-modifying", self_modifying_blocks(), ["--jit-threshold", "1", "--max-steps", "150000"]),
+]
+
+
+def run(binary, program, jit, extra=()):
+    args = [binary, "--simulate", "--output-stats", *extra, program]
+    if jit:
+        args.append("--jit")
+    result = subprocess.run(args, capture_output=True, text=True, check=True)
+    rate = float(re.search(r"([0-9.]+) M instructions/s", result.stderr).group(1))
+    return rate, result.stdout
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--iterations", type=int, default=1000000, help="inner loop iterations in total")
+    parser.add_argument("--body", type=int, default=12, help="instructions per loop body")
+    parser.add_argument("--runs", type=int, default=3)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as scratch:
+        binary = os.path.join(scratch, "decoder")
+        subprocess.run(["gcc", "main.c", "-std=c11", "-O2", "-pthread", "-o", binary],
+                       cwd=os.path.join(REPO, "c_decoder_linux"), check=True)
+
+        for name, code, extra in JIT_CHECKS:
+            program = os.path.join(scratch, name)
+            with open(program, "wb") as f:
+                f.write(code)
+            if run(binary, program, False, extra)[1] != run(binary, program, True, extra)[1]:
+                sys.exit(f"{name}: interpreter and jit final state differ")
+
+        inner = 1000
+        outer = max(1, args.iterations // inner)
+        print(f"{'program':<12} {'interpreter MIPS':>16} {'jit MIPS':>9} {'speedup':>8}")
+        for name, branches in [("straight", False), ("branchy", True)]:
+            program = os.path.join(scratch, name)
+            with open(program, "wb") as f:
+                f.write(generate_program(args.seed, args.body, outer, inner, branches))
+
+            interpreted = [run(binary, program, False) for _ in range(args.runs)]
+            translated = [run(binary, program, True) for _ in range(args.runs)]
+            if interpreted[0][1] != translated[0][1]:
+                sys.exit(f"{name}: interpreter and jit final state differ:\n{interpreted[0][1]}\n{translated[0][1]}")
+            interpreter = max(rate for rate, _ in interpreted)
+            jit = max(rate for rate, _ in translated)
+            print(f"{name:<12} {interpreter:>16.1f} {jit:>9.1f} {jit / interpreter:>7.2f}x")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+# Measures --replay: one short program run many times from a snapshot, as
+# against starting the simulator once per run, and checks the last replay
+# ends in the state of a plain run.
+#
+# Example:
+#   python3 bench/simulate_replay.py --replays 100000 --checkpoint-at 20
+#
+# The program is the loop of simulate_flags.py with a couple of hundred
+# iterations. The default seed's body stores to memory, so every restore
+# has a page to copy back.
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+from simulate_flags import REPO, generate_program
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--replays", type=int, default=100000)
+    parser.add_argument("--checkpoint-at", type=int, default=0)
+    parser.add_argument("--inner", type=int, default=20)
+    parser.add_argument("--outer", type=int, default=10)
+    parser.add_argument("--body", type=int, default=12, help="instructions per loop body")
+    parser.add_argument("--processes", type=int, default=200, help="separate runs to time for comparison")
+    parser.add_argument("--seed", type=int, default=2)
+    parser.add_argument("--jit", action="store_true")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as scratch:
+        binary = os.path.join(scratch, "decoder")
+        subprocess.run(["gcc", "main.c", "-std=c11", "-O2", "-pthread", "-o", binary],
+                       cwd=os.path.join(REPO, "c_decoder_linux"), check=True)
+
+        program = os.path.join(scratch, "program")
+        with open(program, "wb") as f:
+            f.write(generate_program(args.seed, args.body, args.outer, args.inner, False))
+        extra = ["--jit"] if args.jit else []
+
+        plain = subprocess.run([binary, "--simulate", *extra, program], capture_output=True, text=True, check=True)
+
+        start = time.perf_counter()
+        for _ in range(args.processes):
+            subprocess.run([binary, "--simulate", *extra, program], capture_output=True, check=True)
+        process_rate = args.processes / (time.perf_counter() - start)
+
+        result = subprocess.run([binary, "--simulate", *extra, "--replay", str(args.replays),
+                                 "--checkpoint-at", str(args.checkpoint_at), "--output-stats", program],
+                                capture_output=True, text=True, check=True)
+        if result.stdout != plain.stdout:
+            sys.exit(f"last replay differs from a plain run:\n{plain.stdout}\n{result.stdout}")
+        seconds = float(re.search(r"instructions, ([0-9.]+) s", result.stderr).group(1))
+        pages = re.search(r"([0-9.]+) of [0-9]+ pages copied per restore", result.stderr).group(1)
+        restores = float(re.search(r"([0-9]+) restores/s", result.stderr).group(1))
+
+        print(f"{'':<20} {'runs/s':>10}")
+        print(f"{'process per run':<20} {process_rate:>10.0f}")
+        print(f"{'--replay':<20} {args.replays / seconds:>10.0f}")
+        print(f"restore alone: {restores:.0f}/s, {pages} pages copied per restore")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+# Measures --trace on the loop-heavy programs of simulate_flags.py: the
+# run time with and without the trace, the trace size per step against the
+# text --read-trace prints from it, and the reader's rate.
+#
+# Example:
+#   python3 bench/simulate_trace.py --iterations 2000000 --runs 5
+#
+# The trace goes to a file in a temporary directory, so the traced time
+# includes writing it.
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+from simulate_flags import REPO, generate_program
+
+
+def seconds(stderr, label):
+    return float(re.search(label + r": .*?([0-9.]+) s,", stderr).group(1))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--iterations", type=int, default=1000000, help="inner loop iterations in total")
+    parser.add_argument("--body", type=int, default=12, help="instructions per loop body")
+    parser.add_argument("--runs", type=int, default=3)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as scratch:
+        binary = os.path.join(scratch, "decoder")
+        subprocess.run(["gcc", "main.c", "-std=c11", "-O2", "-pthread", "-o", binary],
+                       cwd=os.path.join(REPO, "c_decoder_linux"), check=True)
+
+        inner = 1000
+        outer = max(1, args.iterations // inner)
+        trace = os.path.join(scratch, "trace")
+        print(f"{'program':<12} {'plain s':>8} {'traced s':>9} {'overhead':>9} {'bytes/step':>11} {'text bytes/step':>16} {'read M steps/s':>15}")
+        for name, branches in [("straight", False), ("branchy", True)]:
+            program = os.path.join(scratch, name)
+            with open(program, "wb") as f:
+                f.write(generate_program(args.seed, args.body, outer, inner, branches))
+
+            plain = []
+            traced = []
+            for _ in range(args.runs):
+                result = subprocess.run([binary, "--simulate", "--output-stats", program],
+                                        capture_output=True, text=True, check=True)
+                plain.append(seconds(result.stderr, "simulate"))
+                state = result.stdout
+                result = subprocess.run([binary, "--simulate", "--trace", trace, "--output-stats", program],
+                                        capture_output=True, text=True, check=True)
+                traced.append(seconds(result.stderr, "simulate"))
+                if result.stdout != state:
+                    sys.exit(f"{name}: traced final state differs:\n{state}\n{result.stdout}")
+            steps = int(re.search(r"trace: ([0-9]+) steps", result.stderr).group(1))
+            size = os.path.getsize(trace)
+
+            # The text goes to /dev/null; the output stats count its bytes.
+            text = subprocess.run([binary, "--read-trace", "--output-stats", trace],
+                                  stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True, check=True)
+            text_size = int(re.search(r"output: \w+, ([0-9]+) bytes", text.stderr).group(1))
+            rate = float(re.search(r"read-trace: .* ([0-9.]+) M steps/s", text.stderr).group(1))
+            print(f"{name:<12} {min(plain):>8.3f} {min(traced):>9.3f} {min(traced) / min(plain):>8.2f}x "
+                  f"{size / steps:>11.2f} {text_size / steps:>16.1f} {rate:>15.1f}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,741 @@
+// Batch simulator, selected with --batch <file>: runs the input as code,
+// like --simulate, once per line of the file and prints one line of final
+// state per run. Included at the bottom of main.c, after snapshot.c.
+//
+// Each line of the file sets the initial registers of one instance, as
+// register=value pairs; registers not named start at 0 and lines starting
+// with # are skipped.
+//
+// Example: ax=3 bx=0x200
+//
+// Instances run in groups of BATCH_LANES whose registers are stored as
+// structure of arrays, one SSE2 vector of words per 8086 register, and
+// step together: each step runs the instruction at the lowest IP of the
+// group for every lane that is there and masks out the others. Loops
+// bring the lanes back together at their head. Register operands and the
+// lazy flag records are vector operations; memory operands and jumps go
+// lane by lane. The decode cache is shared by all instances.
+//
+// A store into the code makes the instance leave its group: it finishes
+// on the scalar simulator (sim.c), with its own decode cache.
+//
+// Stores set the dirty byte of their page, so starting the next group
+// copies only the pages the last one wrote back from the image, see
+// snapshot_reset_pages().
+//
+// Example output line, for instance 0:
+//   0: ax=0x0005 bx=0x0100 ip=0x0014 flags=PZ
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define BATCH_LANES 8 // Words per SSE2 vector
+#define BATCH_MAX_LINE 512
+
+enum
+{
+ BATCH_RUNNING,
+ BATCH_DONE,
+ BATCH_ERROR, // Undecodable instruction at ip
+ BATCH_LEAVING, // Stored into the code, moves to the scalar simulator
+};
+
+#ifdef __SSE2__
+typedef __m128i BatchVector;
+
+BatchVector batch_load(U16 *lanes)
+{
+ return _mm_loadu_si128((__m128i *)lanes);
+}
+
+void batch_store(U16 *lanes, BatchVector value)
+{
+ _mm_storeu_si128((__m128i *)lanes, value);
+}
+
+BatchVector batch_set(U16 value)
+{
+ return _mm_set1_epi16((short)value);
+}
+
+BatchVector batch_add(BatchVector a, BatchVector b)
+{
+ return _mm_add_epi16(a, b);
+}
+
+BatchVector batch_sub(BatchVector a, BatchVector b)
+{
+ return _mm_sub_epi16(a, b);
+}
+
+BatchVector batch_and(BatchVector a, BatchVector b)
+{
+ return _mm_and_si128(a, b);
+}
+
+BatchVector batch_or(BatchVector a, BatchVector b)
+{
+ return _mm_or_si128(a, b);
+}
+
+BatchVector batch_shift_right8(BatchVector a)
+{
+ return _mm_srli_epi16(a, 8);
+}
+
+BatchVector batch_shift_left8(BatchVector a)
+{
+ return _mm_slli_epi16(a, 8);
+}
+
+// a where mask is set, b elsewhere.
+BatchVector batch_select(BatchVector mask, BatchVector a, BatchVector b)
+{
+ return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+#else
+typedef struct
+{
+ U16 lanes[BATCH_LANES];
+} BatchVector;
+
+BatchVector batch_load(U16 *lanes)
+{
+ BatchVector result;
+ memcpy(result.lanes, lanes, sizeof(result.lanes));
+ return result;
+}
+
+void batch_store(U16 *lanes, BatchVector value)
+{
+ memcpy(lanes, value.lanes, sizeof(value.lanes));
+}
+
+BatchVector batch_set(U16 value)
+{
+ BatchVector result;
+ for(int i = 0; i < BATCH_LANES; i++)
+ {
+  result.lanes[i] = value;
+ }
+ return result;
+}
+
+BatchVector batch_add(BatchVector a, BatchVector b)
+{
+ for(int i = 0; i < BATCH_LANES; i++)
+ {
+  a.lanes[i] = (U16)(a.lanes[i] + b.lanes[i]);
+ }
+ return a;
+}
+
+BatchVector batch_sub(BatchVector a, BatchVector b)
+{
+ for(int i = 0; i < BATCH_LANES; i++)
+ {
+  a.lanes[i] = (U16)(a.lanes[i] - b.lanes[i]);
+ }
+ return a;
+}
+
+BatchVector batch_and(BatchVector a, BatchVector b)
+{
+ for(int i = 0; i < BATCH_LANES; i++)
+ {
+  a.lanes[i] &= b.lanes[i];
+ }
+ return a;
+}
+
+BatchVector batch_or(BatchVector a, BatchVector b)
+{
+ for(int i = 0; i < BATCH_LANES; i++)
+ {
+  a.lanes[i] |= b.lanes[i];
+ }
+ return a;
+}
+
+BatchVector batch_shift_right8(BatchVector a)
+{
+ for(int i = 0; i < BATCH_LANES; i++)
+ {
+  a.lanes[i] >>= 8;
+ }
+ return a;
+}
+
+BatchVector batch_shift_left8(BatchVector a)
+{
+ for(int i = 0; i < BATCH_LANES; i++)
+ {
+  a.lanes[i] = (U16)(a.lanes[i] << 8);
+ }
+ return a;
+}
+
+BatchVector batch_select(BatchVector mask, BatchVector a, BatchVector b)
+{
+ for(int i = 0; i < BATCH_LANES; i++)
+ {
+  a.lanes[i] = (U16)((mask.lanes[i] & a.lanes[i]) | (~mask.lanes[i] & b.lanes[i]));
+ }
+ return a;
+}
+#endif
+
+typedef struct
+{
+ U16 registers[8][BATCH_LANES]; // ax, cx, dx, bx, sp, bp, si, di
+ U16 ip[BATCH_LANES];
+
+ // The lazy flag record of each lane, see LazyFlags. flags holds the flags
+ // when the op is SIM_OP_NONE.
+ U16 flag_op[BATCH_LANES]; // op | w << 8
+ U16 flag_a[BATCH_LANES];
+ U16 flag_b[BATCH_LANES];
+ U16 flag_result[BATCH_LANES];
+ U16 flags[BATCH_LANES];
+
+ U64 steps[BATCH_LANES];
+ U16 running[BATCH_LANES]; // 0xFFFF while the state is BATCH_RUNNING
+ U8 state[BATCH_LANES];
+ USIZE instance[BATCH_LANES];
+
+ // Pages stored to since the group started, see Sim.dirty.
+ U8 dirty[BATCH_LANES][SIM_PAGE_COUNT];
+ U8 memory[BATCH_LANES][SIM_MEMORY_SIZE + INPUT_TAIL_PADDING];
+} BatchGroup;
+
+typedef struct
+{
+ U8 code[SIM_MEMORY_SIZE + INPUT_TAIL_PADDING];
+ USIZE code_size;
+ U64 limit;
+
+ bool decoded[SIM_MEMORY_SIZE];
+ Instruction cache[SIM_MEMORY_SIZE];
+
+ Sim *scalar; // For instances that leave their group
+
+ U64 instructions; // Run in groups
+ U64 steps; // Group steps, each one instruction for one or more lanes
+ U64 scalar_instructions; // Run by instances that left their group
+ USIZE left;
+ U64 pages_copied; // Reset between groups
+} Batch;
+
+LazyFlags batch_lazy_flags(BatchGroup *group, int lane)
+{
+ U16 op = group->flag_op[lane];
+ return (LazyFlags){(U8)op, op >> 8, group->flag_a[lane], group->flag_b[lane], group->flag_result[lane]};
+}
+
+BatchVector batch_get_register(BatchGroup *group, U8 reg, bool w)
+{
+ if(w)
+ {
+  return batch_load(group->registers[reg]);
+ }
+ // al, cl, dl, bl, then ah, ch, dh, bh
+ BatchVector value = batch_load(group->registers[reg & 3]);
+ return reg < 4 ? batch_and(value, batch_set(0xFF)) : batch_shift_right8(value);
+}
+
+void batch_set_register(BatchGroup *group, U8 reg, bool w, BatchVector value, BatchVector mask)
+{
+ U16 *lanes = group->registers[w ? reg : reg & 3];
+ BatchVector old = batch_load(lanes);
+ if(!w && reg < 4)
+ {
+  value = batch_or(batch_and(old, batch_set(0xFF00)), batch_and(value, batch_set(0xFF)));
+ }
+ else if(!w)
+ {
+  value = batch_or(batch_and(old, batch_set(0x00FF)), batch_shift_left8(value));
+ }
+ batch_store(lanes, batch_select(mask, value, old));
+}
+
+BatchVector batch_load_memory(BatchGroup *group, U16 *address, U16 *mask, bool w)
+{
+ U16 values[BATCH_LANES] = {0};
+ for(int lane = 0; lane < BATCH_LANES; lane++)
+ {
+  if(mask[lane])
+  {
+   U8 *memory = group->memory[lane];
+   values[lane] = w ? (U16)(memory[address[lane]] | memory[(U16)(address[lane] + 1)] << 8) : memory[address[lane]];
+  }
+ }
+ return batch_load(values);
+}
+
+void batch_store_memory(Batch *batch, BatchGroup *group, U16 *address, U16 *mask, bool w, BatchVector value)
+{
+ U16 values[BATCH_LANES];
+ batch_store(values, value);
+ for(int lane = 0; lane < BATCH_LANES; lane++)
+ {
+  if(!mask[lane])
+  {
+   continue;
+  }
+  U8 *memory = group->memory[lane];
+  memory[address[lane]] = (U8)values[lane];
+  group->dirty[lane][address[lane] / SIM_PAGE_SIZE] = 1;
+  if(w)
+  {
+   memory[(U16)(address[lane] + 1)] = (U8)(values[lane] >> 8);
+   group->dirty[lane][(U16)(address[lane] + 1) / SIM_PAGE_SIZE] = 1;
+  }
+  if(address[lane] < batch->code_size)
+  {
+   group->state[lane] = BATCH_LEAVING;
+   group->running[lane] = 0;
+  }
+ }
+}
+
+void batch_record_flags(BatchGroup *group, U8 op, bool w, BatchVector a, BatchVector b, BatchVector result,
+                        BatchVector mask)
+{
+ batch_store(group->flag_op, batch_select(mask, batch_set((U16)(op | w << 8)), batch_load(group->flag_op)));
+ batch_store(group->flag_a, batch_select(mask, a, batch_load(group->flag_a)));
+ batch_store(group->flag_b, batch_select(mask, b, batch_load(group->flag_b)));
+ batch_store(group->flag_result, batch_select(mask, result, batch_load(group->flag_result)));
+}
+
+// Like sim_alu(): returns the value to store, cmp stores nothing.
+BatchVector batch_alu(BatchGroup *group, U8 mnemonic, BatchVector a, BatchVector b, bool w, BatchVector mask)
+{
+ switch(mnemonic)
+ {
+  case MNEMONIC_ADD:
+  {
+   BatchVector result = batch_add(a, b);
+   batch_record_flags(group, SIM_OP_ADD, w, a, b, result, mask);
+   return result;
+  }
+  case MNEMONIC_SUB:
+  case MNEMONIC_CMP:
+  {
+   BatchVector result = batch_sub(a, b);
+   batch_record_flags(group, SIM_OP_SUB, w, a, b, result, mask);
+   return result;
+  }
+ }
+ return b;
+}
+
+void batch_jump(BatchGroup *group, Instruction *inst, U16 *mask)
+{
+ for(int lane = 0; lane < BATCH_LANES; lane++)
+ {
+  if(!mask[lane])
+  {
+   continue;
+  }
+  LazyFlags last = batch_lazy_flags(group, lane);
+  U16 flags = group->flags[lane];
+  U16 *cx = &group->registers[1][lane];
+  bool taken = false;
+  switch(inst->mnemonic)
+  {
+   case MNEMONIC_LOOP:
+    taken = --*cx != 0;
+    break;
+   case MNEMONIC_LOOPZ:
+    taken = --*cx != 0 && sim_condition(&last, flags, MNEMONIC_JE);
+    break;
+   case MNEMONIC_LOOPNZ:
+    taken = --*cx != 0 && sim_condition(&last, flags, MNEMONIC_JNE);
+    break;
+   case MNEMONIC_JCXZ:
+    taken = *cx == 0;
+    break;
+   default:
+    taken = sim_condition(&last, flags, inst->mnemonic);
+    break;
+  }
+  if(taken)
+  {
+   group->ip[lane] = (U16)(group->ip[lane] + (S8)inst->displacement);
+  }
+ }
+}
+
+// Like sim_address(), for every lane.
+BatchVector batch_address(BatchGroup *group, Instruction *inst)
+{
+ if(inst->mod == 0x00 && inst->rm == 0x06)
+ {
+  return batch_set(inst->displacement);
+ }
+
+ // Same order as eac_table.
+ U8 first[8] = {3, 3, 5, 5, 6, 7, 5, 3};
+ U8 second[4] = {6, 7, 6, 7};
+ U16 displacement = inst->mod == 0x01 ? (U16)(S8)inst->displacement : inst->mod == 0x02 ? inst->displacement : 0;
+ BatchVector address = batch_add(batch_load(group->registers[first[inst->rm]]), batch_set(displacement));
+ if(inst->rm < 4)
+ {
+  address = batch_add(address, batch_load(group->registers[second[inst->rm]]));
+ }
+ return address;
+}
+
+// Runs inst for the lanes in mask, whose ip has already moved past it.
+void batch_execute(Batch *batch, BatchGroup *group, Instruction *inst, U16 *mask_lanes)
+{
+ BatchVector mask = batch_load(mask_lanes);
+ bool memory = inst->mod != 0x03 && (inst->form == FORM_REG_MEM || inst->form == FORM_IMMEDIATE_REG_MEM);
+ U16 address[BATCH_LANES];
+ if(memory)
+ {
+  batch_store(address, batch_address(group, inst));
+ }
+
+ switch(inst->form)
+ {
+  case FORM_REG_MEM:
+  {
+   BatchVector reg = batch_get_register(group, inst->reg, inst->w);
+   BatchVector rm = memory ? batch_load_memory(group, address, mask_lanes, inst->w)
+                           : batch_get_register(group, inst->rm, inst->w);
+   BatchVector value = inst->d ? batch_alu(group, inst->mnemonic, reg, rm, inst->w, mask)
+                               : batch_alu(group, inst->mnemonic, rm, reg, inst->w, mask);
+   if(inst->mnemonic == MNEMONIC_CMP)
+   {
+    break;
+   }
+   if(inst->d || !memory)
+   {
+    batch_set_register(group, inst->d ? inst->reg : inst->rm, inst->w, value, mask);
+   }
+   else
+   {
+    batch_store_memory(batch, group, address, mask_lanes, inst->w, value);
+   }
+   break;
+  }
+
+  case FORM_IMMEDIATE_REG_MEM:
+  {
+   // 0x83 sign-extends its byte immediate.
+   U16 data = inst->s && inst->w ? (U16)(S8)inst->data : inst->data;
+   BatchVector rm = memory ? batch_load_memory(group, address, mask_lanes, inst->w)
+                           : batch_get_register(group, inst->rm, inst->w);
+   BatchVector value = batch_alu(group, inst->mnemonic, rm, batch_set(data), inst->w, mask);
+   if(inst->mnemonic == MNEMONIC_CMP)
+   {
+    break;
+   }
+   if(memory)
+   {
+    batch_store_memory(batch, group, address, mask_lanes, inst->w, value);
+   }
+   else
+   {
+    batch_set_register(group, inst->rm, inst->w, value, mask);
+   }
+   break;
+  }
+
+  case FORM_IMMEDIATE_TO_REG:
+  {
+   batch_set_register(group, inst->reg, inst->w, batch_set(inst->data), mask);
+   break;
+  }
+
+  case FORM_IMMEDIATE_ACCUMULATOR:
+  {
+   BatchVector accumulator = batch_get_register(group, 0, inst->w);
+   BatchVector value = batch_alu(group, inst->mnemonic, accumulator, batch_set(inst->data), inst->w, mask);
+   if(inst->mnemonic != MNEMONIC_CMP)
+   {
+    batch_set_register(group, 0, inst->w, value, mask);
+   }
+   break;
+  }
+
+  case FORM_JUMP:
+  {
+   batch_jump(group, inst, mask_lanes);
+   break;
+  }
+ }
+}
+
+// Finishes the instance in lane on the scalar simulator and copies its
+// final state back.
+void batch_leave(Batch *batch, BatchGroup *group, int lane)
+{
+ Sim *sim = batch->scalar;
+ memset(sim, 0, sizeof(Sim));
+ for(int i = 0; i < 8; i++)
+ {
+  sim->registers[i] = group->registers[i][lane];
+ }
+ sim->ip = group->ip[lane];
+ sim->last = batch_lazy_flags(group, lane);
+ sim->flags = group->flags[lane];
+ sim->code_size = batch->code_size;
+ sim->limit = batch->limit;
+ sim->instructions = group->steps[lane];
+ memcpy(sim->memory, group->memory[lane], SIM_MEMORY_SIZE);
+ sim->memory[SIM_MEMORY_SIZE] = sim->memory[0];
+
+ bool decoded = sim_run(sim);
+ batch->scalar_instructions += sim->instructions - group->steps[lane];
+ batch->left++;
+ group->steps[lane] = sim->instructions;
+
+ for(int i = 0; i < 8; i++)
+ {
+  group->registers[i][lane] = sim->registers[i];
+ }
+ group->ip[lane] = sim->ip;
+ group->flag_op[lane] = SIM_OP_NONE;
+ group->flags[lane] = sim_flags(sim);
+ memcpy(group->memory[lane], sim->memory, SIM_MEMORY_SIZE); // For the error message
+ for(USIZE i = 0; i < SIM_PAGE_COUNT; i++)
+ {
+  group->dirty[lane][i] |= sim->dirty[i];
+ }
+ group->state[lane] = decoded ? BATCH_DONE : BATCH_ERROR;
+ group->running[lane] = 0;
+}
+
+// Runs one instruction for the lanes at the lowest ip. Returns false once
+// no lane is running.
+bool batch_step(Batch *batch, BatchGroup *group)
+{
+ U32 ip = SIM_MEMORY_SIZE; // None running
+ for(int lane = 0; lane < BATCH_LANES; lane++)
+ {
+  U32 lane_ip = group->running[lane] ? group->ip[lane] : SIM_MEMORY_SIZE;
+  ip = lane_ip < ip ? lane_ip : ip;
+ }
+ if(ip == SIM_MEMORY_SIZE)
+ {
+  return false;
+ }
+
+ U16 mask[BATCH_LANES];
+ U32 lanes = 0;
+ for(int lane = 0; lane < BATCH_LANES; lane++)
+ {
+  mask[lane] = group->running[lane] & (U16)-(group->ip[lane] == ip);
+  lanes += mask[lane] & 1;
+ }
+
+ Instruction *inst = &batch->cache[ip];
+ if(!batch->decoded[ip])
+ {
+  if(decode_instruction(batch->code, ip, inst) == DECODE_ERROR)
+  {
+   for(int lane = 0; lane < BATCH_LANES; lane++)
+   {
+    group->state[lane] = mask[lane] ? BATCH_ERROR : group->state[lane];
+    group->running[lane] &= (U16)~mask[lane];
+   }
+   return true;
+  }
+  batch->decoded[ip] = true;
+ }
+
+ BatchVector next = batch_set((U16)(ip + inst->length));
+ batch_store(group->ip, batch_select(batch_load(mask), next, batch_load(group->ip)));
+ for(int lane = 0; lane < BATCH_LANES; lane++)
+ {
+  group->steps[lane] += mask[lane] & 1;
+ }
+ batch->instructions += lanes;
+ batch->steps++;
+
+ batch_execute(batch, group, inst, mask);
+
+ for(int lane = 0; lane < BATCH_LANES; lane++)
+ {
+  if(!mask[lane])
+  {
+   continue;
+  }
+  if(group->state[lane] == BATCH_LEAVING)
+  {
+   batch_leave(batch, group, lane);
+  }
+  else if(group->ip[lane] >= batch->code_size || group->steps[lane] >= batch->limit)
+  {
+   group->state[lane] = BATCH_DONE;
+   group->running[lane] = 0;
+  }
+ }
+ return true;
+}
+
+void batch_print_lane(BatchGroup *group, int lane)
+{
+ printf("%zu:", group->instance[lane]);
+ for(int i = 0; i < 8; i++)
+ {
+  if(group->registers[i][lane])
+  {
+   printf(" %s=0x%04x", sim_register_names[i], group->registers[i][lane]);
+  }
+ }
+ printf(" ip=0x%04x", group->ip[lane]);
+
+ LazyFlags last = batch_lazy_flags(group, lane);
+ char text[8];
+ if(sim_flag_letters(last.op == SIM_OP_NONE ? group->flags[lane] : sim_compute_flags(&last), text))
+ {
+  printf(" flags=%s", text);
+ }
+ if(group->state[lane] == BATCH_ERROR)
+ {
+  // Told apart like run_simulate() does.
+  Instruction inst = {0};
+  decode_instruction(group->memory[lane], group->ip[lane], &inst);
+  if(inst.form == FORM_UNKNOWN_MNEMONIC)
+  {
+   printf(" error=unknown mnemonic for %u of opcode 0x%02X", inst.reg, group->memory[lane][group->ip[lane]]);
+  }
+  else
+  {
+   printf(" error=unknown opcode 0x%02X", group->memory[lane][group->ip[lane]]);
+  }
+ }
+ printf("\n");
+}
+
+// Reads one instance per line into a growing array of register files.
+// Returns the instance count, or -1 after printing an error.
+long batch_read_inputs(char *path, U16 (**inputs)[8])
+{
+ FILE *file = fopen(path, "r");
+ if(!file)
+ {
+  fprintf(stderr, "Error: Could not open %s: %s\n", path, strerror(errno));
+  return -1;
+ }
+
+ long count = 0;
+ long capacity = 0;
+ char line[BATCH_MAX_LINE];
+ for(int number = 1; fgets(line, sizeof(line), file); number++)
+ {
+  char *token = strtok(line, " \t\r\n");
+  if(!token || token[0] == '#')
+  {
+   continue;
+  }
+  if(count == capacity)
+  {
+   capacity = capacity ? capacity * 2 : 1024;
+   *inputs = realloc(*inputs, (USIZE)capacity * sizeof(**inputs));
+  }
+  U16 *registers = (*inputs)[count++];
+  memset(registers, 0, sizeof(**inputs));
+  for(; token; token = strtok(0, " \t\r\n"))
+  {
+   char *value = strchr(token, '=');
+   int reg = 8;
+   if(value)
+   {
+    *value++ = 0;
+    for(reg = 0; reg < 8 && strcmp(token, sim_register_names[reg]) != 0; reg++)
+    {
+    }
+   }
+   if(reg == 8)
+   {
+    fprintf(stderr, "Error: %s:%d: expected register=value, got \"%s\"\n", path, number, token);
+    fclose(file);
+    return -1;
+   }
+   registers[reg] = (U16)strtoul(value, 0, 0);
+  }
+ }
+ fclose(file);
+ return count;
+}
+
+// max_steps 0 runs every instance until IP leaves the code.
+int run_batch(U8 *bytes, USIZE size, char *inputs_path, U64 max_steps, bool output_stats)
+{
+ if(size > SIM_MEMORY_SIZE)
+ {
+  fprintf(stderr, "Error: %zu bytes of code do not fit the 64 KB segment\n", size);
+  return 1;
+ }
+
+ U16 (*inputs)[8] = 0;
+ long count = batch_read_inputs(inputs_path, &inputs);
+ if(count < 0)
+ {
+  free(inputs);
+  return 1;
+ }
+
+ Batch *batch = calloc(1, sizeof(Batch));
+ BatchGroup *group = calloc(1, sizeof(BatchGroup));
+ memset(group->dirty, 1, sizeof(group->dirty));
+ memcpy(batch->code, bytes, size);
+ batch->code_size = size;
+ batch->limit = max_steps ? max_steps : UINT64_MAX;
+ batch->scalar = malloc(sizeof(Sim));
+
+ int result = 0;
+ U64 start = now_ns();
+ for(long first = 0; first < count; first += BATCH_LANES)
+ {
+  memset(group, 0, offsetof(BatchGroup, dirty));
+  for(int lane = 0; lane < BATCH_LANES; lane++)
+  {
+   group->instance[lane] = (USIZE)(first + lane);
+   group->state[lane] = first + lane < count && size ? BATCH_RUNNING : BATCH_DONE;
+   group->running[lane] = group->state[lane] == BATCH_RUNNING ? 0xFFFF : 0;
+   if(first + lane < count)
+   {
+    for(int i = 0; i < 8; i++)
+    {
+     group->registers[i][lane] = inputs[first + lane][i];
+    }
+   }
+   batch->pages_copied += snapshot_reset_pages(group->memory[lane], group->dirty[lane], batch->code);
+  }
+
+  while(batch_step(batch, group))
+  {
+  }
+
+  for(int lane = 0; lane < BATCH_LANES && first + lane < count; lane++)
+  {
+   batch_print_lane(group, lane);
+   result |= group->state[lane] == BATCH_ERROR;
+  }
+ }
+ U64 batch_ns = now_ns() - start;
+
+ if(output_stats)
+ {
+  double seconds = (double)batch_ns / 1e9;
+  U64 instructions = batch->instructions + batch->scalar_instructions;
+  fprintf(stderr, "batch: %ld instances, %llu instructions, %.3f s, %.1f M instructions/s\n", count,
+          (unsigned long long)instructions, seconds, seconds > 0 ? (double)instructions / 1e6 / seconds : 0.0);
+  fprintf(stderr, "batch: %.2f of %d lanes per step, %zu instances left for the scalar simulator\n",
+          batch->steps ? (double)batch->instructions / (double)batch->steps : 0.0, BATCH_LANES, batch->left);
+  fprintf(stderr, "batch: %.1f of %d pages reset per instance\n",
+          count ? (double)batch->pages_copied / (double)count : 0.0, SIM_PAGE_COUNT);
+ }
+
+ free(batch->scalar);
+ free(group);
+ free(batch);
+ free(inputs);
+ return result;
+}
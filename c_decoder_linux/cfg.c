@@ -0,0 +1,292 @@
+// Recursive-traversal disassembly, selected with --cfg. Instead of sweeping
+// linearly from offset 0, decoding starts at the entry points (offset 0 and
+// any --entry <offset>) and follows the targets of the short jumps, so data
+// that no path reaches is never decoded as code. Included at the bottom of
+// main.c.
+//
+// Every jump this decoder knows (Jcc, LOOP*, JCXZ) is conditional, so a jump
+// ends its block with two successors: the target and the next instruction.
+//
+// Output is one line per basic block, in offset order:
+//
+//   <start> <size> <instruction count>: <successor start> ...
+//
+// Example: 0 12 4: 12 40
+//
+// State is four bitmaps of one bit per image byte plus a worklist that holds
+// each jump target at most once. Blocks are emitted while scanning the
+// bitmaps, so nothing is stored per block or per instruction.
+
+enum
+{
+ CFG_START, // First byte of a decoded instruction
+ CFG_COVERED, // Any byte of a decoded instruction
+ CFG_LEADER, // First instruction of a block, or a queued jump target
+ CFG_JUMP, // The instruction starting here is a jump
+ CFG_BITMAP_COUNT,
+};
+
+typedef struct
+{
+ U8 *bytes;
+ USIZE size;
+ U64 *bitmaps[CFG_BITMAP_COUNT];
+
+ USIZE *worklist;
+ USIZE worklist_count;
+ USIZE worklist_capacity;
+
+ // Stats
+ USIZE instructions;
+ USIZE blocks;
+ USIZE edges;
+ USIZE unresolved; // Targets outside the image, inside another instruction or undecodable
+ USIZE overlaps; // Paths that ran into the middle of a decoded instruction
+} Cfg;
+
+bool cfg_test(Cfg *cfg, int bitmap, USIZE pos)
+{
+ return (cfg->bitmaps[bitmap][pos / 64] >> (pos % 64)) & 1;
+}
+
+void cfg_set(Cfg *cfg, int bitmap, USIZE pos)
+{
+ cfg->bitmaps[bitmap][pos / 64] |= (U64)1 << (pos % 64);
+}
+
+void cfg_clear(Cfg *cfg, int bitmap, USIZE pos)
+{
+ cfg->bitmaps[bitmap][pos / 64] &= ~((U64)1 << (pos % 64));
+}
+
+// Queues a jump target. The leader bit doubles as the queued mark, so each
+// offset enters the worklist once.
+void cfg_push(Cfg *cfg, S64 target)
+{
+ if(target < 0 || (USIZE)target >= cfg->size)
+ {
+  cfg->unresolved++;
+  return;
+ }
+ if(cfg_test(cfg, CFG_LEADER, (USIZE)target))
+ {
+  return;
+ }
+ cfg_set(cfg, CFG_LEADER, (USIZE)target);
+
+ if(cfg->worklist_count == cfg->worklist_capacity)
+ {
+  cfg->worklist_capacity = cfg->worklist_capacity ? cfg->worklist_capacity * 2 : 1024;
+  cfg->worklist = realloc(cfg->worklist, cfg->worklist_capacity * sizeof(USIZE));
+ }
+ cfg->worklist[cfg->worklist_count++] = (USIZE)target;
+}
+
+bool cfg_covered(Cfg *cfg, USIZE pos, USIZE length)
+{
+ for(USIZE i = 0; i < length; i++)
+ {
+  if(cfg_test(cfg, CFG_COVERED, pos + i))
+  {
+   return true;
+  }
+ }
+ return false;
+}
+
+// Decodes straight-line code from pos until a jump, already decoded code,
+// or something undecodable. Each byte is decoded at most once.
+void cfg_trace(Cfg *cfg, USIZE pos)
+{
+ if(cfg_test(cfg, CFG_START, pos))
+ {
+  return;
+ }
+ if(cfg_test(cfg, CFG_COVERED, pos))
+ {
+  // Jump into the middle of an instruction.
+  cfg_clear(cfg, CFG_LEADER, pos);
+  cfg->unresolved++;
+  return;
+ }
+
+ USIZE start = pos;
+ Instruction inst;
+ while(pos < cfg->size)
+ {
+  if(cfg_test(cfg, CFG_START, pos))
+  {
+   // Falls into code decoded from another path, which splits its block.
+   cfg_set(cfg, CFG_LEADER, pos);
+   return;
+  }
+
+  // The tail padding keeps the opcode and ModRM reads in bounds.
+  USIZE length = instruction_length(cfg->bytes, pos);
+  if(length == 0 || pos + length > cfg->size)
+  {
+   break;
+  }
+  if(cfg_covered(cfg, pos, length))
+  {
+   cfg->overlaps++;
+   break;
+  }
+
+  if(decode_instruction(cfg->bytes, pos, &inst) == DECODE_ERROR)
+  {
+   break;
+  }
+
+  cfg_set(cfg, CFG_START, pos);
+  for(USIZE i = 0; i < length; i++)
+  {
+   cfg_set(cfg, CFG_COVERED, pos + i);
+  }
+  cfg->instructions++;
+
+  if(inst.form == FORM_JUMP)
+  {
+   cfg_set(cfg, CFG_JUMP, pos);
+   cfg_push(cfg, (S64)(pos + length) + (S8)inst.displacement);
+   cfg_push(cfg, (S64)(pos + length));
+   return;
+  }
+  pos += length;
+ }
+
+ if(pos == start)
+ {
+  // Nothing decodable at the target itself.
+  cfg_clear(cfg, CFG_LEADER, start);
+  cfg->unresolved++;
+ }
+}
+
+// End of the decoded instruction at pos. Instructions never overlap, so
+// it ends at the next instruction start or the first byte not decoded.
+USIZE cfg_instruction_end(Cfg *cfg, USIZE pos)
+{
+ USIZE end = pos + 1;
+ while(end < cfg->size && end - pos < MAX_INSTRUCTION_LENGTH &&
+       cfg_test(cfg, CFG_COVERED, end) && !cfg_test(cfg, CFG_START, end))
+ {
+  end++;
+ }
+ return end;
+}
+
+void cfg_emit_block(Cfg *cfg, Output *out, USIZE start, USIZE end, USIZE count, S64 *successors, int successor_count)
+{
+ char *line = output_reserve(out, MAX_LINE_LENGTH);
+ int length = sprintf(line, "%zu %zu %zu:", start, end - start, count);
+ for(int i = 0; i < successor_count; i++)
+ {
+  length += sprintf(line + length, " %lld", (long long)successors[i]);
+ }
+ line[length++] = '\n';
+ output_commit(out, (USIZE)length);
+
+ cfg->blocks++;
+ cfg->edges += (USIZE)successor_count;
+}
+
+// Walks the decoded instructions in offset order and emits the blocks.
+void cfg_emit(Cfg *cfg, Output *out)
+{
+ USIZE word_count = (cfg->size + 63) / 64;
+ bool open = false;
+ USIZE block_start = 0;
+ USIZE block_count = 0;
+
+ for(USIZE word = 0; word < word_count; word++)
+ {
+  U64 bits = cfg->bitmaps[CFG_START][word];
+  while(bits)
+  {
+   USIZE pos = word * 64 + (USIZE)__builtin_ctzll(bits);
+   bits &= bits - 1;
+
+   if(!open)
+   {
+    open = true;
+    block_start = pos;
+    block_count = 0;
+   }
+   block_count++;
+
+   USIZE end = cfg_instruction_end(cfg, pos);
+   S64 successors[2];
+   int successor_count = 0;
+
+   if(cfg_test(cfg, CFG_JUMP, pos))
+   {
+    S64 target = (S64)end + (S8)cfg->bytes[pos + 1];
+    if(target >= 0 && (USIZE)target < cfg->size && cfg_test(cfg, CFG_START, (USIZE)target))
+    {
+     successors[successor_count++] = target;
+    }
+    if(end < cfg->size && cfg_test(cfg, CFG_START, end) && (!successor_count || successors[0] != (S64)end))
+    {
+     successors[successor_count++] = (S64)end;
+    }
+   }
+   else if(end < cfg->size && cfg_test(cfg, CFG_START, end))
+   {
+    if(!cfg_test(cfg, CFG_LEADER, end))
+    {
+     // Straight-line code continues in this block.
+     continue;
+    }
+    successors[successor_count++] = (S64)end;
+   }
+
+   cfg_emit_block(cfg, out, block_start, end, block_count, successors, successor_count);
+   open = false;
+  }
+ }
+}
+
+int run_cfg(U8 *bytes, USIZE size, USIZE *entries, USIZE entry_count, bool output_stats)
+{
+ Cfg cfg = {0};
+ cfg.bytes = bytes;
+ cfg.size = size;
+ for(int i = 0; i < CFG_BITMAP_COUNT; i++)
+ {
+  cfg.bitmaps[i] = calloc((size + 63) / 64, sizeof(U64));
+ }
+
+ Output out;
+ if(!output_open(&out, STDOUT_FILENO))
+ {
+  return 1;
+ }
+
+ U64 start = now_ns();
+ for(USIZE i = 0; i < entry_count; i++)
+ {
+  cfg_push(&cfg, (S64)entries[i]);
+ }
+ while(cfg.worklist_count)
+ {
+  cfg_trace(&cfg, cfg.worklist[--cfg.worklist_count]);
+ }
+ U64 trace_ns = now_ns() - start;
+
+ cfg_emit(&cfg, &out);
+
+ if(output_stats)
+ {
+  fprintf(stderr, "cfg: %zu instructions, %zu blocks, %zu edges, %zu unresolved targets, %zu overlaps, %.3f s tracing\n",
+          cfg.instructions, cfg.blocks, cfg.edges, cfg.unresolved, cfg.overlaps, (double)trace_ns / 1e9);
+ }
+ output_close(&out, output_stats);
+
+ for(int i = 0; i < CFG_BITMAP_COUNT; i++)
+ {
+  free(cfg.bitmaps[i]);
+ }
+ free(cfg.worklist);
+ return 0;
+}
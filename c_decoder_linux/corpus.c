@@ -0,0 +1,308 @@
+// Columnar corpus and pattern queries, selected with --query "<terms>".
+// The image is decoded once into a structure of arrays, one column per
+// field, and the query scans only the columns it names, 16 rows per SSE2
+// compare. Matches are printed as "<offset> <instruction>". Included at the
+// bottom of main.c.
+//
+// A query is whitespace separated terms, all of which must hold:
+//
+//   <column>=<value> or <column>!=<value>
+//
+// Columns are mnemonic, form, mod, reg, rm, width, direction, displacement
+// and immediate. mnemonic takes a name, form one of reg_mem,
+// immediate_reg_mem, immediate_to_reg, accumulator and jump, the rest a
+// number.
+//
+// Example: every write to [bp + ...]
+//   --query "form=reg_mem direction=0 rm=6 mod!=0 mod!=3"
+// Example: every cmp with an immediate
+//   --query "mnemonic=cmp form!=reg_mem"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CORPUS_ROWS 16 // Rows per compare, one bit each in the match mask
+#define MAX_QUERY_TERMS 16
+
+enum
+{
+ // Byte columns
+ CORPUS_MNEMONIC,
+ CORPUS_FORM,
+ CORPUS_MOD,
+ CORPUS_REG,
+ CORPUS_RM,
+ CORPUS_WIDTH,
+ CORPUS_DIRECTION,
+ // Word columns
+ CORPUS_DISPLACEMENT,
+ CORPUS_IMMEDIATE,
+ CORPUS_COLUMN_COUNT,
+};
+
+char *corpus_column_names[CORPUS_COLUMN_COUNT] = {
+ "mnemonic", "form", "mod", "reg", "rm", "width", "direction", "displacement", "immediate",
+};
+
+char *corpus_form_names[] = {
+ [FORM_REG_MEM] = "reg_mem",
+ [FORM_IMMEDIATE_REG_MEM] = "immediate_reg_mem",
+ [FORM_IMMEDIATE_TO_REG] = "immediate_to_reg",
+ [FORM_IMMEDIATE_ACCUMULATOR] = "accumulator",
+ [FORM_JUMP] = "jump",
+};
+
+typedef struct
+{
+ // Indexed by column. Each column is padded to a multiple of CORPUS_ROWS
+ // and 16-byte aligned.
+ U8 *bytes[CORPUS_DISPLACEMENT];
+ U16 *words[CORPUS_COLUMN_COUNT];
+ USIZE *offset;
+ USIZE count;
+} Corpus;
+
+typedef struct
+{
+ U8 column;
+ bool not_equal;
+ U16 value;
+} QueryTerm;
+
+void *corpus_alloc_column(USIZE rows, USIZE element_size)
+{
+ USIZE size = ((rows * element_size + 63) / 64) * 64;
+ void *column = aligned_alloc(64, size);
+ memset(column, 0, size);
+ return column;
+}
+
+// Decodes linearly like main(), stopping at the first error or truncated
+// instruction.
+void corpus_build(Corpus *corpus, U8 *bytes, USIZE size)
+{
+ // Every instruction is at least 2 bytes.
+ USIZE capacity = (size / 2 + CORPUS_ROWS) / CORPUS_ROWS * CORPUS_ROWS;
+ for(int i = 0; i < CORPUS_DISPLACEMENT; i++)
+ {
+  corpus->bytes[i] = corpus_alloc_column(capacity, sizeof(U8));
+ }
+ for(int i = CORPUS_DISPLACEMENT; i < CORPUS_COLUMN_COUNT; i++)
+ {
+  corpus->words[i] = corpus_alloc_column(capacity, sizeof(U16));
+ }
+ corpus->offset = corpus_alloc_column(capacity, sizeof(USIZE));
+
+ Instruction inst;
+ USIZE count = 0;
+ USIZE pos = 0;
+ while(pos < size)
+ {
+  USIZE length = instruction_length(bytes, pos);
+  if(length == 0 || pos + length > size || decode_instruction(bytes, pos, &inst) == DECODE_ERROR)
+  {
+   break;
+  }
+
+  corpus->bytes[CORPUS_MNEMONIC][count] = inst.mnemonic;
+  corpus->bytes[CORPUS_FORM][count] = inst.form;
+  corpus->bytes[CORPUS_MOD][count] = inst.mod;
+  corpus->bytes[CORPUS_REG][count] = inst.reg;
+  corpus->bytes[CORPUS_RM][count] = inst.rm;
+  corpus->bytes[CORPUS_WIDTH][count] = inst.w;
+  corpus->bytes[CORPUS_DIRECTION][count] = inst.d;
+  corpus->words[CORPUS_DISPLACEMENT][count] = inst.displacement;
+  corpus->words[CORPUS_IMMEDIATE][count] = inst.data;
+  corpus->offset[count] = pos;
+  count++;
+  pos += inst.length;
+ }
+ corpus->count = count;
+}
+
+void corpus_free(Corpus *corpus)
+{
+ for(int i = 0; i < CORPUS_DISPLACEMENT; i++)
+ {
+  free(corpus->bytes[i]);
+ }
+ for(int i = CORPUS_DISPLACEMENT; i < CORPUS_COLUMN_COUNT; i++)
+ {
+  free(corpus->words[i]);
+ }
+ free(corpus->offset);
+}
+
+// Rebuilds the instruction at row for format_instruction().
+void corpus_instruction(Corpus *corpus, USIZE row, Instruction *inst)
+{
+ memset(inst, 0, sizeof(*inst));
+ inst->offset = corpus->offset[row];
+ inst->mnemonic = corpus->bytes[CORPUS_MNEMONIC][row];
+ inst->form = corpus->bytes[CORPUS_FORM][row];
+ inst->mod = corpus->bytes[CORPUS_MOD][row];
+ inst->reg = corpus->bytes[CORPUS_REG][row];
+ inst->rm = corpus->bytes[CORPUS_RM][row];
+ inst->w = corpus->bytes[CORPUS_WIDTH][row];
+ inst->d = corpus->bytes[CORPUS_DIRECTION][row];
+ inst->displacement = corpus->words[CORPUS_DISPLACEMENT][row];
+ inst->data = corpus->words[CORPUS_IMMEDIATE][row];
+}
+
+bool query_lookup(char **names, int count, char *name, U16 *value)
+{
+ for(int i = 0; i < count; i++)
+ {
+  if(names[i] && strcmp(names[i], name) == 0)
+  {
+   *value = (U16)i;
+   return true;
+  }
+ }
+ return false;
+}
+
+// Returns the number of terms, or -1 after printing what is wrong.
+int query_parse(char *text, QueryTerm *terms)
+{
+ char buffer[256];
+ snprintf(buffer, sizeof(buffer), "%s", text);
+
+ int count = 0;
+ for(char *term = strtok(buffer, " \t"); term; term = strtok(0, " \t"))
+ {
+  char *equals = strchr(term, '=');
+  if(!equals || equals == term || count == MAX_QUERY_TERMS)
+  {
+   fprintf(stderr, "Error: bad query term \"%s\"\n", term);
+   return -1;
+  }
+
+  QueryTerm *t = &terms[count++];
+  t->not_equal = equals[-1] == '!';
+  equals[t->not_equal ? -1 : 0] = 0;
+  char *value = equals + 1;
+
+  U16 column;
+  if(!query_lookup(corpus_column_names, CORPUS_COLUMN_COUNT, term, &column))
+  {
+   fprintf(stderr, "Error: unknown query column \"%s\"\n", term);
+   return -1;
+  }
+  t->column = (U8)column;
+
+  bool known = true;
+  if(column == CORPUS_MNEMONIC)
+  {
+   known = query_lookup(mnemonic_names, MNEMONIC_COUNT, value, &t->value);
+  }
+  else if(column == CORPUS_FORM)
+  {
+   known = query_lookup(corpus_form_names, sizeof(corpus_form_names) / sizeof(corpus_form_names[0]), value, &t->value);
+  }
+  else
+  {
+   char *end;
+   t->value = (U16)strtoul(value, &end, 0);
+   known = *value && !*end;
+  }
+  if(!known)
+  {
+   fprintf(stderr, "Error: bad value \"%s\" for %s\n", value, term);
+   return -1;
+  }
+ }
+ return count;
+}
+
+// Bit i set when the term holds for row base + i.
+U32 query_term_mask(Corpus *corpus, QueryTerm *term, USIZE base)
+{
+ U32 mask = 0;
+#ifdef __SSE2__
+ if(term->column < CORPUS_DISPLACEMENT)
+ {
+  __m128i rows = _mm_load_si128((__m128i *)(corpus->bytes[term->column] + base));
+  mask = (U32)_mm_movemask_epi8(_mm_cmpeq_epi8(rows, _mm_set1_epi8((char)term->value)));
+ }
+ else
+ {
+  U16 *column = corpus->words[term->column] + base;
+  __m128i value = _mm_set1_epi16((short)term->value);
+  __m128i low = _mm_cmpeq_epi16(_mm_load_si128((__m128i *)column), value);
+  __m128i high = _mm_cmpeq_epi16(_mm_load_si128((__m128i *)(column + 8)), value);
+  mask = (U32)_mm_movemask_epi8(_mm_packs_epi16(low, high));
+ }
+#else
+ for(USIZE i = 0; i < CORPUS_ROWS; i++)
+ {
+  U16 row = term->column < CORPUS_DISPLACEMENT ? corpus->bytes[term->column][base + i]
+                                                : corpus->words[term->column][base + i];
+  mask |= (U32)(row == term->value) << i;
+ }
+#endif
+ return term->not_equal ? ~mask & 0xFFFF : mask;
+}
+
+int run_query(U8 *bytes, USIZE size, char *query, bool output_stats)
+{
+ QueryTerm terms[MAX_QUERY_TERMS];
+ int term_count = query_parse(query, terms);
+ if(term_count < 0)
+ {
+  return 1;
+ }
+
+ Output out;
+ if(!output_open(&out, STDOUT_FILENO))
+ {
+  return 1;
+ }
+
+ U64 start = now_ns();
+ Corpus corpus;
+ corpus_build(&corpus, bytes, size);
+ U64 build_ns = now_ns() - start;
+
+ start = now_ns();
+ USIZE matches = 0;
+ Instruction inst;
+ for(USIZE base = 0; base < corpus.count; base += CORPUS_ROWS)
+ {
+  U32 mask = 0xFFFF;
+  for(int i = 0; i < term_count && mask; i++)
+  {
+   mask &= query_term_mask(&corpus, &terms[i], base);
+  }
+  if(corpus.count - base < CORPUS_ROWS)
+  {
+   // Padding rows past the end.
+   mask &= (1u << (corpus.count - base)) - 1;
+  }
+
+  while(mask)
+  {
+   USIZE row = base + (USIZE)__builtin_ctz(mask);
+   mask &= mask - 1;
+   matches++;
+
+   corpus_instruction(&corpus, row, &inst);
+   char *line = output_reserve(&out, MAX_LINE_LENGTH + 24);
+   int length = sprintf(line, "%zu ", inst.offset);
+   output_commit(&out, (USIZE)length + format_instruction(&inst, line + length));
+  }
+ }
+ U64 query_ns = now_ns() - start;
+
+ if(output_stats)
+ {
+  double seconds = (double)query_ns / 1e9;
+  fprintf(stderr, "query: %zu instructions, %zu matches, %.3f s building, %.3f s querying, %.1f M rows/s\n",
+          corpus.count, matches, (double)build_ns / 1e9, seconds,
+          seconds > 0 ? (double)corpus.count / 1e6 / seconds : 0.0);
+ }
+ output_close(&out, output_stats);
+ corpus_free(&corpus);
+ return 0;
+}
@@ -0,0 +1,161 @@
+// Encoder, the inverse of decode_instruction(): writes back the bytes an
+// Instruction was decoded from. Every opcode bit the decoder looks at is
+// kept in the Instruction, so any instruction that decodes re-encodes to
+// the same bytes; --verify (verify.c) checks exactly that. Included at the
+// bottom of main.c.
+//
+// The round trip shows that decoding loses nothing, not that it is right;
+// --enumerate (enumerate.c) checks the decoder against the 8086 manual.
+
+#define ENCODE_ERROR 0
+
+// Writes the low size bytes of value, little-endian. Returns the new
+// position.
+USIZE encode_value(U8 *out, USIZE n, U16 value, USIZE size)
+{
+ out[n++] = (U8)value;
+ if(size == 2)
+ {
+  out[n++] = (U8)(value >> 8);
+ }
+ return n;
+}
+
+U8 encode_modrm(Instruction *inst)
+{
+ return (U8)(inst->mod << 6 | inst->reg << 3 | inst->rm);
+}
+
+// Opcode bits above d/w for common_displacement(), above w for
+// immediate_accumulator(), or the whole opcode for short_jump(). Returns
+// false for a mnemonic the form has no opcode for.
+bool encode_opcode(Instruction *inst, U8 *opcode)
+{
+ if(inst->form == FORM_REG_MEM)
+ {
+  switch(inst->mnemonic)
+  {
+   case MNEMONIC_MOV: *opcode = (U8)(MOV_REG_MEM_TO_FROM_REG << 2); return true;
+   case MNEMONIC_ADD: *opcode = (U8)(ADD_REG_MEM_WITH_REGISTER_TO_EITHER << 2); return true;
+   case MNEMONIC_SUB: *opcode = (U8)(SUB_REG_MEM_WITH_REGISTER_TO_EITHER << 2); return true;
+   case MNEMONIC_CMP: *opcode = (U8)(CMP_REG_MEM_WITH_REGISTER_TO_EITHER << 2); return true;
+  }
+  return false;
+ }
+
+ if(inst->form == FORM_IMMEDIATE_ACCUMULATOR)
+ {
+  switch(inst->mnemonic)
+  {
+   case MNEMONIC_ADD: *opcode = (U8)(ADD_IMMEDIATE_TO_ACCUMULATOR << 1); return true;
+   case MNEMONIC_SUB: *opcode = (U8)(SUB_IMMEDIATE_FROM_ACCUMULATOR << 1); return true;
+   case MNEMONIC_CMP: *opcode = (U8)(CMP_IMMEDIATE_WITH_ACCUMULATOR << 1); return true;
+  }
+  return false;
+ }
+
+ switch(inst->mnemonic)
+ {
+  case MNEMONIC_JNE: *opcode = JNE; return true;
+  case MNEMONIC_JE: *opcode = JE; return true;
+  case MNEMONIC_JL: *opcode = JL; return true;
+  case MNEMONIC_JLE: *opcode = JLE; return true;
+  case MNEMONIC_JB: *opcode = JB; return true;
+  case MNEMONIC_JBE: *opcode = JBE; return true;
+  case MNEMONIC_JP: *opcode = JP; return true;
+  case MNEMONIC_JO: *opcode = JO; return true;
+  case MNEMONIC_JS: *opcode = JS; return true;
+  case MNEMONIC_JNL: *opcode = JNL; return true;
+  case MNEMONIC_JG: *opcode = JG; return true;
+  case MNEMONIC_JNB: *opcode = JNB; return true;
+  case MNEMONIC_JA: *opcode = JA; return true;
+  case MNEMONIC_JNP: *opcode = JNP; return true;
+  case MNEMONIC_JNO: *opcode = JNO; return true;
+  case MNEMONIC_JNS: *opcode = JNS; return true;
+  case MNEMONIC_LOOP: *opcode = LOOP; return true;
+  case MNEMONIC_LOOPZ: *opcode = LOOPZ; return true;
+  case MNEMONIC_LOOPNZ: *opcode = LOOPNZ; return true;
+  case MNEMONIC_JCXZ: *opcode = JCXZ; return true;
+ }
+ return false;
+}
+
+// Writes at most MAX_INSTRUCTION_LENGTH bytes. Returns how many, or
+// ENCODE_ERROR for the error forms and impossible field combinations.
+USIZE encode_instruction(Instruction *inst, U8 *out)
+{
+ U8 opcode = 0;
+ USIZE n = 0;
+ bool direct = inst->mod == 0x00 && inst->rm == 0x06;
+
+ switch(inst->form)
+ {
+  case FORM_REG_MEM:
+  {
+   if(!encode_opcode(inst, &opcode))
+   {
+    return ENCODE_ERROR;
+   }
+   out[n++] = (U8)(opcode | inst->d << 1 | inst->w);
+   out[n++] = encode_modrm(inst);
+   if(direct || inst->mod == 0x02)
+   {
+    n = encode_value(out, n, inst->displacement, 2);
+   }
+   else if(inst->mod == 0x01)
+   {
+    n = encode_value(out, n, inst->displacement, 1);
+   }
+   return n;
+  }
+
+  case FORM_IMMEDIATE_REG_MEM:
+  {
+   // The reg field selects the mnemonic, see common_immediate().
+   out[n++] = (U8)(COMMON_IMMEDIATE_REG_MEM << 2 | inst->s << 1 | inst->w);
+   out[n++] = encode_modrm(inst);
+   if(direct || inst->mod == 0x02)
+   {
+    n = encode_value(out, n, inst->displacement, 2);
+   }
+   else if(inst->mod == 0x01)
+   {
+    n = encode_value(out, n, inst->displacement, 1);
+   }
+   return encode_value(out, n, inst->data, !inst->s && inst->w ? 2 : 1);
+  }
+
+  case FORM_IMMEDIATE_TO_REG:
+  {
+   out[n++] = (U8)(MOV_IMMEDIATE_TO_REG << 4 | inst->w << 3 | inst->reg);
+   return encode_value(out, n, inst->data, inst->w ? 2 : 1);
+  }
+
+  case FORM_IMMEDIATE_ACCUMULATOR:
+  {
+   if(!encode_opcode(inst, &opcode))
+   {
+    return ENCODE_ERROR;
+   }
+   out[n++] = (U8)(opcode | inst->w);
+   return encode_value(out, n, inst->data, inst->w ? 2 : 1);
+  }
+
+  case FORM_JUMP:
+  {
+   if(!encode_opcode(inst, &opcode))
+   {
+    return ENCODE_ERROR;
+   }
+   out[n++] = opcode;
+   return encode_value(out, n, inst->displacement, 1);
+  }
+
+  case FORM_DATA_BYTE:
+  {
+   out[n++] = (U8)inst->data;
+   return n;
+  }
+ }
+ return ENCODE_ERROR;
+}
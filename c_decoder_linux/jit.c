@@ -0,0 +1,807 @@
+// Translator from 8086 basic blocks to x86-64, selected with --simulate
+// --jit. Included at the bottom of main.c, after sim.c.
+//
+// The dispatcher interprets with sim_step() until a block start has been
+// reached --jit-threshold times, then translates the block: the
+// instructions up to and including the next jump, decoded with
+// decode_instruction(). Translated code works on the Sim itself, rdi holds
+// its address, so interpreter and translated code hand over at any block
+// boundary.
+//
+// mov, add, sub and cmp are translated to the x86-64 instructions with the
+// same opcodes, so the host computes the 8086 flags. They stay in the host
+// flags within a block and are stored to sim->flags when it exits; a
+// conditional jump in a block that wrote no flags loads them first.
+//
+// An exit to a translated block jumps straight to it (chaining). An exit to
+// a block that is not translated yet returns to the dispatcher until the
+// block is, then gets patched. Every block checks the step limit on entry.
+//
+// A store into the loaded code, or a word store at 0xFFFF, leaves the block
+// before the instruction so the interpreter runs it. A store into the code
+// from the interpreter drops the blocks it overlaps and unlinks the exits
+// that chained to them. Translated stores set the dirty bytes of their pages
+// like sim_store(), for snapshot.c. loopz, loopnz and jcxz are not
+// translated: a block ends before them.
+//
+// No page of the buffer is writable and executable at once. It is a memfd
+// mapped twice: blocks are emitted and patched through the read-write
+// view, and called through the read-execute one at the same offsets. All
+// jumps in the buffer are relative, so code runs unchanged from either
+// view.
+//
+// Example: --simulate --jit --output-stats loop.bin
+
+#include <stddef.h>
+
+#define JIT_BUFFER_SIZE (16 * 1024 * 1024)
+#define JIT_MAX_BLOCK_INSTRUCTIONS 64
+
+// Upper bound of the host code for one instruction, its exits included. The
+// largest is a word add, sub or mov to [bx + si] style memory with the flags
+// in the host: jit_address() 24 bytes, jit_check_store() with pushfq 26,
+// jit_alu() with jit_mark_dirty() 49, and two JIT_SAVE_STACK exits of 38.
+#define JIT_MAX_INSTRUCTION_CODE (24 + 26 + 49 + 2 * 38)
+
+// The step limit check on entry is 26 bytes, the fall-through exit of a
+// block that does not end in a jump 44.
+#define JIT_MAX_BLOCK_CODE (JIT_MAX_BLOCK_INSTRUCTIONS * JIT_MAX_INSTRUCTION_CODE + 26 + 44)
+
+#define JIT_FLAGS_MASK (SIM_FLAG_CF | SIM_FLAG_PF | SIM_FLAG_AF | SIM_FLAG_ZF | SIM_FLAG_SF | SIM_FLAG_OF)
+
+// Offset of the ret every unlinked exit jumps to.
+#define JIT_RETURN 0
+
+// Host condition codes, the low nibble of jcc.
+#define JIT_BELOW 0x2
+#define JIT_EQUAL 0x4
+#define JIT_NOT_EQUAL 0x5
+#define JIT_ABOVE 0x7
+#define JIT_ALWAYS 0xFF
+
+// Where the 8086 flags are when a block exits.
+enum
+{
+ JIT_SAVE_NONE, // In sim->flags already
+ JIT_SAVE_HOST, // In the host flags
+ JIT_SAVE_STACK, // Pushed with pushfq
+};
+
+// An exit of the block being translated, emitted after its last
+// instruction.
+typedef struct
+{
+ U32 site; // Offset of the rel32 that jumps to the exit
+ U16 ip;
+ U8 count; // Instructions run before leaving
+ U8 save;
+ bool link; // Chain to the block at ip
+} JitExit;
+
+// A jmp at the end of an exit that chains to the block at target once it
+// is translated.
+typedef struct
+{
+ U32 site; // Offset of the jmp's rel32
+ U16 owner; // Block the exit belongs to
+ U16 target;
+} JitLink;
+
+// Memory operand: [rdi + disp], or [rdi + rcx + disp] for 8086 memory with
+// the address in ecx.
+typedef struct
+{
+ bool memory;
+ U32 disp;
+} JitOperand;
+
+typedef void (*JitBlock)(Sim *sim);
+
+typedef struct
+{
+ Sim *sim;
+ U8 *code; // Writable view of the buffer
+ U8 *run; // Executable view of the same memory
+ USIZE used;
+
+ U32 entry[SIM_MEMORY_SIZE]; // Code offset of the block at each ip, 0 if none
+ U32 end[SIM_MEMORY_SIZE]; // One past the block's last 8086 byte
+ U8 length[SIM_MEMORY_SIZE]; // Instructions in the block
+ U32 hits[SIM_MEMORY_SIZE];
+ bool untranslatable[SIM_MEMORY_SIZE];
+
+ U16 starts[SIM_MEMORY_SIZE]; // Every translated block
+ USIZE block_count;
+
+ JitLink *links;
+ USIZE link_count;
+ USIZE link_capacity;
+
+ JitExit exits[2 * JIT_MAX_BLOCK_INSTRUCTIONS + 2];
+ USIZE exit_count;
+
+ U64 translated;
+ U64 invalidated;
+ U64 flushes;
+ U64 interpreted;
+} Jit;
+
+void jit_u8(Jit *jit, U8 value)
+{
+ jit->code[jit->used++] = value;
+}
+
+void jit_u16(Jit *jit, U16 value)
+{
+ memcpy(jit->code + jit->used, &value, sizeof(value));
+ jit->used += sizeof(value);
+}
+
+void jit_u32(Jit *jit, U32 value)
+{
+ memcpy(jit->code + jit->used, &value, sizeof(value));
+ jit->used += sizeof(value);
+}
+
+void jit_bytes(Jit *jit, U8 *bytes, USIZE count)
+{
+ memcpy(jit->code + jit->used, bytes, count);
+ jit->used += count;
+}
+
+// Points the rel32 at site to target.
+void jit_patch(Jit *jit, U32 site, USIZE target)
+{
+ S32 relative = (S32)((S64)target - (S64)(site + 4));
+ memcpy(jit->code + site, &relative, sizeof(relative));
+}
+
+// Operand size prefix for word operations.
+void jit_prefix(Jit *jit, bool w)
+{
+ if(w)
+ {
+  jit_u8(jit, 0x66);
+ }
+}
+
+// ModRM, SIB and disp32 for operand with reg in the reg field.
+void jit_operand(Jit *jit, U8 reg, JitOperand operand)
+{
+ if(operand.memory)
+ {
+  jit_u8(jit, (U8)(0x84 | reg << 3));
+  jit_u8(jit, 0x0F); // rdi + rcx
+ }
+ else
+ {
+  jit_u8(jit, (U8)(0x87 | reg << 3));
+ }
+ jit_u32(jit, operand.disp);
+}
+
+JitOperand jit_sim_field(USIZE offset)
+{
+ return (JitOperand){false, (U32)offset};
+}
+
+JitOperand jit_register(U8 reg, bool w)
+{
+ // al, cl, dl, bl are the low bytes of ax, cx, dx, bx; ah to bh the high.
+ U32 byte = w || reg < 4 ? reg * 2u : (reg - 4u) * 2u + 1u;
+ return jit_sim_field(offsetof(Sim, registers) + byte);
+}
+
+JitOperand jit_rm(Instruction *inst)
+{
+ if(inst->mod == 0x03)
+ {
+  return jit_register(inst->rm, inst->w);
+ }
+ return (JitOperand){true, (U32)offsetof(Sim, memory)};
+}
+
+// ecx = the 16-bit effective address, without touching the host flags.
+void jit_address(Jit *jit, Instruction *inst)
+{
+ if(inst->mod == 0x00 && inst->rm == 0x06)
+ {
+  jit_u8(jit, 0xB9); // mov ecx, imm32
+  jit_u32(jit, inst->displacement);
+  return;
+ }
+
+ // Same order as eac_table.
+ U8 first[8] = {3, 3, 5, 5, 6, 7, 5, 3};
+ U8 second[4] = {6, 7, 6, 7};
+ U16 displacement = inst->mod == 0x01 ? (U16)(S8)inst->displacement : inst->mod == 0x02 ? inst->displacement : 0;
+
+ jit_bytes(jit, (U8[]){0x0F, 0xB7}, 2); // movzx ecx, word [first]
+ jit_operand(jit, 1, jit_register(first[inst->rm], true));
+ if(inst->rm < 4)
+ {
+  jit_bytes(jit, (U8[]){0x0F, 0xB7}, 2); // movzx eax, word [second]
+  jit_operand(jit, 0, jit_register(second[inst->rm], true));
+  jit_bytes(jit, (U8[]){0x8D, 0x8C, 0x01}, 3); // lea ecx, [rcx + rax + disp32]
+  jit_u32(jit, displacement);
+ }
+ else if(displacement)
+ {
+  jit_bytes(jit, (U8[]){0x8D, 0x89}, 2); // lea ecx, [rcx + disp32]
+  jit_u32(jit, displacement);
+ }
+ else
+ {
+  return;
+ }
+ jit_bytes(jit, (U8[]){0x0F, 0xB7, 0xC9}, 3); // movzx ecx, cx
+}
+
+// Emits a jcc with the host condition, or a jmp for JIT_ALWAYS, to an exit
+// that jit_emit_exits() places after the block.
+void jit_exit(Jit *jit, U8 condition, U16 ip, USIZE count, U8 save, bool link)
+{
+ if(condition == JIT_ALWAYS)
+ {
+  jit_u8(jit, 0xE9);
+ }
+ else
+ {
+  jit_bytes(jit, (U8[]){0x0F, (U8)(0x80 | condition)}, 2);
+ }
+ jit->exits[jit->exit_count++] = (JitExit){(U32)jit->used, ip, (U8)count, save, link};
+ jit_u32(jit, 0);
+}
+
+// Leaves the block before the instruction at ip when the store address in
+// ecx is in the code, or is 0xFFFF for a word. The interpreter runs it.
+void jit_check_store(Jit *jit, bool w, U16 ip, USIZE count, bool host_flags)
+{
+ U8 save = host_flags ? JIT_SAVE_STACK : JIT_SAVE_NONE;
+ if(host_flags)
+ {
+  jit_u8(jit, 0x9C); // pushfq
+ }
+ jit_bytes(jit, (U8[]){0x81, 0xF9}, 2); // cmp ecx, imm32
+ jit_u32(jit, (U32)jit->sim->code_size);
+ jit_exit(jit, JIT_BELOW, ip, count, save, false);
+ if(w)
+ {
+  jit_bytes(jit, (U8[]){0x81, 0xF9}, 2);
+  jit_u32(jit, 0xFFFF);
+  jit_exit(jit, JIT_EQUAL, ip, count, save, false);
+ }
+ if(host_flags)
+ {
+  jit_u8(jit, 0x9D); // popfq
+ }
+}
+
+// Sets the dirty bytes of the pages written by a store to ecx, without
+// touching the host flags. A word store never wraps, see jit_check_store().
+void jit_mark_dirty(Jit *jit, bool w)
+{
+ jit_bytes(jit, (U8[]){0x0F, 0xB6, 0xC5}, 3); // movzx eax, ch
+ jit_bytes(jit, (U8[]){0xC6, 0x84, 0x07}, 3); // mov byte [rdi + rax + disp32], 1
+ jit_u32(jit, (U32)offsetof(Sim, dirty));
+ jit_u8(jit, 1);
+ if(w)
+ {
+  jit_bytes(jit, (U8[]){0x8D, 0x41, 0x01}, 3); // lea eax, [rcx + 1]
+  jit_bytes(jit, (U8[]){0x0F, 0xB6, 0xC4}, 3); // movzx eax, ah
+  jit_bytes(jit, (U8[]){0xC6, 0x84, 0x07}, 3);
+  jit_u32(jit, (U32)offsetof(Sim, dirty));
+  jit_u8(jit, 1);
+ }
+}
+
+// Stores the host flags to sim->flags.
+void jit_save_flags(Jit *jit, bool pushed)
+{
+ if(!pushed)
+ {
+  jit_u8(jit, 0x9C); // pushfq
+ }
+ jit_u8(jit, 0x58); // pop rax
+ jit_u8(jit, 0x25); // and eax, imm32
+ jit_u32(jit, JIT_FLAGS_MASK);
+ jit_u8(jit, 0x66); // mov [flags], ax
+ jit_u8(jit, 0x89);
+ jit_operand(jit, 0, jit_sim_field(offsetof(Sim, flags)));
+}
+
+// destination op= source through al or ax. 8086 and x86-64 share these
+// opcodes, so the one the encoder would write is the host one.
+void jit_alu(Jit *jit, U8 mnemonic, JitOperand destination, JitOperand source, bool w)
+{
+ U8 opcode = 0;
+ encode_opcode(&(Instruction){.form = FORM_REG_MEM, .mnemonic = mnemonic}, &opcode);
+ if(mnemonic != MNEMONIC_MOV)
+ {
+  jit_prefix(jit, w);
+  jit_u8(jit, (U8)(0x8A | w)); // mov al/ax, destination
+  jit_operand(jit, 0, destination);
+ }
+ jit_prefix(jit, w);
+ jit_u8(jit, (U8)(opcode | 0x02 | w)); // op al/ax, source
+ jit_operand(jit, 0, source);
+ if(mnemonic != MNEMONIC_CMP)
+ {
+  jit_prefix(jit, w);
+  jit_u8(jit, (U8)(0x88 | w)); // mov destination, al/ax
+  jit_operand(jit, 0, destination);
+  if(destination.memory)
+  {
+   jit_mark_dirty(jit, w);
+  }
+ }
+}
+
+void jit_alu_immediate(Jit *jit, U8 mnemonic, JitOperand destination, U16 data, bool w)
+{
+ U8 opcode = 0;
+ encode_opcode(&(Instruction){.form = FORM_IMMEDIATE_ACCUMULATOR, .mnemonic = mnemonic}, &opcode);
+ jit_prefix(jit, w);
+ jit_u8(jit, (U8)(0x8A | w)); // mov al/ax, destination
+ jit_operand(jit, 0, destination);
+ jit_prefix(jit, w);
+ jit_u8(jit, (U8)(opcode | w)); // op al/ax, imm
+ if(w)
+ {
+  jit_u16(jit, data);
+ }
+ else
+ {
+  jit_u8(jit, (U8)data);
+ }
+ if(mnemonic != MNEMONIC_CMP)
+ {
+  jit_prefix(jit, w);
+  jit_u8(jit, (U8)(0x88 | w)); // mov destination, al/ax
+  jit_operand(jit, 0, destination);
+  if(destination.memory)
+  {
+   jit_mark_dirty(jit, w);
+  }
+ }
+}
+
+bool jit_supported(Instruction *inst)
+{
+ switch(inst->form)
+ {
+  case FORM_REG_MEM:
+  case FORM_IMMEDIATE_REG_MEM:
+  case FORM_IMMEDIATE_TO_REG:
+  case FORM_IMMEDIATE_ACCUMULATOR:
+   return true;
+  case FORM_JUMP:
+   return inst->mnemonic != MNEMONIC_LOOPZ && inst->mnemonic != MNEMONIC_LOOPNZ && inst->mnemonic != MNEMONIC_JCXZ;
+ }
+ return false;
+}
+
+// Translates one instruction other than a jump. count is the number of
+// instructions of the block before it. Returns whether the host flags hold
+// the 8086 flags afterwards.
+bool jit_instruction(Jit *jit, Instruction *inst, USIZE count, bool host_flags)
+{
+ U16 ip = (U16)inst->offset;
+ switch(inst->form)
+ {
+  case FORM_REG_MEM:
+  {
+   JitOperand reg = jit_register(inst->reg, inst->w);
+   JitOperand rm = jit_rm(inst);
+   if(rm.memory)
+   {
+    jit_address(jit, inst);
+   }
+   if(inst->d)
+   {
+    jit_alu(jit, inst->mnemonic, reg, rm, inst->w);
+   }
+   else
+   {
+    if(rm.memory && inst->mnemonic != MNEMONIC_CMP)
+    {
+     jit_check_store(jit, inst->w, ip, count, host_flags);
+    }
+    jit_alu(jit, inst->mnemonic, rm, reg, inst->w);
+   }
+   return host_flags || inst->mnemonic != MNEMONIC_MOV;
+  }
+
+  case FORM_IMMEDIATE_REG_MEM:
+  {
+   JitOperand rm = jit_rm(inst);
+   if(rm.memory)
+   {
+    jit_address(jit, inst);
+    if(inst->mnemonic != MNEMONIC_CMP)
+    {
+     jit_check_store(jit, inst->w, ip, count, host_flags);
+    }
+   }
+   // 0x83 sign-extends its byte immediate.
+   U16 data = inst->s && inst->w ? (U16)(S8)inst->data : inst->data;
+   jit_alu_immediate(jit, inst->mnemonic, rm, data, inst->w);
+   return true;
+  }
+
+  case FORM_IMMEDIATE_TO_REG:
+  {
+   jit_prefix(jit, inst->w);
+   jit_u8(jit, (U8)(0xC6 | inst->w)); // mov reg, imm
+   jit_operand(jit, 0, jit_register(inst->reg, inst->w));
+   if(inst->w)
+   {
+    jit_u16(jit, inst->data);
+   }
+   else
+   {
+    jit_u8(jit, (U8)inst->data);
+   }
+   return host_flags;
+  }
+
+  case FORM_IMMEDIATE_ACCUMULATOR:
+  {
+   jit_alu_immediate(jit, inst->mnemonic, jit_register(0, inst->w), inst->data, inst->w);
+   return true;
+  }
+ }
+ return host_flags;
+}
+
+// Translates the jump that ends a block of count instructions.
+void jit_jump(Jit *jit, Instruction *inst, USIZE count, bool host_flags)
+{
+ U16 next = (U16)(inst->offset + inst->length);
+ U16 target = (U16)(next + (S8)inst->displacement);
+ if(inst->mnemonic == MNEMONIC_LOOP)
+ {
+  // loop leaves the flags alone, dec would not.
+  if(host_flags)
+  {
+   jit_save_flags(jit, false);
+  }
+  jit_bytes(jit, (U8[]){0x66, 0x83}, 2); // sub word [cx], 1
+  jit_operand(jit, 5, jit_register(1, true));
+  jit_u8(jit, 1);
+  jit_exit(jit, JIT_NOT_EQUAL, target, count, JIT_SAVE_NONE, true);
+  jit_exit(jit, JIT_ALWAYS, next, count, JIT_SAVE_NONE, true);
+  return;
+ }
+
+ if(!host_flags)
+ {
+  jit_bytes(jit, (U8[]){0x0F, 0xB7}, 2); // movzx eax, word [flags]
+  jit_operand(jit, 0, jit_sim_field(offsetof(Sim, flags)));
+  jit_u8(jit, 0x50); // push rax
+  jit_u8(jit, 0x9D); // popfq
+ }
+ // The 8086 conditions have the host's condition codes.
+ U8 opcode = 0;
+ encode_opcode(inst, &opcode);
+ U8 save = host_flags ? JIT_SAVE_HOST : JIT_SAVE_NONE;
+ jit_exit(jit, opcode & 0x0F, target, count, save, true);
+ jit_exit(jit, JIT_ALWAYS, next, count, save, true);
+}
+
+// Points the jmp at site to the block at target, or back to the
+// dispatcher.
+void jit_link(Jit *jit, U32 site, U16 owner, U16 target)
+{
+ if(jit->link_count == jit->link_capacity)
+ {
+  jit->link_capacity = jit->link_capacity ? jit->link_capacity * 2 : 256;
+  jit->links = realloc(jit->links, jit->link_capacity * sizeof(JitLink));
+ }
+ jit->links[jit->link_count++] = (JitLink){site, owner, target};
+ jit_patch(jit, site, jit->entry[target]);
+}
+
+// Emits the exits of the block at start: store the flags, count the
+// instructions, set ip and return or chain.
+void jit_emit_exits(Jit *jit, U16 start)
+{
+ for(USIZE i = 0; i < jit->exit_count; i++)
+ {
+  JitExit *pending = &jit->exits[i];
+  jit_patch(jit, pending->site, jit->used);
+  if(pending->save != JIT_SAVE_NONE)
+  {
+   jit_save_flags(jit, pending->save == JIT_SAVE_STACK);
+  }
+  if(pending->count)
+  {
+   jit_bytes(jit, (U8[]){0x48, 0x81}, 2); // add qword [instructions], imm32
+   jit_operand(jit, 0, jit_sim_field(offsetof(Sim, instructions)));
+   jit_u32(jit, pending->count);
+  }
+  jit_u8(jit, 0x66); // mov word [ip], imm16
+  jit_u8(jit, 0xC7);
+  jit_operand(jit, 0, jit_sim_field(offsetof(Sim, ip)));
+  jit_u16(jit, pending->ip);
+  jit_u8(jit, 0xE9); // jmp
+  U32 site = (U32)jit->used;
+  jit_u32(jit, 0);
+  if(pending->link && pending->ip < jit->sim->code_size)
+  {
+   jit_link(jit, site, start, pending->ip);
+  }
+  else
+  {
+   jit_patch(jit, site, JIT_RETURN);
+  }
+ }
+}
+
+// Drops every block, when the buffer is full.
+void jit_flush(Jit *jit)
+{
+ for(USIZE i = 0; i < jit->block_count; i++)
+ {
+  jit->entry[jit->starts[i]] = 0;
+ }
+ jit->block_count = 0;
+ jit->link_count = 0;
+ jit->used = JIT_RETURN + 1;
+ jit->flushes++;
+}
+
+// Translates the block at start, or marks it untranslatable when its first
+// instruction is not supported.
+void jit_translate(Jit *jit, U16 start)
+{
+ Sim *sim = jit->sim;
+ Instruction insts[JIT_MAX_BLOCK_INSTRUCTIONS];
+ USIZE count = 0;
+ USIZE pos = start;
+ while(count < JIT_MAX_BLOCK_INSTRUCTIONS && pos < sim->code_size)
+ {
+  Instruction *inst = &insts[count];
+  if(decode_instruction(sim->memory, pos, inst) == DECODE_ERROR || !jit_supported(inst))
+  {
+   break;
+  }
+  count++;
+  pos += inst->length;
+  if(inst->form == FORM_JUMP)
+  {
+   break;
+  }
+ }
+ if(!count)
+ {
+  jit->untranslatable[start] = true;
+  return;
+ }
+
+ if(JIT_BUFFER_SIZE - jit->used < JIT_MAX_BLOCK_CODE)
+ {
+  jit_flush(jit);
+ }
+ U32 block = (U32)jit->used;
+ jit->exit_count = 0;
+
+ // Return to the dispatcher when the block would pass the step limit.
+ jit_bytes(jit, (U8[]){0x48, 0x8B}, 2); // mov rax, [instructions]
+ jit_operand(jit, 0, jit_sim_field(offsetof(Sim, instructions)));
+ jit_bytes(jit, (U8[]){0x48, 0x05}, 2); // add rax, imm32
+ jit_u32(jit, (U32)count);
+ jit_bytes(jit, (U8[]){0x48, 0x3B}, 2); // cmp rax, [limit]
+ jit_operand(jit, 0, jit_sim_field(offsetof(Sim, limit)));
+ jit_bytes(jit, (U8[]){0x0F, 0x80 | JIT_ABOVE}, 2);
+ jit_u32(jit, 0);
+ jit_patch(jit, (U32)jit->used - 4, JIT_RETURN);
+
+ bool host_flags = false;
+ for(USIZE i = 0; i < count; i++)
+ {
+  if(insts[i].form == FORM_JUMP)
+  {
+   jit_jump(jit, &insts[i], count, host_flags);
+  }
+  else
+  {
+   host_flags = jit_instruction(jit, &insts[i], i, host_flags);
+  }
+ }
+ if(insts[count - 1].form != FORM_JUMP)
+ {
+  jit_exit(jit, JIT_ALWAYS, (U16)pos, count, host_flags ? JIT_SAVE_HOST : JIT_SAVE_NONE, true);
+ }
+
+ jit->entry[start] = block;
+ jit->end[start] = (U32)pos;
+ jit->length[start] = (U8)count;
+ jit->starts[jit->block_count++] = start;
+ jit_emit_exits(jit, start);
+ jit->translated++;
+
+ // Chain the exits that were waiting for this block.
+ for(USIZE i = 0; i < jit->link_count; i++)
+ {
+  if(jit->links[i].target == start)
+  {
+   jit_patch(jit, jit->links[i].site, block);
+  }
+ }
+}
+
+// Drops the blocks that overlap the size bytes at address.
+void jit_invalidate_range(Jit *jit, U16 address, USIZE size)
+{
+ for(USIZE i = 0; i < size + MAX_INSTRUCTION_LENGTH - 1; i++)
+ {
+  jit->untranslatable[(U16)(address + size - 1 - i)] = false;
+ }
+
+ for(USIZE i = 0; i < jit->block_count;)
+ {
+  U16 start = jit->starts[i];
+  if(start >= address + size || jit->end[start] <= address)
+  {
+   i++;
+   continue;
+  }
+
+  jit->entry[start] = 0;
+  jit->hits[start] = 0;
+  jit->starts[i] = jit->starts[--jit->block_count];
+  jit->invalidated++;
+  for(USIZE k = 0; k < jit->link_count;)
+  {
+   JitLink *link = &jit->links[k];
+   if(link->owner == start)
+   {
+    *link = jit->links[--jit->link_count];
+    continue;
+   }
+   if(link->target == start)
+   {
+    jit_patch(jit, link->site, JIT_RETURN);
+   }
+   k++;
+  }
+ }
+}
+
+// Drops the blocks that cover the word stored at address.
+void jit_invalidate(Jit *jit, U16 address)
+{
+ jit_invalidate_range(jit, address, 2);
+}
+
+void jit_call(Jit *jit, U16 ip)
+{
+ U8 *entry = jit->run + jit->entry[ip];
+ JitBlock block;
+ memcpy(&block, &entry, sizeof(block));
+ sim_flags(jit->sim);
+ block(jit->sim);
+}
+
+// Maps the translation buffer for sim twice, read-write and read-execute.
+// Returns 0 when it cannot be mapped.
+Jit *jit_open(Sim *sim)
+{
+ int fd = memfd_create("jit", MFD_CLOEXEC);
+ U8 *code = MAP_FAILED;
+ U8 *run = MAP_FAILED;
+ if(fd >= 0 && ftruncate(fd, JIT_BUFFER_SIZE) == 0)
+ {
+  code = mmap(0, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  run = mmap(0, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+ }
+ if(code == MAP_FAILED || run == MAP_FAILED)
+ {
+  fprintf(stderr, "Error: Could not map the JIT buffer: %s, interpreting\n", strerror(errno));
+  if(code != MAP_FAILED)
+  {
+   munmap(code, JIT_BUFFER_SIZE);
+  }
+  if(run != MAP_FAILED)
+  {
+   munmap(run, JIT_BUFFER_SIZE);
+  }
+  if(fd >= 0)
+  {
+   close(fd);
+  }
+  return 0;
+ }
+ close(fd);
+
+ Jit *jit = calloc(1, sizeof(Jit));
+ jit->sim = sim;
+ jit->code = code;
+ jit->run = run;
+ jit->code[JIT_RETURN] = 0xC3; // ret
+ jit->used = JIT_RETURN + 1;
+ return jit;
+}
+
+void jit_close(Jit *jit)
+{
+ munmap(jit->code, JIT_BUFFER_SIZE);
+ munmap(jit->run, JIT_BUFFER_SIZE);
+ free(jit->links);
+ free(jit);
+}
+
+// Like sim_run(), translating the blocks that were interpreted threshold
+// times. Blocks translated by earlier calls on the same jit are kept.
+bool jit_execute(Jit *jit, U64 threshold)
+{
+ Sim *sim = jit->sim;
+ bool result = true;
+ while(result && sim->ip < sim->code_size && sim->instructions < sim->limit)
+ {
+  U16 ip = sim->ip;
+  if(!jit->entry[ip] && !jit->untranslatable[ip] && ++jit->hits[ip] >= threshold)
+  {
+   jit_translate(jit, ip);
+  }
+  if(jit->entry[ip] && sim->instructions + jit->length[ip] <= sim->limit)
+  {
+   // A block that left before its first instruction made no progress,
+   // interpret instead.
+   U64 before = sim->instructions;
+   jit_call(jit, ip);
+   if(sim->instructions != before)
+   {
+    continue;
+   }
+  }
+
+  // Interpret up to the next jump.
+  bool jump = false;
+  while(!jump && sim->ip < sim->code_size && sim->instructions < sim->limit)
+  {
+   U16 at = sim->ip;
+   if(!sim_step(sim))
+   {
+    result = false;
+    break;
+   }
+   jit->interpreted++;
+   jump = sim->cache[at].form == FORM_JUMP;
+   if(sim->code_written)
+   {
+    jit_invalidate(jit, sim->code_write_address);
+    sim->code_written = false;
+   }
+  }
+ }
+ return result;
+}
+
+// instructions is the count the jit ran, translated or interpreted.
+void jit_print_stats(Jit *jit, U64 instructions)
+{
+ fprintf(stderr, "jit: %llu blocks translated, %zu KB of code, %llu invalidated, %llu flushes, %.1f%% of instructions interpreted\n",
+         (unsigned long long)jit->translated, jit->used / 1024, (unsigned long long)jit->invalidated,
+         (unsigned long long)jit->flushes,
+         instructions ? 100.0 * (double)jit->interpreted / (double)instructions : 0.0);
+}
+
+// jit_execute() on a jit of its own. Falls back to sim_run() when no
+// executable memory can be mapped.
+bool jit_run(Sim *sim, U64 threshold, bool output_stats)
+{
+ Jit *jit = jit_open(sim);
+ if(!jit)
+ {
+  return sim_run(sim);
+ }
+ bool result = jit_execute(jit, threshold);
+ if(output_stats)
+ {
+  jit_print_stats(jit, sim->instructions);
+ }
+ jit_close(jit);
+ return result;
+}
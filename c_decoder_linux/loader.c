@@ -0,0 +1,265 @@
+// DOS executable loaders, selected with --load. The file is mapped as
+// usual and only the load image inside it is decoded, at the address DOS
+// would load it to. Included at the bottom of main.c.
+//
+// A file starting with "MZ" (or "ZM") is an .EXE: the image follows the
+// header paragraphs and ends where the page counts say, the entry point is
+// the header CS:IP and every relocation table entry names a word that gets
+// the load segment added. Anything else is a .COM image, loaded whole at
+// offset 0x100 of the PSP segment.
+//
+// The PSP goes to the --load-segment paragraph, LOAD_DEFAULT_SEGMENT if not
+// given, and an .EXE image right behind its 0x100 bytes. The
+// mapping is never written to: an instruction covering a relocated word is
+// copied to a scratch buffer and fixed up there before decoding.
+//
+// With --cfg the entry point replaces offset 0, --superset, --stats and
+// --query get the image as is, offsets relative to its start. Otherwise the
+// listing prints every line with its address:
+//
+// Example: 1010:0003 mov ax, 4128
+
+#define LOAD_DEFAULT_SEGMENT 0x1000
+#define LOAD_COM_OFFSET 0x100
+#define LOAD_PSP_PARAGRAPHS 0x10
+#define MZ_HEADER_SIZE 0x1C
+
+typedef struct
+{
+ U8 *bytes; // Start of the load image, inside the mapping
+ USIZE size;
+ U16 segment; // Address of bytes[0]
+ U16 offset;
+ U16 entry_cs; // Relocated
+ U16 entry_ip;
+ USIZE entry; // Entry point as an offset into bytes
+
+ // Image offsets of the relocated words, sorted, and what gets added to
+ // each of them.
+ USIZE *fixups;
+ USIZE fixup_count;
+ U16 fixup_segment;
+ bool exe;
+} LoadedImage;
+
+U16 load_word(U8 *bytes, USIZE pos)
+{
+ return (U16)(bytes[pos] | (bytes[pos + 1] << 8));
+}
+
+int load_compare_fixups(const void *a, const void *b)
+{
+ USIZE x = *(const USIZE *)a;
+ USIZE y = *(const USIZE *)b;
+ return (x > y) - (x < y);
+}
+
+bool load_exe(U8 *bytes, USIZE size, U16 psp, LoadedImage *image)
+{
+ if(size < MZ_HEADER_SIZE)
+ {
+  fprintf(stderr, "Error: MZ header truncated\n");
+  return false;
+ }
+
+ U16 last_page_bytes = load_word(bytes, 0x02);
+ U16 pages = load_word(bytes, 0x04);
+ U16 relocation_count = load_word(bytes, 0x06);
+ U16 header_paragraphs = load_word(bytes, 0x08);
+ U16 ip = load_word(bytes, 0x14);
+ U16 cs = load_word(bytes, 0x16);
+ U16 relocation_table = load_word(bytes, 0x18);
+
+ // The last page holds last_page_bytes bytes, all 512 when it is 0.
+ USIZE header_size = (USIZE)header_paragraphs * 16;
+ USIZE end = (USIZE)pages * 512;
+ if(pages && last_page_bytes && last_page_bytes < 512)
+ {
+  end -= 512 - last_page_bytes;
+ }
+ if(end > size)
+ {
+  fprintf(stderr, "Error: MZ image ends at %zu, past the end of the file (%zu bytes)\n", end, size);
+  return false;
+ }
+ if(header_size < MZ_HEADER_SIZE || header_size >= end)
+ {
+  fprintf(stderr, "Error: MZ header of %zu bytes leaves no image\n", header_size);
+  return false;
+ }
+ if((USIZE)relocation_table + (USIZE)relocation_count * 4 > size)
+ {
+  fprintf(stderr, "Error: MZ relocation table runs past the end of the file\n");
+  return false;
+ }
+
+ image->exe = true;
+ image->bytes = bytes + header_size;
+ image->size = end - header_size;
+ image->segment = (U16)(psp + LOAD_PSP_PARAGRAPHS);
+ image->offset = 0;
+ image->entry_cs = (U16)(cs + image->segment);
+ image->entry_ip = ip;
+ image->entry = (USIZE)cs * 16 + ip;
+ image->fixup_segment = image->segment;
+
+ // Entries are offset:segment pairs relative to the image start. A word
+ // that does not fit in the image is left alone, as DOS would patch the
+ // memory behind it instead.
+ image->fixups = malloc((relocation_count ? relocation_count : 1) * sizeof(USIZE));
+ image->fixup_count = 0;
+ for(USIZE i = 0; i < relocation_count; i++)
+ {
+  USIZE entry = relocation_table + i * 4;
+  USIZE pos = (USIZE)load_word(bytes, entry + 2) * 16 + load_word(bytes, entry);
+  if(pos + 2 <= image->size)
+  {
+   image->fixups[image->fixup_count++] = pos;
+  }
+ }
+ qsort(image->fixups, image->fixup_count, sizeof(USIZE), load_compare_fixups);
+ return true;
+}
+
+// Fills in image from the mapped file. Returns false after printing what
+// is wrong.
+bool load_image(U8 *bytes, USIZE size, U16 psp, LoadedImage *image)
+{
+ memset(image, 0, sizeof(*image));
+ if(size >= 2 && ((bytes[0] == 'M' && bytes[1] == 'Z') || (bytes[0] == 'Z' && bytes[1] == 'M')))
+ {
+  if(!load_exe(bytes, size, psp, image))
+  {
+   return false;
+  }
+ }
+ else
+ {
+  if(size > 0x10000 - LOAD_COM_OFFSET)
+  {
+   fprintf(stderr, "Error: %zu bytes is too large for a .COM image\n", size);
+   return false;
+  }
+  image->bytes = bytes;
+  image->size = size;
+  image->segment = psp;
+  image->offset = LOAD_COM_OFFSET;
+  image->entry_cs = psp;
+  image->entry_ip = LOAD_COM_OFFSET;
+  image->entry = 0;
+ }
+
+ if(image->entry >= image->size)
+ {
+  fprintf(stderr, "Error: entry point %04X:%04X lies outside the %zu byte image\n",
+          image->entry_cs, image->entry_ip, image->size);
+  free(image->fixups);
+  return false;
+ }
+ return true;
+}
+
+// Decodes the instruction at pos like decode_instruction(), with the
+// relocations in fixups[*next_fixup...] applied. *next_fixup is advanced
+// past those that end before pos.
+USIZE load_decode(LoadedImage *image, USIZE pos, USIZE *next_fixup, Instruction *inst)
+{
+ while(*next_fixup < image->fixup_count && image->fixups[*next_fixup] + 2 <= pos)
+ {
+  (*next_fixup)++;
+ }
+ if(*next_fixup == image->fixup_count || image->fixups[*next_fixup] >= pos + MAX_INSTRUCTION_LENGTH)
+ {
+  return decode_instruction(image->bytes, pos, inst);
+ }
+
+ // Same layout as every input buffer: the instruction, then zeroed tail
+ // padding.
+ U8 patched[MAX_INSTRUCTION_LENGTH + INPUT_TAIL_PADDING] = {0};
+ USIZE count = image->size - pos < MAX_INSTRUCTION_LENGTH ? image->size - pos : MAX_INSTRUCTION_LENGTH;
+ memcpy(patched, image->bytes + pos, count);
+ for(USIZE i = *next_fixup; i < image->fixup_count && image->fixups[i] < pos + count; i++)
+ {
+  USIZE fixup = image->fixups[i];
+  U16 word = (U16)(load_word(image->bytes, fixup) + image->fixup_segment);
+  if(fixup >= pos)
+  {
+   patched[fixup - pos] = (U8)word;
+  }
+  if(fixup + 1 < pos + count)
+  {
+   patched[fixup + 1 - pos] = (U8)(word >> 8);
+  }
+ }
+
+ USIZE end = decode_instruction(patched, 0, inst);
+ inst->offset = pos;
+ return end == DECODE_ERROR ? DECODE_ERROR : pos + end;
+}
+
+// Writes "SSSS:OOOO " and the instruction. Addresses within 64 KB of the
+// entry code segment are shown relative to it.
+void load_write_line(Output *out, LoadedImage *image, Instruction *inst)
+{
+ U32 linear = (U32)image->segment * 16 + image->offset + (U32)inst->offset;
+ U32 base = (U32)image->entry_cs * 16;
+ U32 segment = linear >= base && linear - base < 0x10000 ? image->entry_cs : linear >> 4;
+
+ char *line = output_reserve(out, MAX_LINE_LENGTH + 16);
+ int length = sprintf(line, "%04X:%04X ", (unsigned)segment, (unsigned)(linear - segment * 16));
+ output_commit(out, (USIZE)length + format_instruction(inst, line + length));
+}
+
+int run_load(LoadedImage *image, bool output_stats, bool resilient)
+{
+ Output out;
+ if(!output_open(&out, STDOUT_FILENO))
+ {
+  return 1;
+ }
+
+ char *line = output_reserve(&out, 128);
+ output_commit(&out, (USIZE)sprintf(line, "; %s image, %zu bytes at %04X:%04X, entry %04X:%04X, %zu relocations\n",
+                                    image->exe ? "MZ .EXE" : ".COM", image->size, image->segment, image->offset,
+                                    image->entry_cs, image->entry_ip, image->fixup_count));
+
+ Instruction inst = {0};
+ USIZE data_bytes = 0;
+ USIZE next_fixup = 0;
+ USIZE pos = 0;
+ while(pos < image->size)
+ {
+  // The image is followed by the rest of the file or the tail padding, so
+  // the opcode and ModRM reads stay in bounds.
+  USIZE length = instruction_length(image->bytes, pos);
+  USIZE next = DECODE_ERROR;
+  if(length && pos + length > image->size)
+  {
+   inst.form = FORM_TRUNCATED;
+   inst.offset = pos;
+  }
+  else
+  {
+   next = load_decode(image, pos, &next_fixup, &inst);
+  }
+
+  if(next == DECODE_ERROR && resilient)
+  {
+   next = decode_data_byte(image->bytes, pos, &inst);
+   data_bytes++;
+  }
+  load_write_line(&out, image, &inst);
+  if(next == DECODE_ERROR)
+  {
+   break;
+  }
+  pos = next + 1;
+ }
+
+ output_close(&out, output_stats);
+ if(data_bytes)
+ {
+  fprintf(stderr, "resilient: %zu undecodable bytes emitted as db\n", data_bytes);
+ }
+ return 0;
+}
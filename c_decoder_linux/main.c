@@ -1,21 +1,133 @@
-// clear && nasm instructions.asm && gcc main.c -std=c11 -g3 -Wall -Wextra -pedantic -fsanitize=address,undefined -o decoder && ./decoder
+// clear && nasm instructions.asm && gcc main.c -std=c11 -g3 -Wall -Wextra -pedantic -fsanitize=address,undefined -pthread -o decoder && ./decoder
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 typedef uint8_t U8;
 typedef uint16_t U16;
 typedef int8_t S8;
 typedef int16_t S16;
+typedef uint32_t U32;
+typedef int32_t S32;
+typedef uint64_t U64;
+typedef int64_t S64;
 typedef size_t USIZE;
 
 #define MAX_INSTRUCTION_FILE_SIZE 1024
 
-USIZE read_instruction_bytes(U8 *bytes);
-void debug_print_byte(U8 byte);
+// Longest form decoded below: 0x81 with mod 10 and a word immediate,
+// opcode + ModRM + 2 displacement bytes + 2 data bytes.
+#define MAX_INSTRUCTION_LENGTH 6
+
+// Every input buffer carries at least this many zeroed bytes past its end,
+// so decoding a truncated instruction never reads outside the buffer.
+#define INPUT_TAIL_PADDING 8
+
+#define DECODE_ERROR SIZE_MAX
+
+// Longest line format_instruction() writes, including the newline.
+#define MAX_LINE_LENGTH 64
+
+// --cfg: offset 0 plus this many --entry offsets.
+#define MAX_ENTRY_POINTS 64
+
+enum
+{
+ MNEMONIC_MOV,
+ MNEMONIC_ADD,
+ MNEMONIC_SUB,
+ MNEMONIC_CMP,
+ MNEMONIC_JNE,
+ MNEMONIC_JE,
+ MNEMONIC_JL,
+ MNEMONIC_JLE,
+ MNEMONIC_JB,
+ MNEMONIC_JBE,
+ MNEMONIC_JP,
+ MNEMONIC_JO,
+ MNEMONIC_JS,
+ MNEMONIC_JNL,
+ MNEMONIC_JG,
+ MNEMONIC_JNB,
+ MNEMONIC_JA,
+ MNEMONIC_JNP,
+ MNEMONIC_JNO,
+ MNEMONIC_JNS,
+ MNEMONIC_LOOP,
+ MNEMONIC_LOOPZ,
+ MNEMONIC_LOOPNZ,
+ MNEMONIC_JCXZ,
+ MNEMONIC_COUNT,
+};
+
+char *mnemonic_names[MNEMONIC_COUNT] = {
+ "mov", "add", "sub", "cmp",
+ "jne", "je", "jl", "jle", "jb", "jbe", "jp", "jo", "js", "jnl",
+ "jg", "jnb", "ja", "jnp", "jno", "jns", "loop", "loopz", "loopnz", "jcxz",
+};
+
+// Operand layout of a decoded instruction, one per decode helper below.
+enum
+{
+ FORM_REG_MEM, // common_displacement()
+ FORM_IMMEDIATE_REG_MEM, // common_immediate()
+ FORM_IMMEDIATE_TO_REG, // mov_immediate_to_reg()
+ FORM_IMMEDIATE_ACCUMULATOR, // immediate_accumulator()
+ FORM_JUMP, // short_jump()
+ FORM_UNKNOWN_MNEMONIC,
+ FORM_UNKNOWN_OPCODE,
+ FORM_TRUNCATED,
+ FORM_DATA_BYTE, // decode_data_byte(), --resilient only
+};
+
+typedef struct
+{
+ USIZE offset;
+ U16 displacement;
+ U16 data;
+ U8 length;
+ U8 form;
+ U8 mnemonic;
+ U8 mod;
+ U8 reg;
+ U8 rm;
+ bool w;
+ bool d;
+ bool s;
+} Instruction;
+
+// Preformatted operand text, built once at startup by
+// build_operand_fragments(). A line is the mnemonic fragment, head, first
+// number, mid, second number and a newline, so formatting is a few
+// fixed-size copies plus the digits of the numbers.
+typedef struct
+{
+ char head[16];
+ char mid[8];
+ U8 head_length;
+ U8 mid_length;
+ U8 numbers;
+} OperandFragment;
+
+OperandFragment mnemonic_fragments[MNEMONIC_COUNT];
+OperandFragment reg_mem_fragments[2048]; // [zero displacement][d][w][ModRM]
+OperandFragment immediate_fragments[64]; // [w][mod][rm]
+OperandFragment immediate_to_reg_fragments[16]; // [w][reg]
+OperandFragment accumulator_fragments[2]; // [w]
+
+USIZE read_instruction_bytes(char *filename, U8 *bytes);
+U8 *map_instruction_bytes(char *filename, USIZE *bytes_read, USIZE *mapped_size);
+U64 now_ns(void);
 
 char *eac_table[8] = {
  [0] = "bx + si",
@@ -67,618 +179,1052 @@ U8 LOOPZ = 0xE1; // 0b1110_0001
 U8 LOOPNZ = 0xE0; // 0b1110_0000
 U8 JCXZ = 0xE3; // 0b1110_0011
                                    
-USIZE common_displacement(char *name, U8 *bytes, USIZE pos);
-USIZE common_immediate(U8 *bytes, USIZE pos);
-USIZE mov_immediate_to_reg(U8 *bytes, USIZE pos);
-USIZE immediate_accumulator(char *name, U8 *bytes, USIZE pos);
-
-int main()
+USIZE decode_instruction(U8 *bytes, USIZE pos, Instruction *inst);
+USIZE decode_fields(U8 *bytes, USIZE pos, Instruction *inst);
+USIZE instruction_length(U8 *bytes, USIZE pos);
+USIZE common_displacement(U8 mnemonic, U8 *bytes, USIZE pos, Instruction *inst);
+USIZE common_immediate(U8 *bytes, USIZE pos, Instruction *inst);
+USIZE mov_immediate_to_reg(U8 *bytes, USIZE pos, Instruction *inst);
+USIZE immediate_accumulator(U8 mnemonic, U8 *bytes, USIZE pos, Instruction *inst);
+USIZE short_jump(U8 mnemonic, U8 *bytes, USIZE pos, Instruction *inst);
+USIZE decode_data_byte(U8 *bytes, USIZE pos, Instruction *inst);
+USIZE format_instruction(Instruction *inst, char *out);
+void build_operand_fragments(void);
+
+#include "output.c"
+#include "loader.c"
+
+int run_pipeline(char *filename, bool output_stats, bool resilient);
+int run_stream(int fd, bool output_stats, bool resilient);
+int run_cfg(U8 *bytes, USIZE size, USIZE *entries, USIZE entry_count, bool output_stats);
+int run_superset(U8 *bytes, USIZE size, bool output_stats);
+int run_query(U8 *bytes, USIZE size, char *query, bool output_stats);
+int run_stats(U8 *bytes, USIZE size, bool output_stats);
+int run_packed(U8 *bytes, USIZE size, bool output_stats, bool resilient);
+int run_verify(U8 *bytes, USIZE size, U64 seed, bool output_stats);
+USIZE parse_size(char *text);
+int run_enumerate(bool output_stats);
+int run_simulate(U8 *bytes, USIZE size, bool eager, U64 max_steps, U64 jit_threshold, U64 replays,
+                 U64 checkpoint_at, char *trace_path, bool output_stats);
+int run_read_trace(U8 *bytes, USIZE size, U64 from, bool output_stats);
+int run_batch(U8 *bytes, USIZE size, char *inputs_path, U64 max_steps, bool output_stats);
+int run_patch(U8 *bytes, USIZE size, char *patches_path, bool output_stats, bool resilient);
+int run_server(char *path, USIZE worker_count);
+
+int main(int argc, char **argv)
 {
+ build_operand_fragments();
 
- U8 bytes[MAX_INSTRUCTION_FILE_SIZE] = {0};
- USIZE bytes_read = read_instruction_bytes(bytes);
- if(bytes_read == 0)
- {
-  printf("Zero bytes read\n");
-  return 1;
- }
-
- for(USIZE i = 0; i < bytes_read; i++)
- {
-  debug_print_byte(bytes[i]);
- }
- 
- USIZE pos = 0;
- while(pos < bytes_read)
+ char *filename = "instructions";
+ bool pipeline = false;
+ bool stream = false;
+ bool output_stats = false;
+ bool cfg = false;
+ bool superset = false;
+ bool stats = false;
+ bool resilient = false;
+ bool load = false;
+ bool packed = false;
+ bool verify = false;
+ bool enumerate = false;
+ bool simulate = false;
+ bool eager_flags = false;
+ U64 max_steps = 0;
+ bool jit = false;
+ U64 jit_threshold = 16; // Runs of a block before --jit translates it
+ U64 replays = 0;
+ U64 checkpoint_at = 0;
+ char *trace_path = 0;
+ bool read_trace = false;
+ U64 trace_from = 0;
+ USIZE verify_random_size = 0;
+ U64 seed = 0;
+ U16 load_segment = LOAD_DEFAULT_SEGMENT;
+ char *query = 0;
+ char *batch_path = 0;
+ char *patch_path = 0;
+ char *serve_path = 0;
+ USIZE worker_count = 0;
+ USIZE entries[MAX_ENTRY_POINTS + 1] = {0};
+ USIZE entry_count = 1;
+ for(int i = 1; i < argc; i++)
  {
-  // Instruction decoding
-  if((bytes[pos] >> 2) == MOV_REG_MEM_TO_FROM_REG)
+  if(strcmp(argv[i], "--pipeline") == 0)
   {
-   pos = common_displacement("mov", bytes, pos);
-   pos++;
-   continue;
+   pipeline = true;
   }
-
-  if((bytes[pos] >> 4) == MOV_IMMEDIATE_TO_REG)
+  else if(strcmp(argv[i], "--stream") == 0)
   {
-   pos = mov_immediate_to_reg(bytes, pos);
-   pos++;
-   continue;
+   stream = true;
   }
-
-  if((bytes[pos] >> 2) == ADD_REG_MEM_WITH_REGISTER_TO_EITHER)
+  else if(strcmp(argv[i], "--output-stats") == 0)
   {
-   pos = common_displacement("add", bytes, pos);
-   pos++;
-   continue;
+   output_stats = true;
   }
-
-  if((bytes[pos] >> 2) == SUB_REG_MEM_WITH_REGISTER_TO_EITHER)
+  else if(strcmp(argv[i], "--cfg") == 0)
   {
-   pos = common_displacement("sub", bytes, pos);
-   pos++;
-   continue;
+   cfg = true;
   }
-
-  if((bytes[pos] >> 2) == CMP_REG_MEM_WITH_REGISTER_TO_EITHER)
+  else if(strcmp(argv[i], "--superset") == 0)
   {
-   pos = common_displacement("cmp", bytes, pos);
-   pos++;
-   continue;
+   superset = true;
   }
-
-  if((bytes[pos] >> 2) == COMMON_IMMEDIATE_REG_MEM)
+  else if(strcmp(argv[i], "--stats") == 0)
   {
-   pos = common_immediate(bytes, pos);
-   pos++;
-   continue;
+   stats = true;
   }
-
-  if((bytes[pos] >> 1) == ADD_IMMEDIATE_TO_ACCUMULATOR)
+  else if(strcmp(argv[i], "--resilient") == 0)
   {
-   pos = immediate_accumulator("add", bytes, pos);
-   pos++;
-   continue;
+   resilient = true;
   }
-
-  if((bytes[pos] >> 1) == SUB_IMMEDIATE_FROM_ACCUMULATOR)
+  else if(strcmp(argv[i], "--packed") == 0)
   {
-   pos = immediate_accumulator("sub", bytes, pos);
-   pos++;
-   continue;
+   packed = true;
   }
-
-  if((bytes[pos] >> 1) == CMP_IMMEDIATE_WITH_ACCUMULATOR)
+  else if(strcmp(argv[i], "--verify") == 0)
   {
-   pos = immediate_accumulator("cmp", bytes, pos);
-   pos++;
-   continue;
+   verify = true;
   }
-
-  if(bytes[pos] == JNE)
+  else if(strcmp(argv[i], "--enumerate") == 0)
   {
-   S8 value = bytes[++pos];
-   printf("jne %i\n", value);
-   pos++;
-   continue;
+   enumerate = true;
   }
-
-  if(bytes[pos] == JE)
+  else if(strcmp(argv[i], "--simulate") == 0)
   {
-   S8 value = bytes[++pos];
-   printf("je %i\n", value);
-   pos++;
-   continue;
+   simulate = true;
   }
-
-  if(bytes[pos] == JL)
+  else if(strcmp(argv[i], "--eager-flags") == 0)
   {
-   S8 value = bytes[++pos];
-   printf("jl %i\n", value);
-   pos++;
-   continue;
+   eager_flags = true;
   }
-
-  if(bytes[pos] == JLE)
+  else if(strcmp(argv[i], "--jit") == 0)
   {
-   S8 value = bytes[++pos];
-   printf("jle %i\n", value);
-   pos++;
-   continue;
+   jit = true;
   }
-
-  if(bytes[pos] == JB)
+  else if(strcmp(argv[i], "--jit-threshold") == 0 && i + 1 < argc)
   {
-   S8 value = bytes[++pos];
-   printf("jb %i\n", value);
-   pos++;
-   continue;
+   // Example: --jit-threshold 1 translates every block on its first run
+   jit_threshold = strtoull(argv[++i], 0, 0);
   }
- 
-  if(bytes[pos] == JBE)
+  else if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
   {
-   S8 value = bytes[++pos];
-   printf("jbe %i\n", value);
-   pos++;
-   continue;
+   // Example: --replay 1000 --checkpoint-at 50
+   replays = strtoull(argv[++i], 0, 0);
   }
-
-  if(bytes[pos] == JP)
+  else if(strcmp(argv[i], "--checkpoint-at") == 0 && i + 1 < argc)
   {
-   S8 value = bytes[++pos];
-   printf("jp %i\n", value);
-   pos++;
-   continue;
+   checkpoint_at = strtoull(argv[++i], 0, 0);
   }
-
-  if(bytes[pos] == JO)
+  else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
   {
-   S8 value = bytes[++pos];
-   printf("jo %i\n", value);
-   pos++;
-   continue;
+   trace_path = argv[++i];
   }
-
-  if(bytes[pos] == JS)
+  else if(strcmp(argv[i], "--read-trace") == 0)
   {
-   S8 value = bytes[++pos];
-   printf("js %i\n", value);
-   pos++;
-   continue;
+   // The input file is a trace written with --trace.
+   read_trace = true;
   }
-
-  if(bytes[pos] == JNL)
+  else if(strcmp(argv[i], "--trace-from") == 0 && i + 1 < argc)
   {
-   S8 value = bytes[++pos];
-   printf("jnl %i\n", value);
-   pos++;
-   continue;
+   trace_from = strtoull(argv[++i], 0, 0);
   }
-
-  if(bytes[pos] == JG)
+  else if(strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
   {
-   S8 value = bytes[++pos];
-   printf("jg %i\n", value);
-   pos++;
-   continue;
+   batch_path = argv[++i];
   }
-
-  if(bytes[pos] == JNB)
+  else if(strcmp(argv[i], "--patch") == 0 && i + 1 < argc)
   {
-   S8 value = bytes[++pos];
-   printf("jnb %i\n", value);
-   pos++;
-   continue;
+   patch_path = argv[++i];
   }
-
-  if(bytes[pos] == JA)
+  else if(strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc)
   {
-   S8 value = bytes[++pos];
-   printf("ja %i\n", value);
-   pos++;
-   continue;
+   max_steps = strtoull(argv[++i], 0, 0);
   }
-
-  if(bytes[pos] == JNP)
+  else if(strcmp(argv[i], "--verify-random") == 0 && i + 1 < argc)
   {
-   S8 value = bytes[++pos];
-   printf("jnp %i\n", value);
-   pos++;
-   continue;
+   // Example: --verify-random 4G
+   verify_random_size = parse_size(argv[++i]);
+   if(!verify_random_size)
+   {
+    fprintf(stderr, "Error: --verify-random takes a size such as 4G, 512M or 1048576: %s\n", argv[i]);
+    return 1;
+   }
   }
-
-  if(bytes[pos] == JNO)
+  else if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
   {
-   S8 value = bytes[++pos];
-   printf("jno %i\n", value);
-   pos++;
-   continue;
+   seed = strtoull(argv[++i], 0, 0);
   }
-
-  if(bytes[pos] == JNS)
+  else if(strcmp(argv[i], "--load") == 0)
   {
-   S8 value = bytes[++pos];
-   printf("jns %i\n", value);
-   pos++;
-   continue;
+   load = true;
   }
-
-  if(bytes[pos] == LOOP)
+  else if(strcmp(argv[i], "--load-segment") == 0 && i + 1 < argc)
   {
-   S8 value = bytes[++pos];
-   printf("loop %i\n", value);
-   pos++;
-   continue;
+   // Example: --load-segment 0x0700
+   load_segment = (U16)strtoul(argv[++i], 0, 0);
   }
-
-  if(bytes[pos] == LOOPZ)
+  else if(strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
   {
-   S8 value = bytes[++pos];
-   printf("loopz %i\n", value);
-   pos++;
-   continue;
+   serve_path = argv[++i];
   }
-
-  if(bytes[pos] == LOOPNZ)
+  else if(strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
   {
-   S8 value = bytes[++pos];
-   printf("loopnz %i\n", value);
-   pos++;
-   continue;
+   worker_count = strtoull(argv[++i], 0, 0);
   }
-
-  if(bytes[pos] == JCXZ)
+  else if(strcmp(argv[i], "--query") == 0 && i + 1 < argc)
+  {
+   query = argv[++i];
+  }
+  else if(strcmp(argv[i], "--entry") == 0 && i + 1 < argc)
   {
-   S8 value = bytes[++pos];
-   printf("jcxz %i\n", value);
-   pos++;
-   continue;
+   // Example: --entry 0x1A0
+   if(entry_count == MAX_ENTRY_POINTS + 1)
+   {
+    fprintf(stderr, "Error: more than %d entry points\n", MAX_ENTRY_POINTS);
+    return 1;
+   }
+   entries[entry_count++] = strtoull(argv[++i], 0, 0);
+  }
+  else
+  {
+   filename = argv[i];
   }
  }
- 
- return 0;
-}
 
-USIZE common_displacement(char *name, U8 *bytes, USIZE pos)
-{
- bool instruction_destination_is_in_reg_field = (bytes[pos] & 0x2); // 0b0000_00010
- bool word_data = (bytes[pos] & 0x1); // 0b0000_0001                                                                  
-                                    
- pos++;
- U8 mod_field = (bytes[pos] >> 6);
- U8 reg_field = (bytes[pos] & 0x38) >> 3; // 0b0011_1000 = 0x38
- U8 rm_field = (bytes[pos] & 0x07); // 0b0000_0111
-
- if(mod_field == 0x00 && rm_field == 0x06)
+ if(serve_path)
  {
-  // 16-bit displacement. Therefore word register. 
-  // And rm_field is direct address so destination must be in reg_field.
-  // Example: mov bp, [5]    -> 0x8B 0x2E 0x05 0x00
-  // Example: mov bx, [3458] -> 0x8B 0x1E 0x82 0x0D
-  U16 disp_low = bytes[++pos];
-  U16 disp_high = bytes[++pos];
-  U16 displacement = (disp_high << 8) | disp_low;
-  printf("%s %s, [%u]\n", name, word_registers[reg_field], displacement);
-  return pos;
- } 
+  return run_server(serve_path, worker_count);
+ }
 
- if(mod_field == 0x00) 
+ if(enumerate)
  {
-  // Example: mov al, [bx + si]
-  // Example: mov bx, [bp + di]
- 
-  char *rm_str = eac_table[rm_field];
+  return run_enumerate(output_stats);
+ }
 
-  char *reg_str;
-  if(word_data)
-  {
-   reg_str = word_registers[reg_field];
-  }  
-  else
-  {
-   reg_str = byte_registers[reg_field];
-  }
+ if(verify_random_size)
+ {
+  return run_verify(0, verify_random_size, seed, output_stats);
+ }
 
-  if(instruction_destination_is_in_reg_field)
-  {
-   printf("%s %s, [%s]\n", name, reg_str, rm_str);
-   return pos;
-  }
-  else
-  {
-   printf("%s [%s], %s\n", name, rm_str, reg_str);
-   return pos;
-  }
+ if(pipeline)
+ {
+  return run_pipeline(filename, output_stats, resilient);
  }
 
- if(mod_field == 0x01)
+ if(strcmp(filename, "-") == 0)
  {
-  // Example: mov dx, [bp]
-  // Example: mov ah, [bx + si + 4]
-  char *rm_str = eac_table[rm_field];
+  return run_stream(STDIN_FILENO, output_stats, resilient);
+ }
 
-  char *reg_str;
-  if(word_data)
-  {
-   reg_str = word_registers[reg_field];
-  }  
-  else
+ if(stream)
+ {
+  int fd = open(filename, O_RDONLY);
+  if(fd < 0)
   {
-   reg_str = byte_registers[reg_field];
+   fprintf(stderr, "Error: %s: %s\n", strerror(errno), filename);
+   return 1;
   }
+  int result = run_stream(fd, output_stats, resilient);
+  close(fd);
+  return result;
+ }
 
-  U8 displacement = bytes[++pos];
+ U8 read_buffer[MAX_INSTRUCTION_FILE_SIZE + INPUT_TAIL_PADDING] = {0};
+ USIZE bytes_read = 0;
+ USIZE mapped_size = 0;
+ U8 *bytes = map_instruction_bytes(filename, &bytes_read, &mapped_size);
+ if(!bytes)
+ {
+  // Not mappable (e.g. a FIFO), fall back to reading into the stack buffer.
+  bytes = read_buffer;
+  bytes_read = read_instruction_bytes(filename, bytes);
+ }
 
-  if(instruction_destination_is_in_reg_field)
-  {
-   if(displacement)
-   {
-    printf("%s %s, [%s + %u]\n", name, reg_str, rm_str, displacement);
-    return pos;
-   }
-   else
-   {
-    printf("%s %s, [%s]\n", name, reg_str, rm_str);
-    return pos;
-   }
-  }
-  else
+ if(bytes_read == 0)
+ {
+  printf("Zero bytes read\n");
+  return 1;
+ }
+
+ // Without --load the image is the whole file.
+ LoadedImage image = {.bytes = bytes, .size = bytes_read};
+ if(load)
+ {
+  if(!load_image(bytes, bytes_read, load_segment, &image))
   {
-   if(displacement)
+   if(mapped_size)
    {
-    printf("%s [%s + %u], %s\n", name, rm_str, displacement, reg_str);
-    return pos;
-   }
-   else
-   {
-    printf("%s [%s], %s\n", name, rm_str, reg_str);
-    return pos;
+    munmap(bytes, mapped_size);
    }
+   return 1;
   }
+  entries[0] = image.entry;
  }
 
- if(mod_field == 0x02)
+ if(cfg || superset || query || stats || packed || verify || simulate || batch_path || read_trace || patch_path ||
+    load)
  {
-  // Example: mov al, [bx + si + 4999]
-
-  char *rm_str = eac_table[rm_field];
-
-  char *reg_str;
-  if(word_data)
+  int result = 0;
+  if(cfg)
+  {
+   result = run_cfg(image.bytes, image.size, entries, entry_count, output_stats);
+  }
+  else if(superset)
+  {
+   result = run_superset(image.bytes, image.size, output_stats);
+  }
+  else if(stats)
+  {
+   result = run_stats(image.bytes, image.size, output_stats);
+  }
+  else if(query)
+  {
+   result = run_query(image.bytes, image.size, query, output_stats);
+  }
+  else if(batch_path)
+  {
+   result = run_batch(image.bytes, image.size, batch_path, max_steps, output_stats);
+  }
+  else if(simulate)
+  {
+   result = run_simulate(image.bytes, image.size, eager_flags, max_steps, jit ? jit_threshold : 0, replays,
+                         checkpoint_at, trace_path, output_stats);
+  }
+  else if(read_trace)
+  {
+   result = run_read_trace(image.bytes, image.size, trace_from, output_stats);
+  }
+  else if(patch_path)
+  {
+   result = run_patch(image.bytes, image.size, patch_path, output_stats, resilient);
+  }
+  else if(verify)
+  {
+   result = run_verify(image.bytes, image.size, 0, output_stats);
+  }
+  else if(packed)
   {
-   reg_str = word_registers[reg_field];
-  }  
+   result = run_packed(image.bytes, image.size, output_stats, resilient);
+  }
   else
   {
-   reg_str = byte_registers[reg_field];
+   result = run_load(&image, output_stats, resilient);
+  }
+  free(image.fixups);
+  if(mapped_size)
+  {
+   munmap(bytes, mapped_size);
   }
+  return result;
+ }
 
-  U8 disp_low = bytes[++pos];
-  U8 disp_high = bytes[++pos];
-  U16 displacement = (disp_high << 8) | disp_low;
+ Output out;
+ if(!output_open(&out, STDOUT_FILENO))
+ {
+  return 1;
+ }
 
-  if(instruction_destination_is_in_reg_field)
+ Instruction inst = {0};
+ USIZE data_bytes = 0;
+
+ // Fast path: at least MAX_INSTRUCTION_LENGTH bytes remain, so the decode
+ // helpers can read bytes[++pos] freely without checking bytes_read.
+ USIZE pos = 0;
+ while(pos + MAX_INSTRUCTION_LENGTH <= bytes_read)
+ {
+  USIZE next = decode_instruction(bytes, pos, &inst);
+  if(next == DECODE_ERROR && resilient)
   {
-   if(displacement)
-   {
-    printf("%s %s, [%s + %u]\n", name, reg_str, rm_str, displacement);
-    return pos;
-   }
-   else
-   {
-    printf("%s %s, [%s]\n", name, reg_str, rm_str);
-    return pos;
-   }
+   next = decode_data_byte(bytes, pos, &inst);
+   data_bytes++;
   }
-  else
+  output_write_instruction(&out, &inst);
+  if(next == DECODE_ERROR)
   {
-   if (displacement)
-   {
-    printf("%s %s, [%s + %u]\n", name, rm_str, reg_str, displacement);
-    return pos;
-   }
-   else
-   {
-    printf("%s %s, [%s]\n", name, rm_str, reg_str);
-    return pos;
-   }
+   pos = DECODE_ERROR;
+   break;
   }
+  pos = next + 1;
  }
 
- if(mod_field == 0x03)
+ // Tail: the last instruction may be truncated. Measure it before decoding,
+ // the tail padding keeps the opcode and ModRM reads in bounds.
+ while(pos < bytes_read)
  {
-  // Example: mov si, bx
-  // Example: mov dh, al
-
-  char *rm_str;
-  char *reg_str;
-  if(word_data)
+  USIZE length = instruction_length(bytes, pos);
+  USIZE next = DECODE_ERROR;
+  if(length && pos + length > bytes_read)
   {
-   rm_str = word_registers[rm_field];
-   reg_str = word_registers[reg_field];
-  }  
+   inst.form = FORM_TRUNCATED;
+   inst.offset = pos;
+  }
   else
   {
-   rm_str = byte_registers[rm_field];
-   reg_str = byte_registers[reg_field];
+   next = decode_instruction(bytes, pos, &inst);
   }
 
-  if(instruction_destination_is_in_reg_field)
+  if(next == DECODE_ERROR && resilient)
   {
-   printf("%s %s, %s\n", name, reg_str, rm_str);
-   return pos;
+   next = decode_data_byte(bytes, pos, &inst);
+   data_bytes++;
   }
-  else
+  output_write_instruction(&out, &inst);
+  if(next == DECODE_ERROR)
   {
-   printf("%s %s, %s\n", name, rm_str, reg_str);
-   return pos;
+   break;
   }
+  pos = next + 1;
+ }
+
+ output_close(&out, output_stats);
+ if(data_bytes)
+ {
+  fprintf(stderr, "resilient: %zu undecodable bytes emitted as db\n", data_bytes);
+ }
+
+ if(mapped_size)
+ {
+  munmap(bytes, mapped_size);
  }
 
- printf("Error: instruction pattern found but not processed.\n");
- return MAX_INSTRUCTION_FILE_SIZE + 1;
+ return 0;
+}
+
+USIZE decode_instruction(U8 *bytes, USIZE pos, Instruction *inst)
+{
+ memset(inst, 0, sizeof(*inst));
+ inst->offset = pos;
+
+ USIZE end = decode_fields(bytes, pos, inst);
+ if(end != DECODE_ERROR)
+ {
+  inst->length = (U8)(end - pos + 1);
+ }
+ return end;
 }
 
-USIZE common_immediate(U8 *bytes, USIZE pos)
+USIZE decode_fields(U8 *bytes, USIZE pos, Instruction *inst)
 {
- bool has_sign_extension = bytes[pos] & 0x02;
- bool word_data = bytes[pos] & 0x01;
+ if((bytes[pos] >> 2) == MOV_REG_MEM_TO_FROM_REG)
+ {
+  return common_displacement(MNEMONIC_MOV, bytes, pos, inst);
+ }
+
+ if((bytes[pos] >> 4) == MOV_IMMEDIATE_TO_REG)
+ {
+  return mov_immediate_to_reg(bytes, pos, inst);
+ }
+
+ if((bytes[pos] >> 2) == ADD_REG_MEM_WITH_REGISTER_TO_EITHER)
+ {
+  return common_displacement(MNEMONIC_ADD, bytes, pos, inst);
+ }
+
+ if((bytes[pos] >> 2) == SUB_REG_MEM_WITH_REGISTER_TO_EITHER)
+ {
+  return common_displacement(MNEMONIC_SUB, bytes, pos, inst);
+ }
+
+ if((bytes[pos] >> 2) == CMP_REG_MEM_WITH_REGISTER_TO_EITHER)
+ {
+  return common_displacement(MNEMONIC_CMP, bytes, pos, inst);
+ }
+
+ if((bytes[pos] >> 2) == COMMON_IMMEDIATE_REG_MEM)
+ {
+  return common_immediate(bytes, pos, inst);
+ }
+
+ if((bytes[pos] >> 1) == ADD_IMMEDIATE_TO_ACCUMULATOR)
+ {
+  return immediate_accumulator(MNEMONIC_ADD, bytes, pos, inst);
+ }
+
+ if((bytes[pos] >> 1) == SUB_IMMEDIATE_FROM_ACCUMULATOR)
+ {
+  return immediate_accumulator(MNEMONIC_SUB, bytes, pos, inst);
+ }
+
+ if((bytes[pos] >> 1) == CMP_IMMEDIATE_WITH_ACCUMULATOR)
+ {
+  return immediate_accumulator(MNEMONIC_CMP, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JNE)
+ {
+  return short_jump(MNEMONIC_JNE, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JE)
+ {
+  return short_jump(MNEMONIC_JE, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JL)
+ {
+  return short_jump(MNEMONIC_JL, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JLE)
+ {
+  return short_jump(MNEMONIC_JLE, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JB)
+ {
+  return short_jump(MNEMONIC_JB, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JBE)
+ {
+  return short_jump(MNEMONIC_JBE, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JP)
+ {
+  return short_jump(MNEMONIC_JP, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JO)
+ {
+  return short_jump(MNEMONIC_JO, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JS)
+ {
+  return short_jump(MNEMONIC_JS, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JNL)
+ {
+  return short_jump(MNEMONIC_JNL, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JG)
+ {
+  return short_jump(MNEMONIC_JG, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JNB)
+ {
+  return short_jump(MNEMONIC_JNB, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JA)
+ {
+  return short_jump(MNEMONIC_JA, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JNP)
+ {
+  return short_jump(MNEMONIC_JNP, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JNO)
+ {
+  return short_jump(MNEMONIC_JNO, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JNS)
+ {
+  return short_jump(MNEMONIC_JNS, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == LOOP)
+ {
+  return short_jump(MNEMONIC_LOOP, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == LOOPZ)
+ {
+  return short_jump(MNEMONIC_LOOPZ, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == LOOPNZ)
+ {
+  return short_jump(MNEMONIC_LOOPNZ, bytes, pos, inst);
+ }
+
+ if(bytes[pos] == JCXZ)
+ {
+  return short_jump(MNEMONIC_JCXZ, bytes, pos, inst);
+ }
+
+ inst->form = FORM_UNKNOWN_OPCODE;
+ inst->data = bytes[pos];
+ return DECODE_ERROR;
+}
+
+// --resilient: the undecodable or truncated instruction at pos becomes a
+// "db 0xNN" line for its first byte, and decoding resumes at the next byte.
+// Returns pos, the last byte consumed, like the decode helpers.
+USIZE decode_data_byte(U8 *bytes, USIZE pos, Instruction *inst)
+{
+ memset(inst, 0, sizeof(*inst));
+ inst->form = FORM_DATA_BYTE;
+ inst->offset = pos;
+ inst->length = 1;
+ inst->data = bytes[pos];
+ return pos;
+}
+
+USIZE instruction_length(U8 *bytes, USIZE pos)
+{
+ // Mirrors the bytes consumed by decode_instruction() without decoding.
+ // Reads at most the opcode and ModRM byte. Returns 0 for unknown opcodes.
+ U8 op = bytes[pos];
+ U8 mod_field = (bytes[pos + 1] >> 6);
+ U8 rm_field = (bytes[pos + 1] & 0x07);
+ bool word_data = op & 0x01;
+
+ if((op >> 2) == MOV_REG_MEM_TO_FROM_REG ||
+    (op >> 2) == ADD_REG_MEM_WITH_REGISTER_TO_EITHER ||
+    (op >> 2) == SUB_REG_MEM_WITH_REGISTER_TO_EITHER ||
+    (op >> 2) == CMP_REG_MEM_WITH_REGISTER_TO_EITHER)
+ {
+  if(mod_field == 0x00 && rm_field == 0x06) return 4;
+  if(mod_field == 0x01) return 3;
+  if(mod_field == 0x02) return 4;
+  return 2;
+ }
+
+ if((op >> 4) == MOV_IMMEDIATE_TO_REG)
+ {
+  return (op & 0x08) ? 3 : 2;
+ }
+
+ if((op >> 2) == COMMON_IMMEDIATE_REG_MEM)
+ {
+  bool has_sign_extension = op & 0x02;
+  USIZE data_size = (!has_sign_extension && word_data) ? 2 : 1;
+  if(mod_field == 0x00 && rm_field == 0x06) return 4 + data_size;
+  if(mod_field == 0x01) return 3 + data_size;
+  if(mod_field == 0x02) return 4 + data_size;
+  return 2 + data_size;
+ }
+
+ if((op >> 1) == ADD_IMMEDIATE_TO_ACCUMULATOR ||
+    (op >> 1) == SUB_IMMEDIATE_FROM_ACCUMULATOR ||
+    (op >> 1) == CMP_IMMEDIATE_WITH_ACCUMULATOR)
+ {
+  return word_data ? 3 : 2;
+ }
+
+ if((op >> 4) == 0x07 || (op >= LOOPNZ && op <= JCXZ))
+ {
+  return 2;
+ }
+
+ return 0;
+}
+
+USIZE common_displacement(U8 mnemonic, U8 *bytes, USIZE pos, Instruction *inst)
+{
+ inst->form = FORM_REG_MEM;
+ inst->mnemonic = mnemonic;
+ inst->d = (bytes[pos] & 0x2); // 0b0000_00010
+ inst->w = (bytes[pos] & 0x1); // 0b0000_0001
 
  pos++;
- U8 mod_field = (bytes[pos] >> 6);
- U8 reg_field = (bytes[pos] & 0x38) >> 3;
- U8 rm_field = (bytes[pos] & 0x07);
+ inst->mod = (bytes[pos] >> 6);
+ inst->reg = (bytes[pos] & 0x38) >> 3; // 0b0011_1000 = 0x38
+ inst->rm = (bytes[pos] & 0x07); // 0b0000_0111
 
- char *name;
- switch(reg_field)
+ if(inst->mod == 0x00 && inst->rm == 0x06)
+ {
+  // 16-bit displacement. Therefore word register.
+  // And rm_field is direct address so destination must be in reg_field.
+  // Example: mov bp, [5]    -> 0x8B 0x2E 0x05 0x00
+  // Example: mov bx, [3458] -> 0x8B 0x1E 0x82 0x0D
+  U16 disp_low = bytes[++pos];
+  U16 disp_high = bytes[++pos];
+  inst->displacement = (disp_high << 8) | disp_low;
+  return pos;
+ }
+
+ if(inst->mod == 0x01)
+ {
+  // Example: mov ah, [bx + si + 4]
+  inst->displacement = bytes[++pos];
+  return pos;
+ }
+
+ if(inst->mod == 0x02)
+ {
+  // Example: mov al, [bx + si + 4999]
+  U16 disp_low = bytes[++pos];
+  U16 disp_high = bytes[++pos];
+  inst->displacement = (disp_high << 8) | disp_low;
+  return pos;
+ }
+
+ // mod 00: mov al, [bx + si]
+ // mod 11: mov si, bx
+ return pos;
+}
+
+USIZE common_immediate(U8 *bytes, USIZE pos, Instruction *inst)
+{
+ inst->form = FORM_IMMEDIATE_REG_MEM;
+ inst->s = bytes[pos] & 0x02;
+ inst->w = bytes[pos] & 0x01;
+
+ pos++;
+ inst->mod = (bytes[pos] >> 6);
+ inst->reg = (bytes[pos] & 0x38) >> 3;
+ inst->rm = (bytes[pos] & 0x07);
+
+ switch(inst->reg)
  {
   case 0x00:
-   name = "add";
+   inst->mnemonic = MNEMONIC_ADD;
    break;
   case 0x05:
-   name = "sub";
+   inst->mnemonic = MNEMONIC_SUB;
    break;
   case 0x07:
-   name = "cmp";
+   inst->mnemonic = MNEMONIC_CMP;
    break;
   default:
-   printf("Error: Unknown mnemonic for %u\n", reg_field);
-   return MAX_INSTRUCTION_FILE_SIZE + 1;
+   inst->form = FORM_UNKNOWN_MNEMONIC;
+   return DECODE_ERROR;
  }
 
- if(mod_field == 0x00 && rm_field == 0x06)
+ if(inst->mod == 0x00 && inst->rm == 0x06)
  {
   // cmp word [4834], 29
   U16 disp_low = bytes[++pos];
   U16 disp_high = bytes[++pos];
-  U16 displacement = (disp_high << 8) | disp_low;
+  inst->displacement = (disp_high << 8) | disp_low;
+ }
+ else if(inst->mod == 0x01)
+ {
+  // Example: add word [bp + 2], 5
+  inst->displacement = bytes[++pos];
+ }
+ else if(inst->mod == 0x02)
+ {
+  // Example: sub byte [bx + 1000], 7
+  U16 disp_low = bytes[++pos];
+  U16 disp_high = bytes[++pos];
+  inst->displacement = (disp_high << 8) | disp_low;
+ }
 
-  U8 data = bytes[++pos];
-  printf("%s [%u], %u\n", name, displacement, data); 
-  return pos;
+ // Only 0x81 carries a word immediate, 0x83 sign-extends a byte.
+ if(!inst->s && inst->w)
+ {
+  U16 data_low = bytes[++pos];
+  U16 data_high = bytes[++pos];
+  inst->data = (data_high << 8) | data_low;
+ }
+ else
+ {
+  inst->data = bytes[++pos];
  }
+ return pos;
+}
+
+USIZE mov_immediate_to_reg(U8 *bytes, USIZE pos, Instruction *inst)
+{
+ inst->form = FORM_IMMEDIATE_TO_REG;
+ inst->mnemonic = MNEMONIC_MOV;
+ inst->w = bytes[pos] & 0x08; // 0b0000_1000
+ inst->reg = bytes[pos] & 0x07; // 0b0000_0111
 
- if(mod_field == 0x00)
+ if(inst->w)
  {
-  char *rm_str = eac_table[rm_field];
-  U8 data_low = bytes[++pos];
-  printf("%s [%s], %u\n", name, rm_str, data_low);
-  return pos;
+  // Example: mov dx, 3948
+  // Example: mov dx, -3948
+  U16 data_low = bytes[++pos];
+  U16 data_high = bytes[++pos];
+  inst->data = (data_high << 8) | data_low;
  }
+ else
+ {
+  // Example: mov cl, 12
+  // Example: mov ch, -12
+  inst->data = bytes[++pos];
+ }
+ return pos;
+}
 
- if(mod_field == 0x01)
+USIZE immediate_accumulator(U8 mnemonic, U8 *bytes, USIZE pos, Instruction *inst)
+{
+ inst->form = FORM_IMMEDIATE_ACCUMULATOR;
+ inst->mnemonic = mnemonic;
+ inst->w = (bytes[pos] & 0x01);
+ if(inst->w)
+ {
+  U16 data_low = bytes[++pos];
+  U16 data_high = bytes[++pos];
+  inst->data = (data_high << 8) | data_low;
+ }
+ else
  {
-  char *rm_str = eac_table[rm_field];
+  inst->data = bytes[++pos];
+ }
+ return pos;
+}
 
-  U8 displacement = bytes[++pos];
+USIZE short_jump(U8 mnemonic, U8 *bytes, USIZE pos, Instruction *inst)
+{
+ inst->form = FORM_JUMP;
+ inst->mnemonic = mnemonic;
+ inst->displacement = bytes[++pos];
+ return pos;
+}
 
-  U16 data;
-  if (word_data)
-  {
-   U16 data_low = bytes[++pos];
-   U16 data_high = bytes[++pos];
-   data = (data_high << 8) | data_low;
-  }
-  else
-  {
-   data = bytes[++pos];
-  }
-  
-  printf("%s [%s + %u], %u\n", name, rm_str, displacement, data);
-  return pos;
- }
+void set_fragment(OperandFragment *fragment, U8 numbers, char *head, char *mid)
+{
+ fragment->numbers = numbers;
+ fragment->head_length = (U8)snprintf(fragment->head, sizeof(fragment->head), "%s", head);
+ fragment->mid_length = (U8)snprintf(fragment->mid, sizeof(fragment->mid), "%s", mid);
+}
 
- if(mod_field == 0x02)
+void build_operand_fragments(void)
+{
+ char head[32];
+ char mid[32];
+
+ for(U8 m = 0; m < MNEMONIC_COUNT; m++)
  {
-  char *rm_str = eac_table[rm_field];
+  snprintf(head, sizeof(head), "%s ", mnemonic_names[m]);
+  set_fragment(&mnemonic_fragments[m], 0, head, "");
+ }
 
-  U16 displacement;
-  if(word_data)
+ for(U32 index = 0; index < 2048; index++)
+ {
+  // Same layouts as the displacement cases in common_displacement().
+  U8 modrm = index & 0xFF;
+  bool w = index & 0x100;
+  bool d = index & 0x200;
+  bool zero_disp = index & 0x400;
+  U8 mod = modrm >> 6;
+  U8 reg = (modrm >> 3) & 0x07;
+  U8 rm = modrm & 0x07;
+  char **registers = w ? word_registers : byte_registers;
+  char *reg_str = registers[reg];
+  char *rm_str = eac_table[rm];
+  OperandFragment *fragment = &reg_mem_fragments[index];
+
+  if(mod == 0x00 && rm == 0x06)
   {
-   U16 disp_low = bytes[++pos];
-   U16 disp_high = bytes[++pos];
-   displacement = (disp_high << 8) | disp_low;
+   snprintf(head, sizeof(head), "%s, [", word_registers[reg]);
+   set_fragment(fragment, 1, head, "]");
   }
-  else
+  else if(mod == 0x03)
   {
-   displacement = bytes[++pos];
+   snprintf(head, sizeof(head), "%s, %s", d ? reg_str : registers[rm], d ? registers[rm] : reg_str);
+   set_fragment(fragment, 0, head, "");
   }
-   
-  U16 data;
-  if(!has_sign_extension && word_data)
+  else if(mod == 0x00 || zero_disp)
   {
-   U16 data_low = bytes[++pos];
-   U16 data_high = bytes[++pos];
-   data = (data_high << 8) | data_low;
+   if(d)
+   {
+    snprintf(head, sizeof(head), "%s, [%s]", reg_str, rm_str);
+   }
+   else if(mod == 0x02)
+   {
+    snprintf(head, sizeof(head), "%s, [%s]", rm_str, reg_str);
+   }
+   else
+   {
+    snprintf(head, sizeof(head), "[%s], %s", rm_str, reg_str);
+   }
+   set_fragment(fragment, 0, head, "");
   }
   else
   {
-   data = bytes[++pos];
+   if(d)
+   {
+    snprintf(head, sizeof(head), "%s, [%s + ", reg_str, rm_str);
+    snprintf(mid, sizeof(mid), "]");
+   }
+   else if(mod == 0x02)
+   {
+    snprintf(head, sizeof(head), "%s, [%s + ", rm_str, reg_str);
+    snprintf(mid, sizeof(mid), "]");
+   }
+   else
+   {
+    snprintf(head, sizeof(head), "[%s + ", rm_str);
+    snprintf(mid, sizeof(mid), "], %s", reg_str);
+   }
+   set_fragment(fragment, 1, head, mid);
   }
- 
-  printf("%s [%s + %u], %u\n", name, rm_str, displacement, data);
-  return pos;
  }
 
- if(mod_field == 0x03)
+ for(U32 index = 0; index < 64; index++)
  {
-  char *rm_str;
-  if (word_data)
+  // Same layouts as common_immediate(). Numbers are displacement then data.
+  U8 rm = index & 0x07;
+  U8 mod = (index >> 3) & 0x03;
+  bool w = index & 0x20;
+  OperandFragment *fragment = &immediate_fragments[index];
+
+  if(mod == 0x00 && rm == 0x06)
   {
-   rm_str = word_registers[rm_field];
+   set_fragment(fragment, 2, "[", "], ");
   }
-  else
+  else if(mod == 0x00)
   {
-   rm_str = byte_registers[rm_field];
+   snprintf(head, sizeof(head), "[%s], ", eac_table[rm]);
+   set_fragment(fragment, 1, head, "");
   }
-
-  U16 data;
-  if(!has_sign_extension && word_data)
+  else if(mod == 0x03)
   {
-   U16 data_low = bytes[++pos];
-   U16 data_high = bytes[++pos];
-   data = (data_high << 8) | data_low;
+   snprintf(head, sizeof(head), "%s, ", w ? word_registers[rm] : byte_registers[rm]);
+   set_fragment(fragment, 1, head, "");
   }
   else
   {
-   data = bytes[++pos];
+   snprintf(head, sizeof(head), "[%s + ", eac_table[rm]);
+   set_fragment(fragment, 2, head, "], ");
   }
+ }
 
-  printf("%s %s, %u\n", name, rm_str, data);
-  return pos;
+ for(U32 index = 0; index < 16; index++)
+ {
+  bool w = index & 0x08;
+  snprintf(head, sizeof(head), "%s, ", w ? word_registers[index & 0x07] : byte_registers[index & 0x07]);
+  set_fragment(&immediate_to_reg_fragments[index], 1, head, "");
  }
 
- printf("Error: Common immediate found but could not be processed correctly\n");
- return MAX_INSTRUCTION_FILE_SIZE + 1;
+ set_fragment(&accumulator_fragments[0], 1, "al, ", "");
+ set_fragment(&accumulator_fragments[1], 1, "ax, ", "");
 }
 
-USIZE mov_immediate_to_reg(U8 *bytes, USIZE pos)
+// Fixed-size copies, the caller reserves MAX_LINE_LENGTH bytes per line.
+char *emit_text(char *out, char *text, USIZE size, U8 length)
 {
- bool word_data = bytes[pos] & 0x08; // 0b0000_1000
- U8 reg_field = bytes[pos] & 0x07; // 0b0000_0111
- 
- if(word_data)
+ memcpy(out, text, size);
+ return out + length;
+}
+
+char *emit_unsigned(char *out, U32 value)
+{
+ USIZE length = value >= 10000 ? 5 : value >= 1000 ? 4 : value >= 100 ? 3 : value >= 10 ? 2 : 1;
+ for(USIZE i = length; i; i--)
  {
-  // Example: mov dx, 3948
-  // Example: mov dx, -3948
-  S16 data_low = bytes[++pos];
-  S16 data_high = bytes[++pos];
-  S16 data = (data_high << 8) | data_low;
-  printf("mov %s, %d\n", word_registers[reg_field], data);
-  return pos;
+  out[i - 1] = (char)('0' + value % 10);
+  value /= 10;
  }
- else
+ return out + length;
+}
+
+char *emit_signed(char *out, S32 value)
+{
+ if(value < 0)
  {
-  // Example: mov cl, 12
-  // Example: mov ch, -12
-  S8 data = bytes[++pos];
-  printf("mov %s, %d\n", byte_registers[reg_field], data);
-  return pos;
+  *out++ = '-';
+  return emit_unsigned(out, (U32)-value);
  }
+ return emit_unsigned(out, (U32)value);
 }
 
-USIZE immediate_accumulator(char *name, U8 *bytes, USIZE pos)
+char *emit_operands(char *out, OperandFragment *fragment, U32 first, U32 second)
 {
- bool word_data = (bytes[pos] & 0x01);
- if(word_data)
+ out = emit_text(out, fragment->head, sizeof(fragment->head), fragment->head_length);
+ if(fragment->numbers)
  {
-  U16 data_low = bytes[++pos];
-  U16 data_high = bytes[++pos];
-  U16 data = (data_high << 8) | data_low;
-  printf("%s ax, %u\n", name, data);
-  return pos;
+  out = emit_unsigned(out, first);
+  out = emit_text(out, fragment->mid, sizeof(fragment->mid), fragment->mid_length);
+  if(fragment->numbers == 2)
+  {
+   out = emit_unsigned(out, second);
+  }
  }
- else
+ return out;
+}
+
+USIZE format_instruction(Instruction *inst, char *out)
+{
+ char *start = out;
+ OperandFragment *name = &mnemonic_fragments[inst->mnemonic];
+
+ switch(inst->form)
  {
-  U8 data = bytes[++pos];
-  printf("%s al, %u\n", name, data);
-  return pos;
+  case FORM_REG_MEM:
+  {
+   U32 index = (inst->displacement == 0) << 10 | inst->d << 9 | inst->w << 8 |
+               inst->mod << 6 | inst->reg << 3 | inst->rm;
+   out = emit_text(out, name->head, sizeof(name->head), name->head_length);
+   out = emit_operands(out, &reg_mem_fragments[index], inst->displacement, 0);
+   break;
+  }
+
+  case FORM_IMMEDIATE_REG_MEM:
+  {
+   // 0x83 sign-extends its byte immediate, as sim.c executes it.
+   // Example: add ax, -5
+   OperandFragment *fragment = &immediate_fragments[inst->w << 5 | inst->mod << 3 | inst->rm];
+   S32 data = inst->s && inst->w ? (S8)inst->data : (S32)inst->data;
+   out = emit_text(out, name->head, sizeof(name->head), name->head_length);
+   out = emit_text(out, fragment->head, sizeof(fragment->head), fragment->head_length);
+   if(fragment->numbers == 2)
+   {
+    out = emit_unsigned(out, inst->displacement);
+    out = emit_text(out, fragment->mid, sizeof(fragment->mid), fragment->mid_length);
+    out = emit_signed(out, data);
+   }
+   else
+   {
+    out = emit_signed(out, data);
+    out = emit_text(out, fragment->mid, sizeof(fragment->mid), fragment->mid_length);
+   }
+   break;
+  }
+
+  case FORM_IMMEDIATE_TO_REG:
+  {
+   OperandFragment *fragment = &immediate_to_reg_fragments[inst->w << 3 | inst->reg];
+   out = emit_text(out, name->head, sizeof(name->head), name->head_length);
+   out = emit_text(out, fragment->head, sizeof(fragment->head), fragment->head_length);
+   out = emit_signed(out, inst->w ? (S16)inst->data : (S8)inst->data);
+   break;
+  }
+
+  case FORM_IMMEDIATE_ACCUMULATOR:
+  {
+   out = emit_text(out, name->head, sizeof(name->head), name->head_length);
+   out = emit_operands(out, &accumulator_fragments[inst->w], inst->data, 0);
+   break;
+  }
+
+  case FORM_JUMP:
+  {
+   out = emit_text(out, name->head, sizeof(name->head), name->head_length);
+   out = emit_signed(out, (S8)inst->displacement);
+   break;
+  }
+
+  case FORM_UNKNOWN_MNEMONIC:
+  {
+   return sprintf(out, "Error: Unknown mnemonic for %u\n", inst->reg);
+  }
+
+  case FORM_UNKNOWN_OPCODE:
+  {
+   return sprintf(out, "Error: Unknown opcode 0x%02X\n", inst->data);
+  }
+
+  case FORM_TRUNCATED:
+  {
+   return sprintf(out, "Error: truncated instruction at offset %zu\n", inst->offset);
+  }
+
+  case FORM_DATA_BYTE:
+  {
+   return sprintf(out, "db 0x%02X\n", inst->data);
+  }
  }
+
+ *out++ = '\n';
+ return out - start;
 }
 
-USIZE read_instruction_bytes(U8 *bytes)
+USIZE read_instruction_bytes(char *filename, U8 *bytes)
 {
- char *filename = "instructions";
  FILE *fb = fopen(filename, "rb");
  if(!fb)
  {
@@ -693,7 +1239,7 @@ USIZE read_instruction_bytes(U8 *bytes)
  while(1) 
  {
   USIZE elements_read = fread(&byte, element_size, nr_of_elements, fb);  
-  if(elements_read != nr_of_elements)
+  if(elements_read != nr_of_elements || bytes_read == MAX_INSTRUCTION_FILE_SIZE)
   {
    break;
   }
@@ -708,23 +1254,69 @@ USIZE read_instruction_bytes(U8 *bytes)
  return bytes_read;
 }
 
-void debug_print_byte(U8 byte)
+U8 *map_instruction_bytes(char *filename, USIZE *bytes_read, USIZE *mapped_size)
 {
- S8 bit_str[9] = {0};
- for(U8 i = 0, j = 7; i < 8; i++, j--)
+ // Only regular files are mapped. Checked before opening so that a FIFO is
+ // left untouched for read_instruction_bytes().
+ struct stat st;
+ if(stat(filename, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
  {
-  if((byte >> i) & 0x1)
-  {
-   bit_str[j] = '1';
-  }
-  else
-  {
-   bit_str[j] = '0';
-  }
+  return 0;
  }
- bit_str[8] = '\0';
 
- char debug_str[16];
- sprintf(debug_str, "0x%02X: %s\n", byte, bit_str);
+ int fd = open(filename, O_RDONLY);
+ if(fd < 0)
+ {
+  return 0;
+ }
+
+ // Reserve zeroed anonymous pages for the file plus its tail padding, then
+ // map the file over the front. Bytes past EOF in the last file page read as
+ // zero, and the anonymous pages behind it cover the rest of the padding.
+ USIZE page_size = (USIZE)sysconf(_SC_PAGESIZE);
+ USIZE file_size = (USIZE)st.st_size;
+ USIZE size = (file_size + INPUT_TAIL_PADDING + page_size - 1) & ~(page_size - 1);
+ U8 *base = mmap(0, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+ if(base == MAP_FAILED)
+ {
+  close(fd);
+  return 0;
+ }
+
+ if(mmap(base, file_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+ {
+  munmap(base, size);
+  close(fd);
+  return 0;
+ }
+
+ close(fd);
+ *bytes_read = file_size;
+ *mapped_size = size;
+ return base;
+}
+
+U64 now_ns(void)
+{
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC, &ts);
+ return (U64)ts.tv_sec * 1000000000ull + (U64)ts.tv_nsec;
 }
 
+#include "pipeline.c"
+#include "stream.c"
+#include "cfg.c"
+#include "superset.c"
+#include "corpus.c"
+#include "stats.c"
+#include "packed.c"
+#include "encode.c"
+#include "verify.c"
+#include "enumerate.c"
+#include "sim.c"
+#include "jit.c"
+#include "snapshot.c"
+#include "trace.c"
+#include "batch.c"
+#include "patch.c"
+#include "server.c"
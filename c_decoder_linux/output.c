@@ -0,0 +1,229 @@
+// Output backend. Formatted lines go straight into a ring of page-aligned
+// buffers instead of through stdio. Filled buffers are pushed with one
+// writev() per ring, or, when stdout is a pipe, handed to the pipe with
+// vmsplice() so the kernel references the pages instead of copying them.
+// Included from main.c after the declarations.
+
+#include <sys/uio.h>
+
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+#define OUTPUT_BUFFER_COUNT 16
+
+enum
+{
+ OUTPUT_WRITEV,
+ OUTPUT_VMSPLICE,
+};
+
+typedef struct
+{
+ int fd;
+ int mode;
+ char *base; // OUTPUT_BUFFER_COUNT buffers of OUTPUT_BUFFER_SIZE, page aligned
+ USIZE used[OUTPUT_BUFFER_COUNT];
+ USIZE current; // Buffer being filled
+ USIZE first_pending; // Oldest filled buffer not yet pushed (writev mode)
+ USIZE spliced; // Bytes of the current buffer already spliced (vmsplice mode)
+ bool failed;
+
+ // Throughput counters
+ U64 bytes;
+ U64 syscalls;
+ U64 ns;
+} Output;
+
+bool output_open(Output *out, int fd)
+{
+ memset(out, 0, sizeof(*out));
+ out->fd = fd;
+ out->mode = OUTPUT_WRITEV;
+ out->base = mmap(0, OUTPUT_BUFFER_SIZE * OUTPUT_BUFFER_COUNT, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+ if(out->base == MAP_FAILED)
+ {
+  fprintf(stderr, "Error: %s: output buffers\n", strerror(errno));
+  out->base = 0;
+  return false;
+ }
+
+ // A spliced buffer stays referenced by the pipe until the reader drains
+ // it. A buffer is only refilled after the other buffers of the ring have
+ // been filled and spliced behind it, so the pipe must never hold more.
+ struct stat st;
+ if(fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+ {
+  int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+  if(pipe_size > 0 && (USIZE)pipe_size <= OUTPUT_BUFFER_SIZE * (OUTPUT_BUFFER_COUNT - 1))
+  {
+   out->mode = OUTPUT_VMSPLICE;
+  }
+ }
+ return true;
+}
+
+// Splices the unspliced part of the current buffer.
+void output_vmsplice(Output *out)
+{
+ char *buffer = out->base + out->current * OUTPUT_BUFFER_SIZE;
+ struct iovec iov = {buffer + out->spliced, out->used[out->current] - out->spliced};
+ while(iov.iov_len && !out->failed)
+ {
+  ssize_t n = vmsplice(out->fd, &iov, 1, 0);
+  out->syscalls++;
+  if(n < 0 && errno == EINTR)
+  {
+   continue;
+  }
+  if(n < 0 && out->syscalls == 1)
+  {
+   // vmsplice() refused the very first buffer, nothing is referenced by
+   // the pipe yet. Copy from here on.
+   out->mode = OUTPUT_WRITEV;
+   out->first_pending = out->current;
+   return;
+  }
+  if(n <= 0)
+  {
+   out->failed = true;
+   break;
+  }
+  iov.iov_base = (char *)iov.iov_base + n;
+  iov.iov_len -= (USIZE)n;
+ }
+ out->spliced = out->used[out->current];
+}
+
+// Pushes buffers first_pending up to and including the current one.
+void output_writev(Output *out)
+{
+ struct iovec iov[OUTPUT_BUFFER_COUNT];
+ int count = 0;
+ for(USIZE i = out->first_pending;; i = (i + 1) % OUTPUT_BUFFER_COUNT)
+ {
+  if(out->used[i])
+  {
+   iov[count].iov_base = out->base + i * OUTPUT_BUFFER_SIZE;
+   iov[count].iov_len = out->used[i];
+   count++;
+  }
+  if(i == out->current)
+  {
+   break;
+  }
+ }
+
+ struct iovec *next = iov;
+ while(count && !out->failed)
+ {
+  ssize_t n = writev(out->fd, next, count);
+  out->syscalls++;
+  if(n < 0 && errno == EINTR)
+  {
+   continue;
+  }
+  if(n <= 0)
+  {
+   out->failed = true;
+   break;
+  }
+
+  // Skip what was written, possibly stopping inside a buffer.
+  USIZE written = (USIZE)n;
+  while(count && written >= next->iov_len)
+  {
+   written -= next->iov_len;
+   next++;
+   count--;
+  }
+  if(count)
+  {
+   next->iov_base = (char *)next->iov_base + written;
+   next->iov_len -= written;
+  }
+ }
+}
+
+// Hands the current buffer over and moves to the next one.
+void output_next_buffer(Output *out)
+{
+ U64 start = now_ns();
+
+ if(out->mode == OUTPUT_VMSPLICE)
+ {
+  output_vmsplice(out);
+ }
+
+ if(out->mode == OUTPUT_WRITEV && (out->current + 1) % OUTPUT_BUFFER_COUNT == out->first_pending)
+ {
+  // Ring full, push it all in one call.
+  output_writev(out);
+  out->first_pending = (out->current + 1) % OUTPUT_BUFFER_COUNT;
+ }
+
+ out->current = (out->current + 1) % OUTPUT_BUFFER_COUNT;
+ out->used[out->current] = 0;
+ out->spliced = 0;
+ out->ns += now_ns() - start;
+}
+
+// Returns space for at least max_size bytes. Follow with output_commit().
+char *output_reserve(Output *out, USIZE max_size)
+{
+ if(out->used[out->current] + max_size > OUTPUT_BUFFER_SIZE)
+ {
+  output_next_buffer(out);
+ }
+ return out->base + out->current * OUTPUT_BUFFER_SIZE + out->used[out->current];
+}
+
+void output_commit(Output *out, USIZE size)
+{
+ out->used[out->current] += size;
+ out->bytes += size;
+}
+
+void output_write_instruction(Output *out, Instruction *inst)
+{
+ char *line = output_reserve(out, MAX_LINE_LENGTH);
+ output_commit(out, format_instruction(inst, line));
+}
+
+// Pushes everything written so far.
+void output_flush(Output *out)
+{
+ if(!out->base)
+ {
+  return;
+ }
+
+ U64 start = now_ns();
+ if(out->mode == OUTPUT_VMSPLICE)
+ {
+  // Keeps filling the same buffer, see output_open().
+  output_vmsplice(out);
+ }
+
+ if(out->mode == OUTPUT_WRITEV)
+ {
+  // writev() copied the data, every buffer is free again.
+  output_writev(out);
+  memset(out->used, 0, sizeof(out->used));
+  out->current = 0;
+  out->first_pending = 0;
+ }
+ out->ns += now_ns() - start;
+}
+
+// Flushes. The mapping is left alone: spliced pages may still be in the pipe.
+void output_close(Output *out, bool report)
+{
+ output_flush(out);
+ if(report)
+ {
+  double seconds = (double)out->ns / 1e9;
+  fprintf(stderr, "output: %s, %llu bytes, %llu syscalls, %.3f s in output, %.1f MB/s\n",
+          out->mode == OUTPUT_VMSPLICE ? "vmsplice" : "writev",
+          (unsigned long long)out->bytes, (unsigned long long)out->syscalls, seconds,
+          seconds > 0 ? (double)out->bytes / 1e6 / seconds : 0.0);
+ }
+}
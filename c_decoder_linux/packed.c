@@ -0,0 +1,262 @@
+// Packed instructions, selected with --packed. Every Instruction except its
+// offset fits one U64, so a corpus of decoded instructions costs 8 bytes
+// each instead of sizeof(Instruction) or a line of text. Included at the
+// bottom of main.c.
+//
+//   bits  0..15  displacement
+//   bits 16..31  data
+//   bits 32..35  length
+//   bits 36..39  form
+//   bits 40..44  mnemonic
+//   bits 45..46  mod
+//   bits 47..49  reg
+//   bits 50..52  rm
+//   bit  53      w
+//   bit  54      d
+//   bit  55      s
+//   bits 56..63  0, or PACKED_ESCAPE_TAG
+//
+// Offsets are implicit: an instruction starts where the previous one ends.
+// The rare instruction that does not (the first one, or one after a gap) is
+// preceded by an escape word, the tag plus the offset in the low 56 bits.
+// A truncated instruction is stored with length 0.
+//
+// --packed decodes the input into a PackedCorpus and prints the listing from
+// it, which matches the plain listing. With --output-stats the footprint of
+// the corpus is compared against the unpacked forms.
+
+#define PACKED_ESCAPE_TAG 0xFFull
+#define PACKED_OFFSET_MASK ((1ull << 56) - 1)
+
+_Static_assert(MNEMONIC_COUNT <= 32, "mnemonic does not fit 5 bits");
+_Static_assert(FORM_DATA_BYTE < 16, "form does not fit 4 bits");
+_Static_assert(MAX_INSTRUCTION_LENGTH < 16, "length does not fit 4 bits");
+
+typedef struct
+{
+ U64 *words;
+ USIZE count; // Words, including escapes
+ USIZE capacity;
+ USIZE instructions;
+ USIZE escapes;
+ USIZE end; // Offset the next instruction is expected at
+} PackedCorpus;
+
+U64 pack_instruction(Instruction *inst)
+{
+ return (U64)inst->displacement |
+        (U64)inst->data << 16 |
+        (U64)(inst->length & 0xF) << 32 |
+        (U64)inst->form << 36 |
+        (U64)inst->mnemonic << 40 |
+        (U64)inst->mod << 45 |
+        (U64)inst->reg << 47 |
+        (U64)inst->rm << 50 |
+        (U64)inst->w << 53 |
+        (U64)inst->d << 54 |
+        (U64)inst->s << 55;
+}
+
+U16 packed_displacement(U64 word)
+{
+ return (U16)word;
+}
+
+U16 packed_data(U64 word)
+{
+ return (U16)(word >> 16);
+}
+
+U8 packed_length(U64 word)
+{
+ return (U8)((word >> 32) & 0xF);
+}
+
+U8 packed_form(U64 word)
+{
+ return (U8)((word >> 36) & 0xF);
+}
+
+U8 packed_mnemonic(U64 word)
+{
+ return (U8)((word >> 40) & 0x1F);
+}
+
+U8 packed_mod(U64 word)
+{
+ return (U8)((word >> 45) & 0x3);
+}
+
+U8 packed_reg(U64 word)
+{
+ return (U8)((word >> 47) & 0x7);
+}
+
+U8 packed_rm(U64 word)
+{
+ return (U8)((word >> 50) & 0x7);
+}
+
+bool packed_w(U64 word)
+{
+ return (word >> 53) & 1;
+}
+
+bool packed_d(U64 word)
+{
+ return (word >> 54) & 1;
+}
+
+bool packed_s(U64 word)
+{
+ return (word >> 55) & 1;
+}
+
+bool packed_is_escape(U64 word)
+{
+ return (word >> 56) == PACKED_ESCAPE_TAG;
+}
+
+void unpack_instruction(U64 word, USIZE offset, Instruction *inst)
+{
+ inst->offset = offset;
+ inst->displacement = packed_displacement(word);
+ inst->data = packed_data(word);
+ inst->length = packed_length(word);
+ inst->form = packed_form(word);
+ inst->mnemonic = packed_mnemonic(word);
+ inst->mod = packed_mod(word);
+ inst->reg = packed_reg(word);
+ inst->rm = packed_rm(word);
+ inst->w = packed_w(word);
+ inst->d = packed_d(word);
+ inst->s = packed_s(word);
+}
+
+void packed_push(PackedCorpus *corpus, U64 word)
+{
+ if(corpus->count == corpus->capacity)
+ {
+  corpus->capacity = corpus->capacity ? corpus->capacity * 2 : 4096;
+  corpus->words = realloc(corpus->words, corpus->capacity * sizeof(U64));
+ }
+ corpus->words[corpus->count++] = word;
+}
+
+void packed_append(PackedCorpus *corpus, Instruction *inst)
+{
+ if(corpus->instructions == 0 || inst->offset != corpus->end)
+ {
+  packed_push(corpus, PACKED_ESCAPE_TAG << 56 | ((U64)inst->offset & PACKED_OFFSET_MASK));
+  corpus->escapes++;
+ }
+
+ // Only the forms that decoded carry a length, see format_instruction().
+ U8 length = inst->form == FORM_TRUNCATED ? 0 : inst->length;
+ Instruction copy = *inst;
+ copy.length = length;
+ packed_push(corpus, pack_instruction(&copy));
+ corpus->instructions++;
+ corpus->end = inst->offset + length;
+}
+
+// Decodes like main(): stops after the first error or truncated
+// instruction, unless resilient.
+USIZE packed_build(PackedCorpus *corpus, U8 *bytes, USIZE size, bool resilient)
+{
+ Instruction inst = {0};
+ USIZE data_bytes = 0;
+ USIZE pos = 0;
+ while(pos < size)
+ {
+  // The tail padding keeps the opcode and ModRM reads in bounds.
+  USIZE length = instruction_length(bytes, pos);
+  USIZE next = DECODE_ERROR;
+  if(length && pos + length > size)
+  {
+   memset(&inst, 0, sizeof(inst));
+   inst.form = FORM_TRUNCATED;
+   inst.offset = pos;
+  }
+  else
+  {
+   next = decode_instruction(bytes, pos, &inst);
+  }
+
+  if(next == DECODE_ERROR && resilient)
+  {
+   next = decode_data_byte(bytes, pos, &inst);
+   data_bytes++;
+  }
+  packed_append(corpus, &inst);
+  if(next == DECODE_ERROR)
+  {
+   break;
+  }
+  pos = next + 1;
+ }
+ return data_bytes;
+}
+
+int run_packed(U8 *bytes, USIZE size, bool output_stats, bool resilient)
+{
+ Output out;
+ if(!output_open(&out, STDOUT_FILENO))
+ {
+  return 1;
+ }
+
+ U64 start = now_ns();
+ PackedCorpus corpus = {0};
+ USIZE data_bytes = packed_build(&corpus, bytes, size, resilient);
+ U64 build_ns = now_ns() - start;
+
+ start = now_ns();
+ Instruction inst = {0};
+ USIZE offset = 0;
+ USIZE text_size = 0;
+ for(USIZE i = 0; i < corpus.count; i++)
+ {
+  U64 word = corpus.words[i];
+  if(packed_is_escape(word))
+  {
+   offset = (USIZE)(word & PACKED_OFFSET_MASK);
+   continue;
+  }
+  unpack_instruction(word, offset, &inst);
+  offset += inst.length;
+
+  char *line = output_reserve(&out, MAX_LINE_LENGTH);
+  USIZE length = format_instruction(&inst, line);
+  output_commit(&out, length);
+  text_size += length;
+ }
+ U64 emit_ns = now_ns() - start;
+
+ if(output_stats)
+ {
+  // The columnar corpus of --query stores 7 byte columns, 2 word columns
+  // and the offset per row.
+  USIZE count = corpus.instructions;
+  USIZE packed_size = corpus.count * sizeof(U64);
+  USIZE column_size = count * (7 * sizeof(U8) + 2 * sizeof(U16) + sizeof(USIZE));
+  fprintf(stderr, "packed: %zu instructions, %zu escapes, %.3f s packing, %.3f s unpacking and formatting\n",
+          count, corpus.escapes, (double)build_ns / 1e9, (double)emit_ns / 1e9);
+  fprintf(stderr, "packed: %-10s %12zu bytes %6.2f bytes/instruction\n", "packed", packed_size,
+          count ? (double)packed_size / (double)count : 0.0);
+  fprintf(stderr, "packed: %-10s %12zu bytes %6.2f bytes/instruction\n", "struct", count * sizeof(Instruction),
+          (double)sizeof(Instruction));
+  fprintf(stderr, "packed: %-10s %12zu bytes %6.2f bytes/instruction\n", "columns", column_size,
+          count ? (double)column_size / (double)count : 0.0);
+  fprintf(stderr, "packed: %-10s %12zu bytes %6.2f bytes/instruction\n", "text", text_size,
+          count ? (double)text_size / (double)count : 0.0);
+ }
+ output_close(&out, output_stats);
+ if(data_bytes)
+ {
+  fprintf(stderr, "resilient: %zu undecodable bytes emitted as db\n", data_bytes);
+ }
+
+ free(corpus.words);
+ return 0;
+}
@@ -0,0 +1,595 @@
+// Incremental re-decode, selected with --patch <file>. Prints the listing
+// of the input, then writes the byte patches of the file into it one by one
+// and prints after each how the listing changed. Included at the bottom of
+// main.c.
+//
+// Each line of the file is an offset and the bytes to write there, in hex;
+// lines starting with # are skipped. Patches overwrite, they never move the
+// bytes after them.
+//
+// Example: 0x1F0 90 90 C3
+//
+// The decoded instructions stay in memory, in chunks of up to
+// PATCH_CHUNK_SIZE, next to a bitmap of the offsets they start at. A patch
+// to [a, b) is decoded again from the last instruction that starts before a
+// until the decode reaches an offset at or past b where an old instruction
+// starts: from there on the bytes and so the instructions are the old ones.
+// Only the chunks the re-decoded range touches are rebuilt, and a Fenwick
+// tree over the chunk counts gives line numbers, so a patch costs about as
+// much as the instructions it changes. Chunks start PATCH_CHUNK_FILL full;
+// the chunk table moves only when a patch outgrows or empties its chunks.
+//
+// The change is printed as a hunk in the style of a unified diff, with the
+// 1-based line of the first changed instruction, the lines removed and the
+// lines added:
+//
+//   @@ -12,2 +12,3 @@ patch 1 at 0x0020
+//   -mov ax, 1
+//   -add ax, bx
+//   +nop
+//   +nop
+//   +nop
+//
+// --output-stats compares the bytes re-decoded with the size of the input.
+
+#define PATCH_CHUNK_SIZE 256
+#define PATCH_CHUNK_FILL 192 // Leaves room for instructions a patch adds
+
+typedef struct
+{
+ USIZE offset;
+ USIZE length;
+ USIZE first; // Index of the bytes in PatchList.bytes
+} Patch;
+
+typedef struct
+{
+ Patch *list;
+ USIZE count;
+ U8 *bytes;
+ USIZE byte_count;
+} PatchList;
+
+typedef struct
+{
+ USIZE count;
+ Instruction list[PATCH_CHUNK_SIZE];
+} PatchChunk;
+
+typedef struct
+{
+ U8 *bytes; // The patched input, with INPUT_TAIL_PADDING
+ USIZE size;
+ bool resilient;
+
+ PatchChunk **chunks;
+ USIZE chunk_count;
+ USIZE chunk_capacity;
+ USIZE *lines; // Fenwick tree of the chunk counts, for line numbers
+ U64 *starts; // Bit per offset: an instruction starts there
+
+ // Scratch for one patch: the old and new instructions of the range, and
+ // the chunks it is rebuilt from.
+ Instruction *old;
+ USIZE old_capacity;
+ Instruction *new;
+ USIZE new_capacity;
+ Instruction *merged;
+ USIZE merged_capacity;
+
+ U64 decoded_bytes; // Decoded again by the patches
+ U64 decoded_instructions;
+ U64 rebuilt_chunks;
+} PatchListing;
+
+bool patch_read(char *path, USIZE size, PatchList *patches)
+{
+ FILE *file = fopen(path, "r");
+ if(!file)
+ {
+  fprintf(stderr, "Error: Could not open %s: %s\n", path, strerror(errno));
+  return false;
+ }
+
+ USIZE capacity = 0;
+ USIZE byte_capacity = 0;
+ bool result = true;
+ // getline(), as a patch can run to thousands of bytes.
+ char *line = 0;
+ size_t line_capacity = 0;
+ for(int number = 1; result && getline(&line, &line_capacity, file) != -1; number++)
+ {
+  char *token = strtok(line, " \t\r\n");
+  if(!token || token[0] == '#')
+  {
+   continue;
+  }
+  if(patches->count == capacity)
+  {
+   capacity = capacity ? capacity * 2 : 256;
+   patches->list = realloc(patches->list, capacity * sizeof(Patch));
+  }
+  Patch *patch = &patches->list[patches->count++];
+  char *end = 0;
+  patch->offset = strtoull(token, &end, 0);
+  patch->length = 0;
+  patch->first = patches->byte_count;
+  if(*end)
+  {
+   fprintf(stderr, "Error: %s:%d: expected an offset, got \"%s\"\n", path, number, token);
+   result = false;
+   break;
+  }
+  for(token = strtok(0, " \t\r\n"); token; token = strtok(0, " \t\r\n"))
+  {
+   unsigned long value = strtoul(token, &end, 16);
+   if(*end || value > 0xFF)
+   {
+    fprintf(stderr, "Error: %s:%d: expected a hex byte, got \"%s\"\n", path, number, token);
+    result = false;
+    break;
+   }
+   if(patches->byte_count == byte_capacity)
+   {
+    byte_capacity = byte_capacity ? byte_capacity * 2 : 4096;
+    patches->bytes = realloc(patches->bytes, byte_capacity);
+   }
+   patches->bytes[patches->byte_count++] = (U8)value;
+   patch->length++;
+  }
+  if(result && (patch->offset > size || patch->length > size - patch->offset))
+  {
+   fprintf(stderr, "Error: %s:%d: patch at 0x%zx of %zu bytes runs past the %zu byte input\n", path, number,
+           patch->offset, patch->length, size);
+   result = false;
+  }
+ }
+ free(line);
+ fclose(file);
+ return result;
+}
+
+bool patch_is_start(PatchListing *listing, USIZE offset)
+{
+ return listing->starts[offset / 64] >> (offset % 64) & 1;
+}
+
+void patch_set_start(PatchListing *listing, USIZE offset, bool start)
+{
+ U64 bit = 1ull << (offset % 64);
+ if(start)
+ {
+  listing->starts[offset / 64] |= bit;
+ }
+ else
+ {
+  listing->starts[offset / 64] &= ~bit;
+ }
+}
+
+void patch_reserve(Instruction **list, USIZE *capacity, USIZE count)
+{
+ if(count > *capacity)
+ {
+  *capacity = count > 2 * *capacity ? count : 2 * *capacity;
+  *list = realloc(*list, *capacity * sizeof(Instruction));
+ }
+}
+
+// Decodes the instruction at pos like main() does. Returns the offset of
+// its last byte, or DECODE_ERROR where the listing stops.
+USIZE patch_decode(PatchListing *listing, USIZE pos, Instruction *inst)
+{
+ // Zeroed, so that instructions compare with memcmp().
+ memset(inst, 0, sizeof(*inst));
+
+ // The tail padding keeps the opcode and ModRM reads in bounds.
+ USIZE length = instruction_length(listing->bytes, pos);
+ USIZE next = DECODE_ERROR;
+ if(length && pos + length > listing->size)
+ {
+  inst->form = FORM_TRUNCATED;
+  inst->offset = pos;
+ }
+ else
+ {
+  next = decode_instruction(listing->bytes, pos, inst);
+ }
+
+ if(next == DECODE_ERROR && listing->resilient)
+ {
+  memset(inst, 0, sizeof(*inst));
+  next = decode_data_byte(listing->bytes, pos, inst);
+ }
+ return next;
+}
+
+// Decodes from pos until the decode lines up with an instruction of the
+// listing at or past end, or the listing ends. The new instructions are
+// left in listing->new. Returns their count; *realigned is the offset the
+// old instructions resume at, or listing->size when none do.
+USIZE patch_decode_range(PatchListing *listing, USIZE pos, USIZE end, USIZE *realigned)
+{
+ USIZE count = 0;
+ *realigned = listing->size;
+ while(pos < listing->size)
+ {
+  patch_reserve(&listing->new, &listing->new_capacity, count + 1);
+  USIZE next = patch_decode(listing, pos, &listing->new[count++]);
+  listing->decoded_bytes += next == DECODE_ERROR ? 1 : next + 1 - pos;
+  if(next == DECODE_ERROR)
+  {
+   break;
+  }
+  pos = next + 1;
+  if(pos >= end && pos < listing->size && patch_is_start(listing, pos))
+  {
+   *realigned = pos;
+   break;
+  }
+ }
+ listing->decoded_instructions += count;
+ return count;
+}
+
+// The number of instructions in the chunks before chunk.
+USIZE patch_lines_before(PatchListing *listing, USIZE chunk)
+{
+ USIZE sum = 0;
+ for(USIZE i = chunk; i; i &= i - 1)
+ {
+  sum += listing->lines[i];
+ }
+ return sum;
+}
+
+void patch_lines_add(PatchListing *listing, USIZE chunk, USIZE delta)
+{
+ for(USIZE i = chunk + 1; i <= listing->chunk_count; i += i & -i)
+ {
+  listing->lines[i] += delta;
+ }
+}
+
+// Turns lines[1..chunk_count] from chunk counts into the tree, or back.
+void patch_lines_build(PatchListing *listing, bool build)
+{
+ USIZE n = listing->chunk_count;
+ if(build)
+ {
+  for(USIZE i = 1; i <= n; i++)
+  {
+   if(i + (i & -i) <= n)
+   {
+    listing->lines[i + (i & -i)] += listing->lines[i];
+   }
+  }
+ }
+ else
+ {
+  for(USIZE i = n; i >= 1; i--)
+  {
+   if(i + (i & -i) <= n)
+   {
+    listing->lines[i + (i & -i)] -= listing->lines[i];
+   }
+  }
+ }
+}
+
+// Replaces chunks [first, last) with the count instructions of list,
+// spread evenly over the same chunks while they hold them. Otherwise the
+// chunks are filled to PATCH_CHUNK_FILL, and the chunk table and its line
+// tree are moved and rebuilt.
+void patch_replace_chunks(PatchListing *listing, USIZE first, USIZE last, Instruction *list, USIZE count)
+{
+ USIZE old_count = last - first;
+ USIZE new_count = old_count;
+ if(count < old_count || count > old_count * PATCH_CHUNK_SIZE)
+ {
+  new_count = (count + PATCH_CHUNK_FILL - 1) / PATCH_CHUNK_FILL;
+ }
+
+ if(new_count == old_count)
+ {
+  for(USIZE i = 0; i < new_count; i++)
+  {
+   PatchChunk *chunk = listing->chunks[first + i];
+   USIZE begin = count * i / new_count;
+   USIZE end = count * (i + 1) / new_count;
+   patch_lines_add(listing, first + i, end - begin - chunk->count);
+   chunk->count = end - begin;
+   memcpy(chunk->list, list + begin, (end - begin) * sizeof(Instruction));
+  }
+  listing->rebuilt_chunks += new_count;
+  return;
+ }
+
+ USIZE total = listing->chunk_count - old_count + new_count;
+ if(total > listing->chunk_capacity)
+ {
+  listing->chunk_capacity = total > 2 * listing->chunk_capacity ? total : 2 * listing->chunk_capacity;
+  listing->chunks = realloc(listing->chunks, listing->chunk_capacity * sizeof(PatchChunk *));
+  listing->lines = realloc(listing->lines, (listing->chunk_capacity + 1) * sizeof(USIZE));
+ }
+
+ // The first old chunks are reused, the rest freed or new ones added.
+ patch_lines_build(listing, false);
+ for(USIZE i = new_count; i < old_count; i++)
+ {
+  free(listing->chunks[first + i]);
+ }
+ memmove(listing->chunks + first + new_count, listing->chunks + last,
+         (listing->chunk_count - last) * sizeof(PatchChunk *));
+ memmove(listing->lines + 1 + first + new_count, listing->lines + 1 + last,
+         (listing->chunk_count - last) * sizeof(USIZE));
+ USIZE reused_count = old_count < new_count ? old_count : new_count;
+ for(USIZE i = reused_count; i < new_count; i++)
+ {
+  listing->chunks[first + i] = malloc(sizeof(PatchChunk));
+ }
+
+ for(USIZE i = 0; i < new_count; i++)
+ {
+  USIZE begin = count * i / new_count;
+  USIZE end = count * (i + 1) / new_count;
+  listing->chunks[first + i]->count = end - begin;
+  listing->lines[1 + first + i] = end - begin;
+  memcpy(listing->chunks[first + i]->list, list + begin, (end - begin) * sizeof(Instruction));
+ }
+ listing->chunk_count = total;
+ patch_lines_build(listing, true);
+ listing->rebuilt_chunks += new_count;
+}
+
+// The chunk and index of the last instruction starting before offset, or
+// the first instruction when none does.
+void patch_find(PatchListing *listing, USIZE offset, USIZE *chunk, USIZE *index)
+{
+ USIZE low = 0;
+ USIZE high = listing->chunk_count;
+ while(high - low > 1)
+ {
+  USIZE middle = low + (high - low) / 2;
+  if(listing->chunks[middle]->list[0].offset < offset)
+  {
+   low = middle;
+  }
+  else
+  {
+   high = middle;
+  }
+ }
+ PatchChunk *found = listing->chunks[low];
+ USIZE i = 0;
+ while(i + 1 < found->count && found->list[i + 1].offset < offset)
+ {
+  i++;
+ }
+ *chunk = low;
+ *index = i;
+}
+
+void patch_write_lines(Output *out, char sign, Instruction *list, USIZE count)
+{
+ for(USIZE i = 0; i < count; i++)
+ {
+  char *line = output_reserve(out, MAX_LINE_LENGTH + 1);
+  line[0] = sign;
+  output_commit(out, 1 + format_instruction(&list[i], line + 1));
+ }
+}
+
+// Writes bytes at offset and brings the listing up to date. Prints the
+// hunk, when the listing changed, and returns the number of lines it
+// removed and added.
+USIZE patch_apply(PatchListing *listing, Output *out, USIZE number, USIZE offset, U8 *bytes, USIZE length)
+{
+ if(!length || !listing->chunk_count)
+ {
+  return 0;
+ }
+ memcpy(listing->bytes + offset, bytes, length);
+
+ USIZE first_chunk = 0;
+ USIZE first_index = 0;
+ patch_find(listing, offset, &first_chunk, &first_index);
+ USIZE start = listing->chunks[first_chunk]->list[first_index].offset;
+
+ USIZE realigned = 0;
+ USIZE new_count = patch_decode_range(listing, start, offset + length, &realigned);
+
+ // The old instructions the new ones replace end at realigned.
+ USIZE last_chunk = listing->chunk_count - 1;
+ USIZE last_index = listing->chunks[last_chunk]->count;
+ if(realigned < listing->size)
+ {
+  patch_find(listing, realigned + 1, &last_chunk, &last_index);
+ }
+
+ // Gather the old instructions, and the new ones between the untouched
+ // heads and tails of the chunks.
+ USIZE old_count = 0;
+ USIZE head = first_index;
+ USIZE tail = listing->chunks[last_chunk]->count - last_index;
+ USIZE merged_count = 0;
+ patch_reserve(&listing->merged, &listing->merged_capacity, head + new_count + tail);
+ memcpy(listing->merged, listing->chunks[first_chunk]->list, head * sizeof(Instruction));
+ merged_count += head;
+ for(USIZE c = first_chunk; c <= last_chunk; c++)
+ {
+  PatchChunk *chunk = listing->chunks[c];
+  USIZE begin = c == first_chunk ? first_index : 0;
+  USIZE end = c == last_chunk ? last_index : chunk->count;
+  patch_reserve(&listing->old, &listing->old_capacity, old_count + end - begin);
+  memcpy(listing->old + old_count, chunk->list + begin, (end - begin) * sizeof(Instruction));
+  old_count += end - begin;
+ }
+ memcpy(listing->merged + merged_count, listing->new, new_count * sizeof(Instruction));
+ merged_count += new_count;
+ memcpy(listing->merged + merged_count, listing->chunks[last_chunk]->list + last_index, tail * sizeof(Instruction));
+ merged_count += tail;
+
+ for(USIZE i = 0; i < old_count; i++)
+ {
+  patch_set_start(listing, listing->old[i].offset, false);
+ }
+ for(USIZE i = 0; i < new_count; i++)
+ {
+  patch_set_start(listing, listing->new[i].offset, true);
+ }
+
+ // The line of the first instruction in the range.
+ USIZE line = patch_lines_before(listing, first_chunk) + first_index + 1;
+ patch_replace_chunks(listing, first_chunk, last_chunk + 1, listing->merged, merged_count);
+
+ // Only the lines that differ go into the hunk.
+ Instruction *old = listing->old;
+ Instruction *new = listing->new;
+ while(old_count && new_count && memcmp(old, new, sizeof(Instruction)) == 0)
+ {
+  old++;
+  new++;
+  old_count--;
+  new_count--;
+  line++;
+ }
+ while(old_count && new_count && memcmp(&old[old_count - 1], &new[new_count - 1], sizeof(Instruction)) == 0)
+ {
+  old_count--;
+  new_count--;
+ }
+ if(!old_count && !new_count)
+ {
+  return 0;
+ }
+
+ // As in diff -u, an empty side names the line before it.
+ char *header = output_reserve(out, 128);
+ int header_length = snprintf(header, 128, "@@ -%zu,%zu +%zu,%zu @@ patch %zu at 0x%04zx\n",
+                              old_count ? line : line - 1, old_count, new_count ? line : line - 1, new_count,
+                              number, offset);
+ output_commit(out, (USIZE)header_length);
+ patch_write_lines(out, '-', old, old_count);
+ patch_write_lines(out, '+', new, new_count);
+ return old_count + new_count;
+}
+
+// Decodes the whole input into chunks of PATCH_CHUNK_FILL.
+void patch_build(PatchListing *listing)
+{
+ USIZE pos = 0;
+ while(pos < listing->size)
+ {
+  if(!listing->chunk_count || listing->chunks[listing->chunk_count - 1]->count == PATCH_CHUNK_FILL)
+  {
+   if(listing->chunk_count == listing->chunk_capacity)
+   {
+    listing->chunk_capacity = listing->chunk_capacity ? listing->chunk_capacity * 2 : 1024;
+    listing->chunks = realloc(listing->chunks, listing->chunk_capacity * sizeof(PatchChunk *));
+   }
+   listing->chunks[listing->chunk_count] = malloc(sizeof(PatchChunk));
+   listing->chunks[listing->chunk_count++]->count = 0;
+  }
+  PatchChunk *chunk = listing->chunks[listing->chunk_count - 1];
+  USIZE next = patch_decode(listing, pos, &chunk->list[chunk->count++]);
+  patch_set_start(listing, pos, true);
+  if(next == DECODE_ERROR)
+  {
+   break;
+  }
+  pos = next + 1;
+ }
+
+ listing->lines = malloc((listing->chunk_capacity + 1) * sizeof(USIZE));
+ for(USIZE c = 0; c < listing->chunk_count; c++)
+ {
+  listing->lines[c + 1] = listing->chunks[c]->count;
+ }
+ patch_lines_build(listing, true);
+}
+
+int run_patch(U8 *bytes, USIZE size, char *patches_path, bool output_stats, bool resilient)
+{
+ PatchList patches = {0};
+ if(!patch_read(patches_path, size, &patches))
+ {
+  free(patches.list);
+  free(patches.bytes);
+  return 1;
+ }
+
+ Output out;
+ if(!output_open(&out, STDOUT_FILENO))
+ {
+  free(patches.list);
+  free(patches.bytes);
+  return 1;
+ }
+
+ PatchListing listing = {0};
+ listing.bytes = calloc(1, size + INPUT_TAIL_PADDING);
+ memcpy(listing.bytes, bytes, size);
+ listing.size = size;
+ listing.resilient = resilient;
+ listing.starts = calloc(size / 64 + 1, sizeof(U64));
+
+ U64 start = now_ns();
+ patch_build(&listing);
+ U64 build_ns = now_ns() - start;
+ USIZE instructions = 0;
+ for(USIZE c = 0; c < listing.chunk_count; c++)
+ {
+  PatchChunk *chunk = listing.chunks[c];
+  instructions += chunk->count;
+  for(USIZE i = 0; i < chunk->count; i++)
+  {
+   output_write_instruction(&out, &chunk->list[i]);
+  }
+ }
+
+ USIZE changed = 0;
+ USIZE changed_lines = 0;
+ U64 patch_ns = 0;
+ for(USIZE i = 0; i < patches.count; i++)
+ {
+  Patch *patch = &patches.list[i];
+  start = now_ns();
+  USIZE lines = patch_apply(&listing, &out, i + 1, patch->offset, patches.bytes + patch->first, patch->length);
+  patch_ns += now_ns() - start;
+  changed += lines != 0;
+  changed_lines += lines;
+ }
+
+ if(output_stats)
+ {
+  // The hunks are written out as they are made, so patch_ns includes
+  // formatting them.
+  double count = patches.count ? (double)patches.count : 1.0;
+  fprintf(stderr, "patch: %zu bytes, %zu instructions, %.3f ms full decode\n", size, instructions,
+          (double)build_ns / 1e6);
+  fprintf(stderr, "patch: %zu patches, %zu changed the listing, %zu lines removed or added\n", patches.count,
+          changed, changed_lines);
+  fprintf(stderr, "patch: %.1f bytes and %.1f instructions decoded again, %.2f chunks rebuilt per patch\n",
+          (double)listing.decoded_bytes / count, (double)listing.decoded_instructions / count,
+          (double)listing.rebuilt_chunks / count);
+  fprintf(stderr, "patch: %.2f us per patch, %.0fx faster than the full decode\n", (double)patch_ns / 1e3 / count,
+          patch_ns ? (double)build_ns * count / (double)patch_ns : 0.0);
+ }
+ output_close(&out, output_stats);
+
+ for(USIZE c = 0; c < listing.chunk_count; c++)
+ {
+  free(listing.chunks[c]);
+ }
+ free(listing.chunks);
+ free(listing.lines);
+ free(listing.starts);
+ free(listing.old);
+ free(listing.new);
+ free(listing.merged);
+ free(listing.bytes);
+ free(patches.list);
+ free(patches.bytes);
+ return 0;
+}
@@ -0,0 +1,378 @@
+// Three-stage pipeline for large inputs, selected with --pipeline:
+//
+//   reader -> [chunk ring] -> decoder -> [batch ring] -> formatter
+//
+// Each stage runs on its own thread pinned to its own core. The rings are
+// lock-free single-producer/single-consumer queues of slot indices, the
+// slots themselves (chunks and instruction batches) are preallocated.
+// Included at the bottom of main.c.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#define PIPELINE_RING_SLOTS 8 // Power of two
+#define PIPELINE_CHUNK_SIZE (1 << 20)
+#define PIPELINE_BATCH_SIZE 16384
+
+typedef struct
+{
+ _Alignas(64) _Atomic USIZE head; // Next slot the producer fills
+ _Alignas(64) _Atomic USIZE tail; // Next slot the consumer drains
+} SpscRing;
+
+typedef struct
+{
+ // The decoder copies the partial instruction left over from the previous
+ // chunk into the MAX_INSTRUCTION_LENGTH bytes in front of the data.
+ U8 bytes[MAX_INSTRUCTION_LENGTH + PIPELINE_CHUNK_SIZE + INPUT_TAIL_PADDING];
+ USIZE size;
+ bool last;
+} InputChunk;
+
+typedef struct
+{
+ Instruction instructions[PIPELINE_BATCH_SIZE];
+ USIZE count;
+ bool last;
+} InstructionBatch;
+
+typedef struct
+{
+ char *name;
+ U64 busy_ns;
+ U64 wait_ns;
+} StageStats;
+
+typedef struct
+{
+ int fd;
+ SpscRing chunk_ring;
+ SpscRing batch_ring;
+ InputChunk *chunks;
+ InstructionBatch *batches;
+ StageStats reader;
+ StageStats decoder;
+ StageStats formatter;
+ Output out;
+ USIZE bytes_in;
+ bool resilient;
+ USIZE data_bytes; // Written by the decoder, read after the join
+} Pipeline;
+
+void pipeline_pin_to_core(int stage)
+{
+ long cores = sysconf(_SC_NPROCESSORS_ONLN);
+ cpu_set_t set;
+ CPU_ZERO(&set);
+ CPU_SET(stage % (cores > 0 ? cores : 1), &set);
+ pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Spins briefly, then yields, so a stage never burns a core that the stage
+// it is waiting on might need.
+void pipeline_backoff(U32 *spins)
+{
+ if(++(*spins) < 64)
+ {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+ }
+ else
+ {
+  sched_yield();
+ }
+}
+
+USIZE ring_acquire_write(SpscRing *ring, StageStats *stats)
+{
+ USIZE head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+ if(head - atomic_load_explicit(&ring->tail, memory_order_acquire) == PIPELINE_RING_SLOTS)
+ {
+  U64 start = now_ns();
+  U32 spins = 0;
+  while(head - atomic_load_explicit(&ring->tail, memory_order_acquire) == PIPELINE_RING_SLOTS)
+  {
+   pipeline_backoff(&spins);
+  }
+  stats->wait_ns += now_ns() - start;
+ }
+ return head & (PIPELINE_RING_SLOTS - 1);
+}
+
+void ring_publish(SpscRing *ring)
+{
+ atomic_fetch_add_explicit(&ring->head, 1, memory_order_release);
+}
+
+USIZE ring_acquire_read(SpscRing *ring, StageStats *stats)
+{
+ USIZE tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+ if(atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+ {
+  U64 start = now_ns();
+  U32 spins = 0;
+  while(atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+  {
+   pipeline_backoff(&spins);
+  }
+  stats->wait_ns += now_ns() - start;
+ }
+ return tail & (PIPELINE_RING_SLOTS - 1);
+}
+
+void ring_release(SpscRing *ring)
+{
+ atomic_fetch_add_explicit(&ring->tail, 1, memory_order_release);
+}
+
+void *pipeline_reader(void *arg)
+{
+ Pipeline *p = arg;
+ pipeline_pin_to_core(0);
+ U64 start = now_ns();
+
+ bool last = false;
+ while(!last)
+ {
+  USIZE slot = ring_acquire_write(&p->chunk_ring, &p->reader);
+  InputChunk *chunk = &p->chunks[slot];
+  U8 *data = chunk->bytes + MAX_INSTRUCTION_LENGTH;
+
+  USIZE size = 0;
+  while(size < PIPELINE_CHUNK_SIZE)
+  {
+   ssize_t n = read(p->fd, data + size, PIPELINE_CHUNK_SIZE - size);
+   if(n < 0 && errno == EINTR)
+   {
+    continue;
+   }
+   if(n <= 0)
+   {
+    last = true;
+    break;
+   }
+   size += (USIZE)n;
+  }
+
+  memset(data + size, 0, INPUT_TAIL_PADDING);
+  chunk->size = size;
+  chunk->last = last;
+  p->bytes_in += size;
+  ring_publish(&p->chunk_ring);
+ }
+
+ p->reader.busy_ns = now_ns() - start - p->reader.wait_ns;
+ return 0;
+}
+
+void *pipeline_decoder(void *arg)
+{
+ Pipeline *p = arg;
+ pipeline_pin_to_core(1);
+ U64 start = now_ns();
+
+ U8 carry[MAX_INSTRUCTION_LENGTH];
+ USIZE carry_size = 0;
+ USIZE stream_offset = 0; // Input offset of the first carried byte
+ bool failed = false;
+
+ USIZE batch_slot = ring_acquire_write(&p->batch_ring, &p->decoder);
+ InstructionBatch *batch = &p->batches[batch_slot];
+ batch->count = 0;
+
+ bool last = false;
+ while(!last)
+ {
+  USIZE chunk_slot = ring_acquire_read(&p->chunk_ring, &p->decoder);
+  InputChunk *chunk = &p->chunks[chunk_slot];
+  last = chunk->last;
+
+  if(failed)
+  {
+   // Keep draining so the reader can finish.
+   ring_release(&p->chunk_ring);
+   continue;
+  }
+
+  U8 *bytes = chunk->bytes + MAX_INSTRUCTION_LENGTH - carry_size;
+  memcpy(bytes, carry, carry_size);
+  USIZE end = carry_size + chunk->size;
+
+  USIZE pos = 0;
+  while(pos < end)
+  {
+   bool truncated = false;
+   if(pos + MAX_INSTRUCTION_LENGTH > end)
+   {
+    if(!last)
+    {
+     break;
+    }
+
+    USIZE length = instruction_length(bytes, pos);
+    truncated = length && pos + length > end;
+    if(truncated && !p->resilient)
+    {
+     Instruction *inst = &batch->instructions[batch->count++];
+     inst->form = FORM_TRUNCATED;
+     inst->offset = stream_offset + pos;
+     break;
+    }
+   }
+
+   Instruction *inst = &batch->instructions[batch->count++];
+   USIZE next = truncated ? DECODE_ERROR : decode_instruction(bytes, pos, inst);
+   if(next == DECODE_ERROR && p->resilient)
+   {
+    next = decode_data_byte(bytes, pos, inst);
+    p->data_bytes++;
+   }
+   inst->offset += stream_offset;
+
+   if(batch->count == PIPELINE_BATCH_SIZE)
+   {
+    batch->last = false;
+    ring_publish(&p->batch_ring);
+    batch_slot = ring_acquire_write(&p->batch_ring, &p->decoder);
+    batch = &p->batches[batch_slot];
+    batch->count = 0;
+   }
+
+   if(next == DECODE_ERROR)
+   {
+    failed = true;
+    break;
+   }
+   pos = next + 1;
+  }
+
+  if(pos < end)
+  {
+   carry_size = end - pos;
+   memcpy(carry, bytes + pos, carry_size);
+  }
+  else
+  {
+   carry_size = 0;
+  }
+  stream_offset += pos;
+  ring_release(&p->chunk_ring);
+ }
+
+ batch->last = true;
+ ring_publish(&p->batch_ring);
+
+ p->decoder.busy_ns = now_ns() - start - p->decoder.wait_ns;
+ return 0;
+}
+
+void *pipeline_formatter(void *arg)
+{
+ Pipeline *p = arg;
+ pipeline_pin_to_core(2);
+ U64 start = now_ns();
+
+ bool last = false;
+ while(!last)
+ {
+  USIZE slot = ring_acquire_read(&p->batch_ring, &p->formatter);
+  InstructionBatch *batch = &p->batches[slot];
+  last = batch->last;
+
+  for(USIZE i = 0; i < batch->count; i++)
+  {
+   output_write_instruction(&p->out, &batch->instructions[i]);
+  }
+
+  ring_release(&p->batch_ring);
+ }
+ output_flush(&p->out);
+
+ p->formatter.busy_ns = now_ns() - start - p->formatter.wait_ns;
+ return 0;
+}
+
+void pipeline_report_stage(StageStats *stats, U64 wall_ns)
+{
+ double busy = wall_ns ? 100.0 * (double)stats->busy_ns / (double)wall_ns : 0.0;
+ fprintf(stderr, "  %-9s busy %6.2f%%  waiting %8.3f ms\n",
+         stats->name, busy, (double)stats->wait_ns / 1e6);
+}
+
+int run_pipeline(char *filename, bool output_stats, bool resilient)
+{
+ // Aligned so the ring heads and tails sit on their own cache lines.
+ USIZE pipeline_size = (sizeof(Pipeline) + 63) & ~(USIZE)63;
+ Pipeline *p = aligned_alloc(64, pipeline_size);
+ if(!p)
+ {
+  fprintf(stderr, "Error: %s: pipeline\n", strerror(errno));
+  return 1;
+ }
+ memset(p, 0, pipeline_size);
+ p->resilient = resilient;
+ p->fd = open(filename, O_RDONLY);
+ if(p->fd < 0)
+ {
+  fprintf(stderr, "Error: %s: %s\n", strerror(errno), filename);
+  free(p);
+  return 1;
+ }
+
+ if(!output_open(&p->out, STDOUT_FILENO))
+ {
+  close(p->fd);
+  free(p);
+  return 1;
+ }
+
+ p->chunks = calloc(PIPELINE_RING_SLOTS, sizeof(InputChunk));
+ p->batches = calloc(PIPELINE_RING_SLOTS, sizeof(InstructionBatch));
+ if(!p->chunks || !p->batches)
+ {
+  fprintf(stderr, "Error: %s: pipeline rings\n", strerror(errno));
+  output_close(&p->out, false);
+  close(p->fd);
+  free(p->chunks);
+  free(p->batches);
+  free(p);
+  return 1;
+ }
+ p->reader.name = "reader";
+ p->decoder.name = "decoder";
+ p->formatter.name = "formatter";
+
+ U64 start = now_ns();
+ pthread_t threads[3];
+ pthread_create(&threads[0], 0, pipeline_reader, p);
+ pthread_create(&threads[1], 0, pipeline_decoder, p);
+ pthread_create(&threads[2], 0, pipeline_formatter, p);
+ for(int i = 0; i < 3; i++)
+ {
+  pthread_join(threads[i], 0);
+ }
+ U64 wall_ns = now_ns() - start;
+
+ if(output_stats)
+ {
+  double seconds = (double)wall_ns / 1e9;
+  fprintf(stderr, "pipeline: %zu bytes in, %zu bytes out, %.3f s, %.1f MB/s\n",
+          p->bytes_in, (USIZE)p->out.bytes, seconds, seconds > 0 ? (double)p->bytes_in / 1e6 / seconds : 0.0);
+  pipeline_report_stage(&p->reader, wall_ns);
+  pipeline_report_stage(&p->decoder, wall_ns);
+  pipeline_report_stage(&p->formatter, wall_ns);
+ }
+ output_close(&p->out, output_stats);
+ if(p->data_bytes)
+ {
+  fprintf(stderr, "resilient: %zu undecodable bytes emitted as db\n", p->data_bytes);
+ }
+
+ close(p->fd);
+ free(p->chunks);
+ free(p->batches);
+ free(p);
+ return 0;
+}
@@ -0,0 +1,464 @@
+// Decode server, selected with --serve <socket path> [--workers N]. Listens
+// on a Unix stream socket so callers pay process startup and table setup
+// once instead of per blob. Included at the bottom of main.c.
+//
+// A connection carries any number of requests, answered in order:
+//
+//   request:  U8 format, U8 reserved[3], U32 length, length bytes of code
+//   response: U32 status, U32 length, length bytes
+//
+// Integers are little-endian. Formats:
+//
+//   0  text, the same listing the file mode prints
+//   1  binary, one WireInstruction per instruction
+//   2  latency report as text, length must be 0
+//
+// Status is 0, or 1 for a bad request, after which the connection is
+// closed.
+//
+// A fixed pool of workers shares one epoll instance. Every socket is
+// registered one-shot, so a ready connection wakes exactly one worker, which
+// serves one request and re-arms it. Latency is measured from reading the
+// request header to writing the response, into per-worker log-linear
+// histograms that are summed for the report. SIGINT or SIGTERM stops the
+// server and prints the report to stderr.
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define SERVER_MAX_WORKERS 64
+#define SERVER_MAX_PAYLOAD (16 * 1024 * 1024)
+#define SERVER_LATENCY_BUCKETS (64 * 8)
+#define SERVER_RECEIVE_TIMEOUT_SECONDS 5
+
+enum
+{
+ SERVER_FORMAT_TEXT,
+ SERVER_FORMAT_BINARY,
+ SERVER_FORMAT_LATENCY,
+};
+
+typedef struct
+{
+ U8 format;
+ U8 reserved[3];
+ U32 length;
+} RequestHeader;
+
+typedef struct
+{
+ U32 status;
+ U32 length;
+} ResponseHeader;
+
+typedef struct
+{
+ U32 offset;
+ U16 displacement;
+ U16 data;
+ U8 length;
+ U8 form;
+ U8 mnemonic;
+ U8 mod;
+ U8 reg;
+ U8 rm;
+ U8 flags; // 1 = w, 2 = d, 4 = s
+ U8 reserved;
+} WireInstruction;
+
+_Static_assert(sizeof(WireInstruction) == 16, "WireInstruction is part of the protocol");
+
+typedef struct
+{
+ U8 *bytes;
+ USIZE capacity;
+ USIZE used;
+} ServerBuffer;
+
+typedef struct
+{
+ pthread_t thread;
+ struct Server *server;
+ ServerBuffer input;
+ ServerBuffer output;
+ // Written by the owning worker only, read for reports.
+ _Atomic U64 latency[SERVER_LATENCY_BUCKETS];
+} ServerWorker;
+
+typedef struct Server
+{
+ int listen_fd;
+ int epoll_fd;
+ USIZE worker_count;
+ ServerWorker *workers;
+} Server;
+
+volatile sig_atomic_t server_stopping;
+
+void server_stop(int signal_number)
+{
+ (void)signal_number;
+ server_stopping = 1;
+}
+
+// Buckets are 8 per power of two, so a percentile is within 12.5%.
+USIZE server_latency_bucket(U64 ns)
+{
+ if(ns < 24)
+ {
+  return (USIZE)ns;
+ }
+ USIZE exponent = (USIZE)(63 - __builtin_clzll(ns));
+ return exponent * 8 + (USIZE)((ns >> (exponent - 3)) & 7);
+}
+
+U64 server_bucket_ns(USIZE bucket)
+{
+ if(bucket < 24)
+ {
+  return bucket;
+ }
+ return (U64)(8 + bucket % 8) << (bucket / 8 - 3);
+}
+
+// Appends the latency percentiles over all workers to out.
+void server_latency_report(Server *server, ServerBuffer *out)
+{
+ U64 counts[SERVER_LATENCY_BUCKETS] = {0};
+ U64 total = 0;
+ for(USIZE w = 0; w < server->worker_count; w++)
+ {
+  for(USIZE i = 0; i < SERVER_LATENCY_BUCKETS; i++)
+  {
+   U64 count = atomic_load_explicit(&server->workers[w].latency[i], memory_order_relaxed);
+   counts[i] += count;
+   total += count;
+  }
+ }
+
+ double percentiles[] = {50, 90, 99, 99.9, 100};
+ char *names[] = {"p50", "p90", "p99", "p99.9", "max"};
+ char text[256];
+ int length = snprintf(text, sizeof(text), "requests %llu", (unsigned long long)total);
+ for(USIZE p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++)
+ {
+  U64 rank = (U64)((double)total * percentiles[p] / 100.0 + 0.5);
+  U64 seen = 0;
+  USIZE bucket = 0;
+  for(; bucket < SERVER_LATENCY_BUCKETS - 1; bucket++)
+  {
+   seen += counts[bucket];
+   if(total && seen >= rank)
+   {
+    break;
+   }
+  }
+  length += snprintf(text + length, sizeof(text) - (USIZE)length, " %s %.1f us", names[p],
+                     total ? (double)server_bucket_ns(bucket) / 1e3 : 0.0);
+ }
+ length += snprintf(text + length, sizeof(text) - (USIZE)length, "\n");
+
+ memcpy(out->bytes + out->used, text, (USIZE)length);
+ out->used += (USIZE)length;
+}
+
+void server_reserve(ServerBuffer *buffer, USIZE size)
+{
+ if(buffer->used + size > buffer->capacity)
+ {
+  buffer->capacity = (buffer->used + size) * 2;
+  buffer->bytes = realloc(buffer->bytes, buffer->capacity);
+ }
+}
+
+void server_emit(ServerBuffer *out, U8 format, Instruction *inst)
+{
+ if(format == SERVER_FORMAT_TEXT)
+ {
+  server_reserve(out, MAX_LINE_LENGTH);
+  out->used += format_instruction(inst, (char *)out->bytes + out->used);
+  return;
+ }
+
+ WireInstruction wire = {
+  .offset = (U32)inst->offset,
+  .displacement = inst->displacement,
+  .data = inst->data,
+  .length = inst->length,
+  .form = inst->form,
+  .mnemonic = inst->mnemonic,
+  .mod = inst->mod,
+  .reg = inst->reg,
+  .rm = inst->rm,
+  .flags = (U8)(inst->w | inst->d << 1 | inst->s << 2),
+ };
+ server_reserve(out, sizeof(wire));
+ memcpy(out->bytes + out->used, &wire, sizeof(wire));
+ out->used += sizeof(wire);
+}
+
+// Same loop as the file mode: stops after an error or a truncated
+// instruction.
+void server_decode(ServerBuffer *in, ServerBuffer *out, U8 format)
+{
+ Instruction inst = {0};
+ USIZE pos = 0;
+ while(pos < in->used)
+ {
+  // The tail padding keeps the opcode and ModRM reads in bounds.
+  if(pos + MAX_INSTRUCTION_LENGTH > in->used)
+  {
+   USIZE length = instruction_length(in->bytes, pos);
+   if(length && pos + length > in->used)
+   {
+    memset(&inst, 0, sizeof(inst));
+    inst.form = FORM_TRUNCATED;
+    inst.offset = pos;
+    server_emit(out, format, &inst);
+    break;
+   }
+  }
+
+  USIZE next = decode_instruction(in->bytes, pos, &inst);
+  server_emit(out, format, &inst);
+  if(next == DECODE_ERROR)
+  {
+   break;
+  }
+  pos = next + 1;
+ }
+}
+
+bool server_read_full(int fd, void *data, USIZE size)
+{
+ U8 *bytes = data;
+ while(size)
+ {
+  ssize_t n = read(fd, bytes, size);
+  if(n < 0 && errno == EINTR)
+  {
+   continue;
+  }
+  if(n <= 0)
+  {
+   return false;
+  }
+  bytes += n;
+  size -= (USIZE)n;
+ }
+ return true;
+}
+
+bool server_respond(int fd, U32 status, ServerBuffer *body)
+{
+ ResponseHeader header = {status, (U32)body->used};
+ struct iovec iov[2] = {{&header, sizeof(header)}, {body->bytes, body->used}};
+ int count = 2;
+ struct iovec *next = iov;
+ while(count)
+ {
+  ssize_t n = writev(fd, next, count);
+  if(n < 0 && errno == EINTR)
+  {
+   continue;
+  }
+  if(n <= 0)
+  {
+   return false;
+  }
+
+  USIZE written = (USIZE)n;
+  while(count && written >= next->iov_len)
+  {
+   written -= next->iov_len;
+   next++;
+   count--;
+  }
+  if(count)
+  {
+   next->iov_base = (char *)next->iov_base + written;
+   next->iov_len -= written;
+  }
+ }
+ return true;
+}
+
+// Serves one request. Returns false when the connection should be closed.
+bool server_handle(ServerWorker *worker, int fd)
+{
+ RequestHeader header;
+ if(!server_read_full(fd, &header, sizeof(header)))
+ {
+  return false;
+ }
+ U64 start = now_ns();
+
+ ServerBuffer *in = &worker->input;
+ ServerBuffer *out = &worker->output;
+ out->used = 0;
+
+ bool valid = header.length <= SERVER_MAX_PAYLOAD && header.format <= SERVER_FORMAT_LATENCY &&
+              (header.format != SERVER_FORMAT_LATENCY || header.length == 0);
+ if(!valid)
+ {
+  server_respond(fd, 1, out);
+  return false;
+ }
+
+ in->used = 0;
+ server_reserve(in, header.length + INPUT_TAIL_PADDING);
+ if(!server_read_full(fd, in->bytes, header.length))
+ {
+  return false;
+ }
+ in->used = header.length;
+ memset(in->bytes + in->used, 0, INPUT_TAIL_PADDING);
+
+ if(header.format == SERVER_FORMAT_LATENCY)
+ {
+  server_reserve(out, 256);
+  server_latency_report(worker->server, out);
+ }
+ else
+ {
+  server_decode(in, out, header.format);
+ }
+
+ if(!server_respond(fd, 0, out))
+ {
+  return false;
+ }
+ atomic_fetch_add_explicit(&worker->latency[server_latency_bucket(now_ns() - start)], 1, memory_order_relaxed);
+ return true;
+}
+
+void server_rearm(Server *server, int fd)
+{
+ struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.fd = fd};
+ epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+void server_accept(Server *server)
+{
+ int fd = accept4(server->listen_fd, 0, 0, SOCK_CLOEXEC);
+ server_rearm(server, server->listen_fd);
+ if(fd < 0)
+ {
+  return;
+ }
+
+ // A client that stalls mid-request only holds its worker this long.
+ struct timeval timeout = {SERVER_RECEIVE_TIMEOUT_SECONDS, 0};
+ setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+ struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.fd = fd};
+ epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+void *server_worker(void *arg)
+{
+ ServerWorker *worker = arg;
+ Server *server = worker->server;
+ while(!server_stopping)
+ {
+  struct epoll_event event;
+  int n = epoll_wait(server->epoll_fd, &event, 1, 200);
+  if(n <= 0)
+  {
+   continue;
+  }
+
+  int fd = event.data.fd;
+  if(fd == server->listen_fd)
+  {
+   server_accept(server);
+  }
+  else if((event.events & (EPOLLHUP | EPOLLERR)) && !(event.events & EPOLLIN))
+  {
+   close(fd);
+  }
+  else if(server_handle(worker, fd))
+  {
+   server_rearm(server, fd);
+  }
+  else
+  {
+   close(fd);
+  }
+ }
+
+ free(worker->input.bytes);
+ free(worker->output.bytes);
+ return 0;
+}
+
+int run_server(char *path, USIZE worker_count)
+{
+ if(worker_count == 0)
+ {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  worker_count = cpus > 0 ? (USIZE)cpus : 1;
+ }
+ if(worker_count > SERVER_MAX_WORKERS)
+ {
+  worker_count = SERVER_MAX_WORKERS;
+ }
+
+ struct sockaddr_un address = {.sun_family = AF_UNIX};
+ if(strlen(path) >= sizeof(address.sun_path))
+ {
+  fprintf(stderr, "Error: socket path too long: %s\n", path);
+  return 1;
+ }
+ strcpy(address.sun_path, path);
+
+ Server server = {0};
+ server.worker_count = worker_count;
+ server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+ unlink(path);
+ if(server.listen_fd < 0 || bind(server.listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+    listen(server.listen_fd, SOMAXCONN) != 0)
+ {
+  fprintf(stderr, "Error: %s: %s\n", strerror(errno), path);
+  return 1;
+ }
+
+ server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+ struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.fd = server.listen_fd};
+ epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event);
+
+ struct sigaction action = {.sa_handler = server_stop};
+ sigaction(SIGINT, &action, 0);
+ sigaction(SIGTERM, &action, 0);
+ signal(SIGPIPE, SIG_IGN);
+
+ server.workers = calloc(worker_count, sizeof(ServerWorker));
+ for(USIZE i = 0; i < worker_count; i++)
+ {
+  server.workers[i].server = &server;
+  pthread_create(&server.workers[i].thread, 0, server_worker, &server.workers[i]);
+ }
+ fprintf(stderr, "serving on %s with %zu workers\n", path, worker_count);
+
+ for(USIZE i = 0; i < worker_count; i++)
+ {
+  pthread_join(server.workers[i].thread, 0);
+ }
+
+ ServerBuffer report = {0};
+ server_reserve(&report, 256);
+ server_latency_report(&server, &report);
+ fwrite(report.bytes, 1, report.used, stderr);
+ free(report.bytes);
+
+ close(server.epoll_fd);
+ close(server.listen_fd);
+ unlink(path);
+ free(server.workers);
+ return 0;
+}
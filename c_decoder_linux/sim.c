@@ -0,0 +1,581 @@
+// Simulator, selected with --simulate. Executes the input as code loaded at
+// address 0 of a single 64 KB segment until IP leaves it, then prints the
+// registers and flags that are not zero. Included at the bottom of main.c.
+//
+// Flags are lazy: add, sub and cmp only record the operation, its operands
+// and result, and a conditional jump computes just the flags it tests. The
+// six flags are materialized only when all of them are read, i.e. for the
+// final state. --eager-flags computes all six after every operation instead,
+// for comparison; --output-stats prints the instruction rate and how many
+// of the recorded flag states were ever read.
+//
+// Each instruction is decoded once and cached by address. A store into the
+// loaded code drops the cached instructions it overlaps.
+//
+// --jit translates hot basic blocks to x86-64 and runs them natively, see
+// jit.c. --replay N runs the program N times from the same state, reset
+// from a copy-on-write snapshot of memory, see snapshot.c. --trace <file>
+// records every step, see trace.c.
+//
+// Example: --simulate --output-stats loop.bin
+
+#define SIM_MEMORY_SIZE 0x10000
+
+// Memory is tracked in pages for snapshots: the page of an address is its
+// high byte.
+#define SIM_PAGE_SIZE 0x100
+#define SIM_PAGE_COUNT (SIM_MEMORY_SIZE / SIM_PAGE_SIZE)
+
+enum
+{
+ SIM_FLAG_CF = 1 << 0,
+ SIM_FLAG_PF = 1 << 2,
+ SIM_FLAG_AF = 1 << 4,
+ SIM_FLAG_ZF = 1 << 6,
+ SIM_FLAG_SF = 1 << 7,
+ SIM_FLAG_OF = 1 << 11,
+};
+
+enum
+{
+ SIM_OP_NONE, // flags holds the flags
+ SIM_OP_ADD,
+ SIM_OP_SUB,
+};
+
+// The last flag-setting operation.
+typedef struct
+{
+ U8 op;
+ bool w;
+ U16 a;
+ U16 b;
+ U16 result;
+} LazyFlags;
+
+// A page of memory as a snapshot saw it, shared by every snapshot and Sim
+// that holds the same bytes there.
+typedef struct
+{
+ U32 references;
+ U8 bytes[SIM_PAGE_SIZE];
+} SimPage;
+
+typedef struct
+{
+ U16 registers[8]; // ax, cx, dx, bx, sp, bp, si, di
+ U16 ip;
+ U16 flags;
+ LazyFlags last;
+ bool eager;
+
+ USIZE code_size;
+ U64 limit; // Stop after this many instructions
+ bool code_written; // A store hit the code since the flag was cleared
+ U16 code_write_address;
+ U64 instructions;
+ U64 flag_writes;
+ U64 flag_reads;
+ U64 stores;
+ U16 store_address; // Of the last store
+ bool store_w;
+
+ // memory[SIM_MEMORY_SIZE] mirrors memory[0], so a word load at 0xFFFF
+ // wraps without a check.
+ U8 memory[SIM_MEMORY_SIZE + INPUT_TAIL_PADDING];
+ bool decoded[SIM_MEMORY_SIZE];
+ Instruction cache[SIM_MEMORY_SIZE];
+
+ // Every store sets the dirty byte of its pages. A page that is not dirty
+ // holds the bytes of its base page, when it has one.
+ U8 dirty[SIM_PAGE_COUNT];
+ SimPage *base[SIM_PAGE_COUNT];
+} Sim;
+
+U16 sim_sign_bit(bool w)
+{
+ return w ? 0x8000 : 0x80;
+}
+
+bool sim_cf(LazyFlags *last)
+{
+ U16 mask = last->w ? 0xFFFF : 0xFF;
+ if(last->op == SIM_OP_ADD)
+ {
+  return (last->result & mask) < (last->a & mask);
+ }
+ return (last->a & mask) < (last->b & mask);
+}
+
+bool sim_of(LazyFlags *last)
+{
+ U16 overflow = last->op == SIM_OP_ADD ? (last->a ^ last->result) & (last->b ^ last->result)
+                                       : (last->a ^ last->b) & (last->a ^ last->result);
+ return overflow & sim_sign_bit(last->w);
+}
+
+bool sim_zf(LazyFlags *last)
+{
+ return (last->result & (last->w ? 0xFFFF : 0xFF)) == 0;
+}
+
+bool sim_sf(LazyFlags *last)
+{
+ return last->result & sim_sign_bit(last->w);
+}
+
+bool sim_pf(LazyFlags *last)
+{
+ return !__builtin_parity(last->result & 0xFF);
+}
+
+bool sim_af(LazyFlags *last)
+{
+ return (last->a ^ last->b ^ last->result) & 0x10;
+}
+
+U16 sim_compute_flags(LazyFlags *last)
+{
+ return (U16)((sim_cf(last) ? SIM_FLAG_CF : 0) |
+              (sim_pf(last) ? SIM_FLAG_PF : 0) |
+              (sim_af(last) ? SIM_FLAG_AF : 0) |
+              (sim_zf(last) ? SIM_FLAG_ZF : 0) |
+              (sim_sf(last) ? SIM_FLAG_SF : 0) |
+              (sim_of(last) ? SIM_FLAG_OF : 0));
+}
+
+// All six flags, materialized.
+U16 sim_flags(Sim *sim)
+{
+ if(sim->last.op != SIM_OP_NONE)
+ {
+  sim->flags = sim_compute_flags(&sim->last);
+  sim->last.op = SIM_OP_NONE;
+ }
+ return sim->flags;
+}
+
+void sim_record_flags(Sim *sim, U8 op, U16 a, U16 b, U16 result, bool w)
+{
+ sim->last = (LazyFlags){op, w, a, b, result};
+ sim->flag_writes++;
+ if(sim->eager)
+ {
+  sim_flags(sim);
+ }
+}
+
+// One flag, computed from the last operation unless already materialized.
+bool sim_flag(LazyFlags *last, U16 flags, U16 flag, bool (*compute)(LazyFlags *))
+{
+ if(last->op == SIM_OP_NONE)
+ {
+  return flags & flag;
+ }
+ return compute(last);
+}
+
+// flags holds the flags when last->op is SIM_OP_NONE.
+bool sim_condition(LazyFlags *last, U16 flags, U8 mnemonic)
+{
+ switch(mnemonic)
+ {
+  case MNEMONIC_JO: return sim_flag(last, flags, SIM_FLAG_OF, sim_of);
+  case MNEMONIC_JNO: return !sim_flag(last, flags, SIM_FLAG_OF, sim_of);
+  case MNEMONIC_JB: return sim_flag(last, flags, SIM_FLAG_CF, sim_cf);
+  case MNEMONIC_JNB: return !sim_flag(last, flags, SIM_FLAG_CF, sim_cf);
+  case MNEMONIC_JE: return sim_flag(last, flags, SIM_FLAG_ZF, sim_zf);
+  case MNEMONIC_JNE: return !sim_flag(last, flags, SIM_FLAG_ZF, sim_zf);
+  case MNEMONIC_JBE: return sim_flag(last, flags, SIM_FLAG_CF, sim_cf) || sim_flag(last, flags, SIM_FLAG_ZF, sim_zf);
+  case MNEMONIC_JA: return !sim_flag(last, flags, SIM_FLAG_CF, sim_cf) && !sim_flag(last, flags, SIM_FLAG_ZF, sim_zf);
+  case MNEMONIC_JS: return sim_flag(last, flags, SIM_FLAG_SF, sim_sf);
+  case MNEMONIC_JNS: return !sim_flag(last, flags, SIM_FLAG_SF, sim_sf);
+  case MNEMONIC_JP: return sim_flag(last, flags, SIM_FLAG_PF, sim_pf);
+  case MNEMONIC_JNP: return !sim_flag(last, flags, SIM_FLAG_PF, sim_pf);
+  case MNEMONIC_JL: return sim_flag(last, flags, SIM_FLAG_SF, sim_sf) != sim_flag(last, flags, SIM_FLAG_OF, sim_of);
+  case MNEMONIC_JNL: return sim_flag(last, flags, SIM_FLAG_SF, sim_sf) == sim_flag(last, flags, SIM_FLAG_OF, sim_of);
+  case MNEMONIC_JLE:
+   return sim_flag(last, flags, SIM_FLAG_ZF, sim_zf) ||
+          sim_flag(last, flags, SIM_FLAG_SF, sim_sf) != sim_flag(last, flags, SIM_FLAG_OF, sim_of);
+  case MNEMONIC_JG:
+   return !sim_flag(last, flags, SIM_FLAG_ZF, sim_zf) &&
+          sim_flag(last, flags, SIM_FLAG_SF, sim_sf) == sim_flag(last, flags, SIM_FLAG_OF, sim_of);
+ }
+ return false;
+}
+
+U16 sim_get_register(Sim *sim, U8 reg, bool w)
+{
+ if(w)
+ {
+  return sim->registers[reg];
+ }
+ // al, cl, dl, bl, then ah, ch, dh, bh
+ return reg < 4 ? sim->registers[reg] & 0xFF : sim->registers[reg - 4] >> 8;
+}
+
+void sim_set_register(Sim *sim, U8 reg, bool w, U16 value)
+{
+ if(w)
+ {
+  sim->registers[reg] = value;
+ }
+ else if(reg < 4)
+ {
+  sim->registers[reg] = (U16)((sim->registers[reg] & 0xFF00) | (value & 0xFF));
+ }
+ else
+ {
+  sim->registers[reg - 4] = (U16)((sim->registers[reg - 4] & 0x00FF) | (value & 0xFF) << 8);
+ }
+}
+
+// r is ax, cx, dx, bx, sp, bp, si, di.
+U16 sim_address(U16 *r, Instruction *inst)
+{
+ if(inst->mod == 0x00 && inst->rm == 0x06)
+ {
+  return inst->displacement;
+ }
+
+ // Same order as eac_table.
+ U16 base = 0;
+ switch(inst->rm)
+ {
+  case 0: base = (U16)(r[3] + r[6]); break;
+  case 1: base = (U16)(r[3] + r[7]); break;
+  case 2: base = (U16)(r[5] + r[6]); break;
+  case 3: base = (U16)(r[5] + r[7]); break;
+  case 4: base = r[6]; break;
+  case 5: base = r[7]; break;
+  case 6: base = r[5]; break;
+  case 7: base = r[3]; break;
+ }
+ U16 displacement = inst->mod == 0x01 ? (U16)(S8)inst->displacement : inst->mod == 0x02 ? inst->displacement : 0;
+ return (U16)(base + displacement);
+}
+
+U16 sim_load(Sim *sim, U16 address, bool w)
+{
+ U16 value = sim->memory[address];
+ if(w)
+ {
+  value |= (U16)(sim->memory[(U16)(address + 1)] << 8);
+ }
+ return value;
+}
+
+void sim_store(Sim *sim, U16 address, bool w, U16 value)
+{
+ sim->memory[address] = (U8)value;
+ if(w)
+ {
+  sim->memory[(U16)(address + 1)] = (U8)(value >> 8);
+  sim->dirty[(U16)(address + 1) / SIM_PAGE_SIZE] = 1;
+ }
+ sim->dirty[address / SIM_PAGE_SIZE] = 1;
+ sim->memory[SIM_MEMORY_SIZE] = sim->memory[0];
+ sim->stores++;
+ sim->store_address = address;
+ sim->store_w = w;
+
+ // Self-modifying code: forget every instruction that could cover the
+ // stored bytes.
+ if(address < sim->code_size)
+ {
+  for(USIZE i = 0; i < MAX_INSTRUCTION_LENGTH + 1u; i++)
+  {
+   sim->decoded[(U16)(address + 1 - i)] = false;
+  }
+  sim->code_written = true;
+  sim->code_write_address = address;
+ }
+}
+
+// Returns the value to store. cmp stores nothing, see sim_step().
+U16 sim_alu(Sim *sim, U8 mnemonic, U16 a, U16 b, bool w)
+{
+ switch(mnemonic)
+ {
+  case MNEMONIC_ADD:
+  {
+   U16 result = (U16)(a + b);
+   sim_record_flags(sim, SIM_OP_ADD, a, b, result, w);
+   return result;
+  }
+  case MNEMONIC_SUB:
+  case MNEMONIC_CMP:
+  {
+   U16 result = (U16)(a - b);
+   sim_record_flags(sim, SIM_OP_SUB, a, b, result, w);
+   return result;
+  }
+ }
+ return b;
+}
+
+// Reads and writes the r/m operand: a register for mod 11, memory otherwise.
+U16 sim_get_rm(Sim *sim, Instruction *inst, U16 address)
+{
+ return inst->mod == 0x03 ? sim_get_register(sim, inst->rm, inst->w) : sim_load(sim, address, inst->w);
+}
+
+void sim_set_rm(Sim *sim, Instruction *inst, U16 address, U16 value)
+{
+ if(inst->mod == 0x03)
+ {
+  sim_set_register(sim, inst->rm, inst->w, value);
+ }
+ else
+ {
+  sim_store(sim, address, inst->w, value);
+ }
+}
+
+// Executes the instruction at ip. Returns false when it does not decode.
+bool sim_step(Sim *sim)
+{
+ U16 ip = sim->ip;
+ Instruction *inst = &sim->cache[ip];
+ if(!sim->decoded[ip])
+ {
+  if(decode_instruction(sim->memory, ip, inst) == DECODE_ERROR)
+  {
+   return false;
+  }
+  sim->decoded[ip] = true;
+ }
+
+ sim->ip = (U16)(ip + inst->length);
+ sim->instructions++;
+ U16 address = inst->mod != 0x03 ? sim_address(sim->registers, inst) : 0;
+
+ switch(inst->form)
+ {
+  case FORM_REG_MEM:
+  {
+   U16 reg = sim_get_register(sim, inst->reg, inst->w);
+   U16 rm = sim_get_rm(sim, inst, address);
+   if(inst->d)
+   {
+    U16 value = sim_alu(sim, inst->mnemonic, reg, rm, inst->w);
+    if(inst->mnemonic != MNEMONIC_CMP)
+    {
+     sim_set_register(sim, inst->reg, inst->w, value);
+    }
+   }
+   else
+   {
+    U16 value = sim_alu(sim, inst->mnemonic, rm, reg, inst->w);
+    if(inst->mnemonic != MNEMONIC_CMP)
+    {
+     sim_set_rm(sim, inst, address, value);
+    }
+   }
+   break;
+  }
+
+  case FORM_IMMEDIATE_REG_MEM:
+  {
+   // 0x83 sign-extends its byte immediate.
+   U16 data = inst->s && inst->w ? (U16)(S8)inst->data : inst->data;
+   U16 rm = sim_get_rm(sim, inst, address);
+   U16 value = sim_alu(sim, inst->mnemonic, rm, data, inst->w);
+   if(inst->mnemonic != MNEMONIC_CMP)
+   {
+    sim_set_rm(sim, inst, address, value);
+   }
+   break;
+  }
+
+  case FORM_IMMEDIATE_TO_REG:
+  {
+   sim_set_register(sim, inst->reg, inst->w, inst->data);
+   break;
+  }
+
+  case FORM_IMMEDIATE_ACCUMULATOR:
+  {
+   U16 accumulator = sim_get_register(sim, 0, inst->w);
+   U16 value = sim_alu(sim, inst->mnemonic, accumulator, inst->data, inst->w);
+   if(inst->mnemonic != MNEMONIC_CMP)
+   {
+    sim_set_register(sim, 0, inst->w, value);
+   }
+   break;
+  }
+
+  case FORM_JUMP:
+  {
+   bool taken = false;
+   U16 *cx = &sim->registers[1];
+   sim->flag_reads += inst->mnemonic < MNEMONIC_LOOP || inst->mnemonic == MNEMONIC_LOOPZ ||
+                      inst->mnemonic == MNEMONIC_LOOPNZ;
+   switch(inst->mnemonic)
+   {
+    case MNEMONIC_LOOP:
+     taken = --*cx != 0;
+     break;
+    case MNEMONIC_LOOPZ:
+     taken = --*cx != 0 && sim_condition(&sim->last, sim->flags, MNEMONIC_JE);
+     break;
+    case MNEMONIC_LOOPNZ:
+     taken = --*cx != 0 && sim_condition(&sim->last, sim->flags, MNEMONIC_JNE);
+     break;
+    case MNEMONIC_JCXZ:
+     taken = *cx == 0;
+     break;
+    default:
+     taken = sim_condition(&sim->last, sim->flags, inst->mnemonic);
+     break;
+   }
+   if(taken)
+   {
+    sim->ip = (U16)(sim->ip + (S8)inst->displacement);
+   }
+   break;
+  }
+ }
+ return true;
+}
+
+char *sim_register_names[8] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
+
+// Writes the letters of the set flags and a terminating 0. Returns how many.
+// Example: CZ
+USIZE sim_flag_letters(U16 flags, char *text)
+{
+ USIZE length = 0;
+ U16 bits[6] = {SIM_FLAG_CF, SIM_FLAG_PF, SIM_FLAG_AF, SIM_FLAG_ZF, SIM_FLAG_SF, SIM_FLAG_OF};
+ for(int i = 0; i < 6; i++)
+ {
+  if(flags & bits[i])
+  {
+   text[length++] = "CPAZSO"[i];
+  }
+ }
+ text[length] = 0;
+ return length;
+}
+
+void sim_print_state(Sim *sim)
+{
+ printf("Final registers:\n");
+ for(int i = 0; i < 8; i++)
+ {
+  if(sim->registers[i])
+  {
+   printf("      %s: 0x%04x (%u)\n", sim_register_names[i], sim->registers[i], sim->registers[i]);
+  }
+ }
+ printf("      ip: 0x%04x (%u)\n", sim->ip, sim->ip);
+
+ char text[8];
+ if(sim_flag_letters(sim_flags(sim), text))
+ {
+  printf("   flags: %s\n", text);
+ }
+}
+
+// Runs until IP leaves the code or the step limit. Returns false when the
+// instruction at IP does not decode.
+bool sim_run(Sim *sim)
+{
+ while(sim->ip < sim->code_size && sim->instructions < sim->limit)
+ {
+  if(!sim_step(sim))
+  {
+   return false;
+  }
+ }
+ return true;
+}
+
+bool jit_run(Sim *sim, U64 threshold, bool output_stats); // jit.c
+bool snapshot_replay(Sim *sim, U64 checkpoint_at, U64 runs, U64 jit_threshold, bool output_stats); // snapshot.c
+bool trace_run(Sim *sim, FILE *file, bool output_stats); // trace.c
+
+// max_steps 0 runs until IP leaves the code. jit_threshold 0 interprets
+// everything. replays 0 runs once without snapshots; otherwise the program
+// runs checkpoint_at steps, then replays times from there. A trace_path
+// overrides both.
+int run_simulate(U8 *bytes, USIZE size, bool eager, U64 max_steps, U64 jit_threshold, U64 replays,
+                 U64 checkpoint_at, char *trace_path, bool output_stats)
+{
+ if(size > SIM_MEMORY_SIZE)
+ {
+  fprintf(stderr, "Error: %zu bytes of code do not fit the 64 KB segment\n", size);
+  return 1;
+ }
+
+ FILE *trace = 0;
+ if(trace_path)
+ {
+  trace = fopen(trace_path, "wb");
+  if(!trace)
+  {
+   fprintf(stderr, "Error: %s: %s\n", strerror(errno), trace_path);
+   return 1;
+  }
+ }
+
+ Sim *sim = calloc(1, sizeof(Sim));
+ memcpy(sim->memory, bytes, size);
+ sim->memory[SIM_MEMORY_SIZE] = sim->memory[0];
+ sim->code_size = size;
+ sim->eager = eager;
+ sim->limit = max_steps ? max_steps : UINT64_MAX;
+
+ int result = 0;
+ U64 start = now_ns();
+ if(trace)
+ {
+  jit_threshold = 0;
+  replays = 0;
+ }
+ bool decoded = trace ? trace_run(sim, trace, output_stats)
+                : replays ? snapshot_replay(sim, checkpoint_at, replays, jit_threshold, output_stats)
+                : jit_threshold ? jit_run(sim, jit_threshold, output_stats) : sim_run(sim);
+ if(!decoded)
+ {
+  // Decoded again for the reason, as the listing reports it.
+  Instruction inst = {0};
+  decode_instruction(sim->memory, sim->ip, &inst);
+  if(inst.form == FORM_UNKNOWN_MNEMONIC)
+  {
+   fprintf(stderr, "Error: Unknown mnemonic for %u of opcode 0x%02X at ip 0x%04x\n", inst.reg,
+           sim->memory[sim->ip], sim->ip);
+  }
+  else
+  {
+   fprintf(stderr, "Error: Unknown opcode 0x%02X at ip 0x%04x\n", sim->memory[sim->ip], sim->ip);
+  }
+  result = 1;
+ }
+ U64 simulate_ns = now_ns() - start;
+ if(trace && (ferror(trace) | fclose(trace)))
+ {
+  fprintf(stderr, "Error: Could not write %s\n", trace_path);
+  result = 1;
+ }
+
+ sim_print_state(sim);
+
+ // snapshot_replay() prints its own rates.
+ if(output_stats && !replays)
+ {
+  double seconds = (double)simulate_ns / 1e9;
+  fprintf(stderr, "simulate: %s, %llu instructions, %.3f s, %.1f M instructions/s\n",
+          jit_threshold ? "jit" : eager ? "eager flags" : "lazy flags", (unsigned long long)sim->instructions,
+          seconds, seconds > 0 ? (double)sim->instructions / 1e6 / seconds : 0.0);
+  if(!jit_threshold)
+  {
+   fprintf(stderr, "simulate: %llu flag writes, %llu conditional reads (%.1f%%)\n",
+           (unsigned long long)sim->flag_writes, (unsigned long long)sim->flag_reads,
+           sim->flag_writes ? 100.0 * (double)sim->flag_reads / (double)sim->flag_writes : 0.0);
+  }
+ }
+
+ free(sim);
+ return result;
+}
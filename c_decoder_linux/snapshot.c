@@ -0,0 +1,210 @@
+// Copy-on-write snapshots of the simulator, for --simulate --replay N.
+// Included at the bottom of main.c, after sim.c and jit.c.
+//
+// A snapshot holds the registers and flags and a table of SIM_PAGE_COUNT
+// pages. Pages are shared by reference: a snapshot taken after another one
+// copies only the pages stored to in between and points at the other's
+// pages for the rest. The Sim keeps, in base, the snapshot page each of its
+// own pages equals, and every store sets the page's dirty byte (sim_store()
+// and the translated stores of jit.c). Restoring a snapshot then copies the
+// pages that are dirty or whose base differs, so resetting to the snapshot
+// last taken or restored costs as much as the pages the run wrote.
+//
+// --replay N runs --checkpoint-at steps, takes a snapshot, and runs the
+// rest of the program N times from it. The decode cache survives every
+// restore except of the pages that hold code. With --jit the runs share one
+// translation buffer, and a restore drops only the blocks on the code pages
+// it copies.
+//
+// Example: --simulate --replay 10000 --checkpoint-at 100 --output-stats loop.bin
+
+typedef struct
+{
+ U16 registers[8];
+ U16 ip;
+ U16 flags;
+ LazyFlags last;
+ U64 instructions;
+ SimPage *pages[SIM_PAGE_COUNT];
+} SimSnapshot;
+
+void snapshot_release_page(SimPage *page)
+{
+ if(page && --page->references == 0)
+ {
+  free(page);
+ }
+}
+
+void snapshot_assign_page(SimPage **slot, SimPage *page)
+{
+ page->references++;
+ snapshot_release_page(*slot);
+ *slot = page;
+}
+
+SimSnapshot *snapshot_take(Sim *sim)
+{
+ SimSnapshot *snapshot = malloc(sizeof(SimSnapshot));
+ memcpy(snapshot->registers, sim->registers, sizeof(sim->registers));
+ snapshot->ip = sim->ip;
+ snapshot->flags = sim->flags;
+ snapshot->last = sim->last;
+ snapshot->instructions = sim->instructions;
+
+ for(USIZE i = 0; i < SIM_PAGE_COUNT; i++)
+ {
+  SimPage *page = sim->base[i];
+  if(!page || sim->dirty[i])
+  {
+   page = malloc(sizeof(SimPage));
+   page->references = 0;
+   memcpy(page->bytes, sim->memory + i * SIM_PAGE_SIZE, SIM_PAGE_SIZE);
+   snapshot_assign_page(&sim->base[i], page);
+   sim->dirty[i] = 0;
+  }
+  page->references++;
+  snapshot->pages[i] = page;
+ }
+ return snapshot;
+}
+
+// Returns the number of pages copied. jit may be 0.
+USIZE snapshot_restore(Sim *sim, SimSnapshot *snapshot, Jit *jit)
+{
+ memcpy(sim->registers, snapshot->registers, sizeof(sim->registers));
+ sim->ip = snapshot->ip;
+ sim->flags = snapshot->flags;
+ sim->last = snapshot->last;
+ sim->instructions = snapshot->instructions;
+
+ USIZE copied = 0;
+ for(USIZE i = 0; i < SIM_PAGE_COUNT; i++)
+ {
+  SimPage *page = snapshot->pages[i];
+  if(!sim->dirty[i] && sim->base[i] == page)
+  {
+   continue;
+  }
+  // Instructions that overlap restored code are decoded and translated
+  // again, unless the run only stored to data on the page.
+  U16 start = (U16)(i * SIM_PAGE_SIZE);
+  USIZE code = start < sim->code_size ? sim->code_size - start : 0;
+  bool code_changed = code && memcmp(sim->memory + start, page->bytes, code < SIM_PAGE_SIZE ? code : SIM_PAGE_SIZE);
+  memcpy(sim->memory + i * SIM_PAGE_SIZE, page->bytes, SIM_PAGE_SIZE);
+  snapshot_assign_page(&sim->base[i], page);
+  sim->dirty[i] = 0;
+  copied++;
+
+  if(code_changed)
+  {
+   for(USIZE k = 0; k < SIM_PAGE_SIZE + MAX_INSTRUCTION_LENGTH; k++)
+   {
+    sim->decoded[(U16)(start - MAX_INSTRUCTION_LENGTH + k)] = false;
+   }
+   if(jit)
+   {
+    jit_invalidate_range(jit, start, SIM_PAGE_SIZE);
+   }
+  }
+ }
+ sim->memory[SIM_MEMORY_SIZE] = sim->memory[0];
+ sim->code_written = false;
+ return copied;
+}
+
+void snapshot_free(SimSnapshot *snapshot)
+{
+ for(USIZE i = 0; i < SIM_PAGE_COUNT; i++)
+ {
+  snapshot_release_page(snapshot->pages[i]);
+ }
+ free(snapshot);
+}
+
+// Drops the Sim's references to snapshot pages.
+void snapshot_forget(Sim *sim)
+{
+ for(USIZE i = 0; i < SIM_PAGE_COUNT; i++)
+ {
+  snapshot_release_page(sim->base[i]);
+  sim->base[i] = 0;
+ }
+}
+
+// Copies the dirty pages of memory back from image and clears them.
+// Returns the number of pages copied.
+USIZE snapshot_reset_pages(U8 *memory, U8 *dirty, U8 *image)
+{
+ USIZE copied = 0;
+ for(USIZE i = 0; i < SIM_PAGE_COUNT; i++)
+ {
+  if(dirty[i])
+  {
+   memcpy(memory + i * SIM_PAGE_SIZE, image + i * SIM_PAGE_SIZE, SIM_PAGE_SIZE);
+   dirty[i] = 0;
+   copied++;
+  }
+ }
+ memory[SIM_MEMORY_SIZE] = memory[0];
+ return copied;
+}
+
+// Runs the sim checkpoint_at steps, snapshots it, and runs it to the end
+// runs times, restoring the snapshot before each. The last run is left in
+// the sim. Returns false when an instruction does not decode.
+// jit_threshold 0 interprets, as does a jit that cannot be mapped.
+bool snapshot_replay(Sim *sim, U64 checkpoint_at, U64 runs, U64 jit_threshold, bool output_stats)
+{
+ U64 limit = sim->limit;
+ sim->limit = checkpoint_at < limit ? checkpoint_at : limit;
+ if(!sim_run(sim))
+ {
+  return false;
+ }
+ sim->limit = limit;
+ SimSnapshot *checkpoint = snapshot_take(sim);
+ Jit *jit = jit_threshold ? jit_open(sim) : 0;
+
+ bool result = true;
+ U64 done = 0;
+ U64 instructions = 0;
+ U64 copied = 0;
+ U64 restore_ns = 0;
+ U64 start = now_ns();
+ for(; done < runs && result; done++)
+ {
+  U64 restore_start = now_ns();
+  copied += snapshot_restore(sim, checkpoint, jit);
+  restore_ns += now_ns() - restore_start;
+
+  result = jit ? jit_execute(jit, jit_threshold) : sim_run(sim);
+  instructions += sim->instructions - checkpoint->instructions;
+ }
+ U64 replay_ns = now_ns() - start;
+
+ if(output_stats)
+ {
+  double seconds = (double)replay_ns / 1e9;
+  double restore_seconds = (double)restore_ns / 1e9;
+  fprintf(stderr, "replay: %llu runs from step %llu, %llu instructions, %.3f s, %.1f M instructions/s\n",
+          (unsigned long long)done, (unsigned long long)checkpoint->instructions,
+          (unsigned long long)instructions, seconds, seconds > 0 ? (double)instructions / 1e6 / seconds : 0.0);
+  fprintf(stderr, "replay: %.1f of %d pages copied per restore, %.0f restores/s\n",
+          done ? (double)copied / (double)done : 0.0, SIM_PAGE_COUNT,
+          restore_seconds > 0 ? (double)done / restore_seconds : 0.0);
+  if(jit)
+  {
+   jit_print_stats(jit, instructions);
+  }
+ }
+
+ if(jit)
+ {
+  jit_close(jit);
+ }
+
+ snapshot_free(checkpoint);
+ snapshot_forget(sim);
+ return result;
+}
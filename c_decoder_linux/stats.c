@@ -0,0 +1,315 @@
+// Statistics mode, selected with --stats. Decodes without formatting and
+// prints histograms over mnemonic, ModRM mod, effective address, operand
+// width, immediate size and jump distance. Included at the bottom of
+// main.c.
+//
+// Unlike the listing, an undecodable byte does not stop decoding: it is
+// counted as invalid and decoding resumes at the next byte, so every range
+// of a multi-GB input can be decoded on its own.
+//
+// The input is split into one range per thread and each thread fills its
+// own histograms, merged once at the end. A thread cannot know where the
+// first instruction of its range starts, so it guesses its range start and
+// logs the instructions of its first STATS_SYNC_WINDOW bytes instead of
+// counting them. The previous thread decodes past its range end to the
+// first instruction boundary there. Instruction streams resynchronize
+// within a few instructions, so that boundary is almost always one the
+// next thread also decoded; its logged instructions from there on are
+// counted. Otherwise the merge decodes that stretch again on its own.
+
+#include <pthread.h>
+
+#define STATS_MAX_THREADS 64
+#define STATS_MIN_RANGE (1024 * 1024) // Smallest range worth a thread
+#define STATS_SYNC_WINDOW 4096
+
+enum
+{
+ STATS_EAC_DIRECT = 8, // mod 00, rm 110: [direct address]
+ STATS_EAC_COUNT,
+};
+
+char *stats_eac_names[STATS_EAC_COUNT] = {
+ "[bx + si]", "[bx + di]", "[bp + si]", "[bp + di]", "[si]", "[di]", "[bp]", "[bx]", "[direct]",
+};
+
+typedef struct
+{
+ U64 instructions;
+ U64 invalid;
+ U64 mnemonic[MNEMONIC_COUNT];
+ U64 mod[4];
+ U64 eac[STATS_EAC_COUNT];
+ U64 width[2];
+ U64 immediate_size[3];
+ U64 jump[256]; // [(U8)displacement]
+} Histograms;
+
+typedef struct
+{
+ _Alignas(64) Histograms histograms;
+ U8 *bytes;
+ USIZE size;
+ USIZE begin;
+ USIZE end;
+ USIZE next; // First instruction boundary at or after end
+
+ // Instructions in [begin, begin + STATS_SYNC_WINDOW), not yet counted.
+ // An invalid byte is logged with form FORM_UNKNOWN_OPCODE.
+ Instruction *window;
+ USIZE window_count;
+} StatsRange;
+
+// Immediate bytes read by the decode helpers.
+USIZE stats_immediate_size(Instruction *inst)
+{
+ switch(inst->form)
+ {
+  case FORM_IMMEDIATE_TO_REG:
+  case FORM_IMMEDIATE_ACCUMULATOR:
+   return inst->w ? 2 : 1;
+
+  case FORM_IMMEDIATE_REG_MEM:
+  {
+   USIZE displacement = 0;
+   if(inst->mod == 0x00 && inst->rm == 0x06) displacement = 2;
+   else if(inst->mod == 0x01) displacement = 1;
+   else if(inst->mod == 0x02) displacement = 2;
+   return inst->length - 2 - displacement;
+  }
+ }
+ return 0;
+}
+
+void stats_count(Histograms *h, Instruction *inst)
+{
+ if(inst->form == FORM_UNKNOWN_OPCODE)
+ {
+  h->invalid++;
+  return;
+ }
+
+ h->instructions++;
+ h->mnemonic[inst->mnemonic]++;
+ h->immediate_size[stats_immediate_size(inst)]++;
+ if(inst->form == FORM_JUMP)
+ {
+  h->jump[inst->displacement & 0xFF]++;
+  return;
+ }
+
+ h->width[inst->w]++;
+ if(inst->form == FORM_REG_MEM || inst->form == FORM_IMMEDIATE_REG_MEM)
+ {
+  h->mod[inst->mod]++;
+  if(inst->mod == 0x00 && inst->rm == 0x06)
+  {
+   h->eac[STATS_EAC_DIRECT]++;
+  }
+  else if(inst->mod != 0x03)
+  {
+   h->eac[inst->rm]++;
+  }
+ }
+}
+
+// Decodes the instruction at pos, or marks the byte invalid. Returns the
+// next position.
+USIZE stats_step(U8 *bytes, USIZE size, USIZE pos, Instruction *inst)
+{
+ // The tail padding keeps the opcode and ModRM reads in bounds.
+ USIZE length = instruction_length(bytes, pos);
+ if(length && pos + length <= size && decode_instruction(bytes, pos, inst) != DECODE_ERROR)
+ {
+  return pos + inst->length;
+ }
+
+ inst->form = FORM_UNKNOWN_OPCODE;
+ inst->offset = pos;
+ if(length && pos + length > size)
+ {
+  // Truncated at the end of the input.
+  return size;
+ }
+ return pos + 1;
+}
+
+void stats_add(Histograms *to, Histograms *from)
+{
+ U64 *a = (U64 *)to;
+ U64 *b = (U64 *)from;
+ for(USIZE i = 0; i < sizeof(Histograms) / sizeof(U64); i++)
+ {
+  a[i] += b[i];
+ }
+}
+
+void *stats_decode_range(void *arg)
+{
+ StatsRange *range = arg;
+ Instruction inst;
+ USIZE pos = range->begin;
+
+ if(range->window)
+ {
+  USIZE window_end = range->begin + STATS_SYNC_WINDOW;
+  while(pos < range->end && pos < window_end)
+  {
+   pos = stats_step(range->bytes, range->size, pos, &range->window[range->window_count++]);
+  }
+ }
+
+ while(pos < range->end)
+ {
+  pos = stats_step(range->bytes, range->size, pos, &inst);
+  stats_count(&range->histograms, &inst);
+ }
+ range->next = pos;
+ return 0;
+}
+
+// Looks for the boundary pos among the count instructions a range logged.
+// Returns the index of that instruction, or -1. verify.c stitches its
+// ranges with it too.
+long stats_find_sync(Instruction *window, USIZE count, USIZE pos)
+{
+ for(USIZE i = 0; i < count; i++)
+ {
+  if(window[i].offset == pos)
+  {
+   return (long)i;
+  }
+  if(window[i].offset > pos)
+  {
+   break;
+  }
+ }
+ return -1;
+}
+
+void stats_print(char *section, char *key, U64 count, U64 total)
+{
+ printf("%-10s %-12s %14llu %7.2f%%\n", section, key, (unsigned long long)count,
+        total ? 100.0 * (double)count / (double)total : 0.0);
+}
+
+void stats_report(Histograms *h)
+{
+ char key[32];
+ U64 total = h->instructions;
+ printf("%-10s %-12s %14llu\n", "total", "instructions", (unsigned long long)total);
+ printf("%-10s %-12s %14llu\n", "total", "invalid", (unsigned long long)h->invalid);
+
+ for(int i = 0; i < MNEMONIC_COUNT; i++)
+ {
+  stats_print("mnemonic", mnemonic_names[i], h->mnemonic[i], total);
+ }
+ for(int i = 0; i < 4; i++)
+ {
+  snprintf(key, sizeof(key), "%d%d", i >> 1, i & 1);
+  stats_print("mod", key, h->mod[i], total);
+ }
+ for(int i = 0; i < STATS_EAC_COUNT; i++)
+ {
+  stats_print("eac", stats_eac_names[i], h->eac[i], total);
+ }
+ stats_print("width", "byte", h->width[0], total);
+ stats_print("width", "word", h->width[1], total);
+ stats_print("immediate", "none", h->immediate_size[0], total);
+ stats_print("immediate", "8-bit", h->immediate_size[1], total);
+ stats_print("immediate", "16-bit", h->immediate_size[2], total);
+
+ // Jump distances in power of two buckets, from the end of the jump.
+ int bounds[] = {-128, -64, -32, -16, -8, 0, 8, 16, 32, 64, 128};
+ for(USIZE b = 0; b + 1 < sizeof(bounds) / sizeof(bounds[0]); b++)
+ {
+  U64 count = 0;
+  for(int d = bounds[b]; d < bounds[b + 1]; d++)
+  {
+   count += h->jump[(U8)d];
+  }
+  snprintf(key, sizeof(key), "%d..%d", bounds[b], bounds[b + 1] - 1);
+  stats_print("jump", key, count, total);
+ }
+}
+
+int run_stats(U8 *bytes, USIZE size, bool output_stats)
+{
+ long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+ USIZE thread_count = cpus > 0 ? (USIZE)cpus : 1;
+ if(thread_count > STATS_MAX_THREADS)
+ {
+  thread_count = STATS_MAX_THREADS;
+ }
+ if(thread_count > size / STATS_MIN_RANGE)
+ {
+  thread_count = size / STATS_MIN_RANGE ? size / STATS_MIN_RANGE : 1;
+ }
+
+ StatsRange *ranges = aligned_alloc(64, sizeof(StatsRange) * thread_count);
+ memset(ranges, 0, sizeof(StatsRange) * thread_count);
+ pthread_t threads[STATS_MAX_THREADS];
+
+ U64 start = now_ns();
+ for(USIZE i = 0; i < thread_count; i++)
+ {
+  StatsRange *range = &ranges[i];
+  range->bytes = bytes;
+  range->size = size;
+  range->begin = size * i / thread_count;
+  range->end = size * (i + 1) / thread_count;
+  if(i)
+  {
+   range->window = malloc(STATS_SYNC_WINDOW * sizeof(Instruction));
+  }
+  pthread_create(&threads[i], 0, stats_decode_range, range);
+ }
+ for(USIZE i = 0; i < thread_count; i++)
+ {
+  pthread_join(threads[i], 0);
+ }
+
+ // Stitch the ranges together. The first one started at a real boundary.
+ Histograms total = ranges[0].histograms;
+ USIZE pos = ranges[0].next;
+ USIZE resyncs = 0;
+ for(USIZE i = 1; i < thread_count; i++)
+ {
+  StatsRange *range = &ranges[i];
+  long sync = stats_find_sync(range->window, range->window_count, pos);
+  if(sync >= 0)
+  {
+   for(USIZE j = (USIZE)sync; j < range->window_count; j++)
+   {
+    stats_count(&total, &range->window[j]);
+   }
+   stats_add(&total, &range->histograms);
+   pos = range->next;
+  }
+  else
+  {
+   // No shared boundary in the window, decode the range again from pos.
+   resyncs++;
+   Instruction inst;
+   while(pos < range->end)
+   {
+    pos = stats_step(bytes, size, pos, &inst);
+    stats_count(&total, &inst);
+   }
+  }
+  free(range->window);
+ }
+ U64 decode_ns = now_ns() - start;
+
+ stats_report(&total);
+
+ if(output_stats)
+ {
+  double seconds = (double)decode_ns / 1e9;
+  fprintf(stderr, "stats: %zu bytes, %zu threads, %zu resyncs, %.3f s, %.1f MB/s\n",
+          size, thread_count, resyncs, seconds, seconds > 0 ? (double)size / 1e6 / seconds : 0.0);
+ }
+
+ free(ranges);
+ return 0;
+}
@@ -0,0 +1,119 @@
+// Streaming mode for stdin and pipes, selected with "-" as the filename or
+// --stream <file>. Input is decoded as it arrives, in constant memory: a
+// fixed buffer holds the partial instruction left at the end of the last
+// read in front of the bytes of the next one. Output for each read is
+// written before the next read starts. Included at the bottom of main.c.
+
+#define STREAM_READ_SIZE (64 * 1024)
+
+int run_stream(int fd, bool output_stats, bool resilient)
+{
+ static U8 buffer[MAX_INSTRUCTION_LENGTH + STREAM_READ_SIZE + INPUT_TAIL_PADDING];
+
+ Output out;
+ if(!output_open(&out, STDOUT_FILENO))
+ {
+  return 1;
+ }
+
+ Instruction inst = {0};
+ USIZE carry_size = 0;
+ USIZE stream_offset = 0; // Input offset of buffer[0]
+ USIZE total_read = 0;
+ USIZE data_bytes = 0;
+
+ bool last = false;
+ while(!last)
+ {
+  ssize_t n = read(fd, buffer + carry_size, STREAM_READ_SIZE);
+  if(n < 0 && errno == EINTR)
+  {
+   continue;
+  }
+  if(n < 0)
+  {
+   fprintf(stderr, "Error: %s: read\n", strerror(errno));
+   return 1;
+  }
+
+  last = (n == 0);
+  total_read += (USIZE)n;
+  USIZE end = carry_size + (USIZE)n;
+  memset(buffer + end, 0, INPUT_TAIL_PADDING);
+
+  USIZE pos = 0;
+  while(pos < end)
+  {
+   if(pos + MAX_INSTRUCTION_LENGTH > end)
+   {
+    USIZE length = instruction_length(buffer, pos);
+    if(length == 0 || pos + length > end)
+    {
+     if(!last)
+     {
+      // Wait for the rest of this instruction.
+      break;
+     }
+
+     if(length && resilient)
+     {
+      decode_data_byte(buffer, pos, &inst);
+      data_bytes++;
+      inst.offset += stream_offset;
+      output_write_instruction(&out, &inst);
+      pos++;
+      continue;
+     }
+
+     if(length)
+     {
+      inst.form = FORM_TRUNCATED;
+      inst.offset = stream_offset + pos;
+      output_write_instruction(&out, &inst);
+      pos = end;
+      break;
+     }
+    }
+   }
+
+   USIZE next = decode_instruction(buffer, pos, &inst);
+   if(next == DECODE_ERROR && resilient)
+   {
+    next = decode_data_byte(buffer, pos, &inst);
+    data_bytes++;
+   }
+   inst.offset += stream_offset;
+   output_write_instruction(&out, &inst);
+   if(next == DECODE_ERROR)
+   {
+    output_close(&out, output_stats);
+    return 0;
+   }
+   pos = next + 1;
+  }
+
+  output_flush(&out);
+  if(out.failed)
+  {
+   return 1;
+  }
+
+  carry_size = end - pos;
+  memmove(buffer, buffer + pos, carry_size);
+  stream_offset += pos;
+ }
+
+ output_close(&out, output_stats);
+ if(data_bytes)
+ {
+  fprintf(stderr, "resilient: %zu undecodable bytes emitted as db\n", data_bytes);
+ }
+
+ if(total_read == 0)
+ {
+  printf("Zero bytes read\n");
+  return 1;
+ }
+
+ return 0;
+}
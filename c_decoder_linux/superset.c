@@ -0,0 +1,177 @@
+// Superset disassembly, selected with --superset. An instruction is decoded
+// at every byte offset, so code hidden behind data or overlapping other
+// instructions is not missed. Included at the bottom of main.c.
+//
+// The offsets are split across threads. Each one runs decode_instruction(),
+// i.e. the same length and ModRM logic as common_displacement() and
+// common_immediate(), and records the length, or 0 when nothing valid
+// decodes there. The fall-through graph is implicit: offset + length.
+//
+// Boundaries are then chosen by chain length, the number of valid
+// instructions reached by falling through from an offset. Starting at
+// offset 0, and again after every invalid byte, the offset with the longest
+// chain within MAX_INSTRUCTION_LENGTH bytes is taken and followed.
+//
+// Output is one line per offset:
+//
+//   <offset> <length> <chain length> <* if chosen, - if not>
+//
+// Example: 12 3 40 *
+
+#include <pthread.h>
+
+#define SUPERSET_MAX_THREADS 64
+#define SUPERSET_MIN_RANGE (64 * 1024) // Smallest range worth a thread
+#define SUPERSET_CHOSEN 0x80 // Flag in lengths[], above any length
+
+typedef struct
+{
+ U8 *bytes;
+ USIZE size;
+ U8 *lengths;
+ USIZE begin;
+ USIZE end;
+ USIZE valid;
+} SupersetRange;
+
+void *superset_decode_range(void *arg)
+{
+ SupersetRange *range = arg;
+ Instruction inst;
+ for(USIZE pos = range->begin; pos < range->end; pos++)
+ {
+  // The tail padding keeps the opcode and ModRM reads in bounds.
+  USIZE length = instruction_length(range->bytes, pos);
+  if(length == 0 || pos + length > range->size ||
+     decode_instruction(range->bytes, pos, &inst) == DECODE_ERROR)
+  {
+   range->lengths[pos] = 0;
+   continue;
+  }
+  range->lengths[pos] = inst.length;
+  range->valid++;
+ }
+ return 0;
+}
+
+char *superset_emit_usize(char *out, USIZE value)
+{
+ char digits[20];
+ USIZE count = 0;
+ do
+ {
+  digits[count++] = (char)('0' + value % 10);
+  value /= 10;
+ } while(value);
+
+ while(count)
+ {
+  *out++ = digits[--count];
+ }
+ return out;
+}
+
+int run_superset(U8 *bytes, USIZE size, bool output_stats)
+{
+ U8 *lengths = malloc(size);
+ U32 *chains = malloc((size + 1) * sizeof(U32));
+
+ Output out;
+ if(!output_open(&out, STDOUT_FILENO))
+ {
+  free(lengths);
+  free(chains);
+  return 1;
+ }
+
+ long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+ USIZE thread_count = cpus > 0 ? (USIZE)cpus : 1;
+ if(thread_count > SUPERSET_MAX_THREADS)
+ {
+  thread_count = SUPERSET_MAX_THREADS;
+ }
+ if(thread_count > size / SUPERSET_MIN_RANGE)
+ {
+  thread_count = size / SUPERSET_MIN_RANGE ? size / SUPERSET_MIN_RANGE : 1;
+ }
+
+ U64 start = now_ns();
+ SupersetRange ranges[SUPERSET_MAX_THREADS];
+ pthread_t threads[SUPERSET_MAX_THREADS];
+ for(USIZE i = 0; i < thread_count; i++)
+ {
+  ranges[i] = (SupersetRange){bytes, size, lengths, size * i / thread_count, size * (i + 1) / thread_count, 0};
+  pthread_create(&threads[i], 0, superset_decode_range, &ranges[i]);
+ }
+ USIZE valid = 0;
+ for(USIZE i = 0; i < thread_count; i++)
+ {
+  pthread_join(threads[i], 0);
+  valid += ranges[i].valid;
+ }
+ U64 decode_ns = now_ns() - start;
+
+ // Chain lengths, back to front: a valid offset extends the chain it falls
+ // through to. chains[size] ends every chain that runs exactly to the end.
+ chains[size] = 0;
+ for(USIZE pos = size; pos--;)
+ {
+  chains[pos] = lengths[pos] ? chains[pos + lengths[pos]] + 1 : 0;
+ }
+
+ USIZE chosen = 0;
+ USIZE pos = 0;
+ while(pos < size)
+ {
+  USIZE window_end = pos + MAX_INSTRUCTION_LENGTH < size ? pos + MAX_INSTRUCTION_LENGTH : size;
+  USIZE best = pos;
+  for(USIZE i = pos + 1; i < window_end; i++)
+  {
+   if(chains[i] > chains[best])
+   {
+    best = i;
+   }
+  }
+  if(chains[best] == 0)
+  {
+   // Nothing valid starts in this window.
+   pos = window_end;
+   continue;
+  }
+
+  pos = best;
+  while(pos < size && lengths[pos])
+  {
+   USIZE length = lengths[pos];
+   lengths[pos] |= SUPERSET_CHOSEN;
+   chosen++;
+   pos += length;
+  }
+ }
+
+ for(USIZE i = 0; i < size; i++)
+ {
+  char *line = output_reserve(&out, MAX_LINE_LENGTH);
+  char *end = superset_emit_usize(line, i);
+  *end++ = ' ';
+  *end++ = (char)('0' + (lengths[i] & ~SUPERSET_CHOSEN));
+  *end++ = ' ';
+  end = superset_emit_usize(end, chains[i]);
+  *end++ = ' ';
+  *end++ = (lengths[i] & SUPERSET_CHOSEN) ? '*' : '-';
+  *end++ = '\n';
+  output_commit(&out, (USIZE)(end - line));
+ }
+
+ if(output_stats)
+ {
+  double seconds = (double)decode_ns / 1e9;
+  fprintf(stderr, "superset: %zu offsets, %zu valid, %zu chosen, %zu threads, %.3f s decoding, %.1f MB/s\n",
+          size, valid, chosen, thread_count, seconds, seconds > 0 ? (double)size / 1e6 / seconds : 0.0);
+ }
+ output_close(&out, output_stats);
+
+ free(lengths);
+ free(chains);
+ return 0;
+}
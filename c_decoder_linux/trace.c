@@ -0,0 +1,742 @@
+// Execution traces of the simulator. --simulate --trace <file> writes one
+// record per executed instruction; --read-trace prints a trace file (the
+// input) as text. Included at the bottom of main.c, after sim.c.
+//
+// A trace starts with the magic, the size of the code and the code. Each
+// step record holds only what the instruction changed:
+//
+//   header    bits 0-3 the changed register, index + 1, or 9 when a mask
+//             byte of changed registers follows; bit 4 flags, bit 5 store,
+//             bit 6 jump taken
+//   registers the new value minus the old one, zigzag varint, per register
+//   flags     CF PF AF ZF SF OF in bits 0-5, only after a cmp with memory
+//   store     zigzag varint of the address minus the last store's, shifted
+//             left by one with w in bit 0, then the 1 or 2 stored bytes
+//   jump      zigzag varint of the new ip minus the next instruction's
+//
+// The offset of an instruction is where the last one left ip, so the
+// reader decodes the code itself, and applies the stores to it for
+// self-modifying code. It also computes the flags of add, sub and cmp from
+// the registers and stores it sees, which leaves out only the value a cmp
+// loads from memory. An add to a register usually takes 2 or 3 bytes.
+//
+// Every TRACE_KEYFRAME_INTERVAL steps a keyframe record holds the step
+// number, the full registers and flags, and the code pages written since
+// the start. The trace ends with an index of the keyframes, so a reader
+// can start at any step with --trace-from: it seeks to the keyframe before
+// it and reads on from there.
+//
+// The writer interprets: --jit and --replay do not apply.
+//
+// Example: --simulate --trace loop.trace loop.bin
+// Example: --read-trace --trace-from 1000 loop.trace
+//
+// Example output line, for step 2 at ip 0x0003:
+//   2 0x0003: add [bp + 0], 1 ; flags=P [0x8000]=0x0001
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define TRACE_MAGIC "8086TRC1"
+#define TRACE_INDEX_MAGIC "8086TIDX"
+#define TRACE_KEYFRAME_INTERVAL 4096
+#define TRACE_BUFFER_SIZE (1024 * 1024)
+#define TRACE_MAX_RECORD 64 // A step record; keyframes check on their own
+
+enum
+{
+ TRACE_REGISTER_MASK = 9, // In the header's register field
+ TRACE_FLAGS = 1 << 4,
+ TRACE_STORE = 1 << 5,
+ TRACE_JUMP = 1 << 6,
+ TRACE_KEYFRAME = 0x80, // Record types other than steps have bit 7 set
+ TRACE_END = 0x81,
+};
+
+typedef struct
+{
+ FILE *file;
+ U8 *buffer;
+ USIZE used;
+ U64 flushed; // Bytes written to the file before the buffer
+
+ U16 registers[8]; // As of the last record
+ U16 store_address;
+
+ U64 *keyframes; // File offset of each keyframe
+ USIZE keyframe_count;
+ USIZE keyframe_capacity;
+ U64 first_step; // Of the first keyframe
+} TraceWriter;
+
+// CF PF AF ZF SF OF to bits 0-5 and back.
+U8 trace_pack_flags(U16 flags)
+{
+ return (U8)((flags & SIM_FLAG_CF) | (flags & SIM_FLAG_PF) >> 1 | (flags & SIM_FLAG_AF) >> 2 |
+             (flags & (SIM_FLAG_ZF | SIM_FLAG_SF)) >> 3 | (flags & SIM_FLAG_OF) >> 6);
+}
+
+U16 trace_unpack_flags(U8 packed)
+{
+ return (U16)((packed & 0x01) | (packed & 0x02) << 1 | (packed & 0x04) << 2 | (packed & 0x18) << 3 |
+              (packed & 0x20) << 6);
+}
+
+U32 trace_zigzag(S32 value)
+{
+ return (U32)value << 1 ^ (U32)(value >> 31);
+}
+
+S32 trace_unzigzag(U32 value)
+{
+ return (S32)(value >> 1) ^ -(S32)(value & 1);
+}
+
+U8 *trace_put_varint(U8 *out, U64 value)
+{
+ while(value >= 0x80)
+ {
+  *out++ = (U8)(value | 0x80);
+  value >>= 7;
+ }
+ *out++ = (U8)value;
+ return out;
+}
+
+void trace_flush(TraceWriter *trace)
+{
+ fwrite(trace->buffer, 1, trace->used, trace->file);
+ trace->flushed += trace->used;
+ trace->used = 0;
+}
+
+// Returns space for size bytes. Follow with trace_commit().
+U8 *trace_reserve(TraceWriter *trace, USIZE size)
+{
+ if(trace->used + size > TRACE_BUFFER_SIZE)
+ {
+  trace_flush(trace);
+ }
+ return trace->buffer + trace->used;
+}
+
+void trace_commit(TraceWriter *trace, U8 *end)
+{
+ trace->used = (USIZE)(end - trace->buffer);
+}
+
+void trace_write(TraceWriter *trace, void *bytes, USIZE size)
+{
+ U8 *out = trace_reserve(trace, size);
+ memcpy(out, bytes, size);
+ trace_commit(trace, out + size);
+}
+
+// Bit i set when register i differs.
+U8 trace_changed_registers(U16 *now, U16 *before)
+{
+#ifdef __SSE2__
+ __m128i equal = _mm_cmpeq_epi16(_mm_loadu_si128((__m128i *)now), _mm_loadu_si128((__m128i *)before));
+ return (U8)~_mm_movemask_epi8(_mm_packs_epi16(equal, equal));
+#else
+ U8 mask = 0;
+ for(int i = 0; i < 8; i++)
+ {
+  mask |= (U8)((now[i] != before[i]) << i);
+ }
+ return mask;
+#endif
+}
+
+// The flags as they are, without materializing the lazy ones.
+U16 trace_current_flags(Sim *sim)
+{
+ return sim->last.op == SIM_OP_NONE ? sim->flags : sim_compute_flags(&sim->last);
+}
+
+// A cmp with a memory operand: the reader does not know the loaded value,
+// so the flags go into the record.
+bool trace_flags_hidden(Instruction *inst)
+{
+ return inst->mnemonic == MNEMONIC_CMP && inst->mod != 0x03 &&
+        (inst->form == FORM_REG_MEM || inst->form == FORM_IMMEDIATE_REG_MEM);
+}
+
+void trace_keyframe(TraceWriter *trace, Sim *sim)
+{
+ if(trace->keyframe_count == trace->keyframe_capacity)
+ {
+  trace->keyframe_capacity = trace->keyframe_capacity ? trace->keyframe_capacity * 2 : 256;
+  trace->keyframes = realloc(trace->keyframes, trace->keyframe_capacity * sizeof(U64));
+ }
+ if(!trace->keyframe_count)
+ {
+  trace->first_step = sim->instructions;
+ }
+ trace->keyframes[trace->keyframe_count++] = trace->flushed + trace->used;
+
+ // Records after the keyframe are relative to it alone.
+ memcpy(trace->registers, sim->registers, sizeof(trace->registers));
+ trace->store_address = 0;
+
+ U8 *out = trace_reserve(trace, 64);
+ *out++ = TRACE_KEYFRAME;
+ out = trace_put_varint(out, sim->instructions);
+ memcpy(out, &sim->ip, 2);
+ memcpy(out + 2, sim->registers, 16);
+ out[18] = trace_pack_flags(trace_current_flags(sim));
+ out += 19;
+
+ // Code pages that were stored to, as they are now. Instructions may reach
+ // MAX_INSTRUCTION_LENGTH bytes past the code.
+ USIZE pages = (sim->code_size + MAX_INSTRUCTION_LENGTH + SIM_PAGE_SIZE - 1) / SIM_PAGE_SIZE;
+ pages = pages < SIM_PAGE_COUNT ? pages : SIM_PAGE_COUNT;
+ USIZE count = 0;
+ for(USIZE i = 0; i < pages; i++)
+ {
+  count += sim->dirty[i] != 0;
+ }
+ out = trace_put_varint(out, count);
+ trace_commit(trace, out);
+ for(USIZE i = 0; i < pages; i++)
+ {
+  if(sim->dirty[i])
+  {
+   U8 page = (U8)i;
+   trace_write(trace, &page, 1);
+   trace_write(trace, sim->memory + i * SIM_PAGE_SIZE, SIM_PAGE_SIZE);
+  }
+ }
+}
+
+// Runs sim on the interpreter and records every step to file. Returns
+// false when an instruction does not decode; the trace ends before it.
+bool trace_run(Sim *sim, FILE *file, bool output_stats)
+{
+ TraceWriter trace = {.file = file, .buffer = malloc(TRACE_BUFFER_SIZE)};
+ U32 code_size = (U32)sim->code_size;
+ trace_write(&trace, TRACE_MAGIC, 8);
+ trace_write(&trace, &code_size, 4);
+ trace_write(&trace, sim->memory, code_size);
+
+ bool result = true;
+ U64 steps = 0;
+ U64 start = now_ns();
+ while(sim->ip < sim->code_size && sim->instructions < sim->limit)
+ {
+  if(steps % TRACE_KEYFRAME_INTERVAL == 0)
+  {
+   trace_keyframe(&trace, sim);
+  }
+
+  U16 ip = sim->ip;
+  U64 stores = sim->stores;
+  if(!sim_step(sim))
+  {
+   result = false;
+   break;
+  }
+  steps++;
+
+  U8 *out = trace_reserve(&trace, TRACE_MAX_RECORD);
+  U8 *header = out++;
+  U8 mask = trace_changed_registers(sim->registers, trace.registers);
+  U8 bits = 0;
+  if(mask & (mask - 1))
+  {
+   bits = TRACE_REGISTER_MASK;
+   *out++ = mask;
+  }
+  else if(mask)
+  {
+   bits = (U8)(__builtin_ctz(mask) + 1);
+  }
+  for(U8 left = mask; left; left &= (U8)(left - 1))
+  {
+   int i = __builtin_ctz(left);
+   out = trace_put_varint(out, trace_zigzag((S16)(sim->registers[i] - trace.registers[i])));
+   trace.registers[i] = sim->registers[i];
+  }
+
+  if(trace_flags_hidden(&sim->cache[ip]))
+  {
+   bits |= TRACE_FLAGS;
+   *out++ = trace_pack_flags(trace_current_flags(sim));
+  }
+
+  if(sim->stores != stores)
+  {
+   bits |= TRACE_STORE;
+   U16 address = sim->store_address;
+   out = trace_put_varint(out, (U64)trace_zigzag((S16)(address - trace.store_address)) << 1 | sim->store_w);
+   *out++ = sim->memory[address];
+   if(sim->store_w)
+   {
+    *out++ = sim->memory[(U16)(address + 1)];
+   }
+   trace.store_address = address;
+  }
+
+  U16 next = (U16)(ip + sim->cache[ip].length);
+  if(sim->ip != next)
+  {
+   bits |= TRACE_JUMP;
+   out = trace_put_varint(out, trace_zigzag((S16)(sim->ip - next)));
+  }
+
+  *header = bits;
+  trace_commit(&trace, out);
+ }
+
+ // End record, then the keyframe index and where it starts.
+ U64 index = trace.flushed + trace.used;
+ U8 end[16];
+ end[0] = TRACE_END;
+ trace_write(&trace, end, (USIZE)(trace_put_varint(end + 1, sim->instructions) - end));
+ U64 count = trace.keyframe_count;
+ trace_write(&trace, &count, 8);
+ trace_write(&trace, &trace.first_step, 8);
+ for(USIZE i = 0; i < trace.keyframe_count; i++)
+ {
+  trace_write(&trace, &trace.keyframes[i], 8);
+ }
+ trace_write(&trace, &index, 8);
+ trace_write(&trace, TRACE_INDEX_MAGIC, 8);
+ trace_flush(&trace);
+ U64 trace_ns = now_ns() - start;
+
+ if(output_stats)
+ {
+  double seconds = (double)trace_ns / 1e9;
+  fprintf(stderr, "trace: %llu steps, %llu bytes, %.2f bytes/step, %zu keyframes, %.3f s, %.1f M steps/s\n",
+          (unsigned long long)steps, (unsigned long long)trace.flushed, steps ? (double)trace.flushed / (double)steps : 0.0,
+          trace.keyframe_count, seconds, seconds > 0 ? (double)steps / 1e6 / seconds : 0.0);
+ }
+
+ free(trace.keyframes);
+ free(trace.buffer);
+ return result;
+}
+
+typedef struct
+{
+ U8 *bytes;
+ USIZE size;
+ USIZE pos;
+ bool failed; // Read past the end
+} TraceReader;
+
+U8 trace_read_u8(TraceReader *reader)
+{
+ if(reader->pos >= reader->size)
+ {
+  reader->failed = true;
+  return 0;
+ }
+ return reader->bytes[reader->pos++];
+}
+
+U16 trace_read_u16(TraceReader *reader)
+{
+ U16 low = trace_read_u8(reader);
+ return (U16)(low | trace_read_u8(reader) << 8);
+}
+
+U64 trace_read_u64_at(TraceReader *reader, USIZE pos)
+{
+ U64 value = 0;
+ if(pos + 8 <= reader->size)
+ {
+  memcpy(&value, reader->bytes + pos, 8);
+ }
+ return value;
+}
+
+U64 trace_read_varint(TraceReader *reader)
+{
+ U64 value = 0;
+ for(int shift = 0; shift < 64; shift += 7)
+ {
+  U8 byte = trace_read_u8(reader);
+  value |= (U64)(byte & 0x7F) << shift;
+  if(!(byte & 0x80))
+  {
+   break;
+  }
+ }
+ return value;
+}
+
+char *trace_emit_hex(char *out, U16 value)
+{
+ *out++ = '0';
+ *out++ = 'x';
+ for(int shift = 12; shift >= 0; shift -= 4)
+ {
+  *out++ = "0123456789abcdef"[value >> shift & 0xF];
+ }
+ return out;
+}
+
+char *trace_emit_decimal(char *out, U64 value)
+{
+ char digits[20];
+ int count = 0;
+ do
+ {
+  digits[count++] = (char)('0' + value % 10);
+  value /= 10;
+ } while(value);
+ while(count)
+ {
+  *out++ = digits[--count];
+ }
+ return out;
+}
+
+// Like sim_get_register(), r is ax, cx, dx, bx, sp, bp, si, di.
+U16 trace_get_register(U16 *r, U8 reg, bool w)
+{
+ if(w)
+ {
+  return r[reg];
+ }
+ return reg < 4 ? r[reg] & 0xFF : r[reg - 4] >> 8;
+}
+
+// Computes the flags add, sub and cmp leave from the registers before and
+// after inst and the value it stored; the one operand that lives in memory
+// follows from the other and the result. Returns false for instructions
+// that leave the flags alone.
+bool trace_derive_flags(Instruction *inst, U16 *before, U16 *after, U16 stored, U16 *flags)
+{
+ U8 op = inst->mnemonic == MNEMONIC_ADD ? SIM_OP_ADD : SIM_OP_SUB;
+ if((inst->mnemonic != MNEMONIC_ADD && inst->mnemonic != MNEMONIC_SUB && inst->mnemonic != MNEMONIC_CMP) ||
+    (inst->form != FORM_REG_MEM && inst->form != FORM_IMMEDIATE_REG_MEM && inst->form != FORM_IMMEDIATE_ACCUMULATOR))
+ {
+  return false;
+ }
+
+ bool w = inst->w;
+ bool memory = inst->form != FORM_IMMEDIATE_ACCUMULATOR && inst->mod != 0x03;
+ bool a_known = true;
+ bool b_known = true;
+ U16 a = 0;
+ U16 b = 0;
+ U16 result = 0;
+ switch(inst->form)
+ {
+  case FORM_REG_MEM:
+  {
+   U8 destination = inst->d ? inst->reg : inst->rm;
+   U8 source = inst->d ? inst->rm : inst->reg;
+   if(!memory)
+   {
+    a = trace_get_register(before, destination, w);
+    b = trace_get_register(before, source, w);
+   }
+   else if(inst->d)
+   {
+    a = trace_get_register(before, inst->reg, w);
+    result = trace_get_register(after, inst->reg, w);
+    b_known = false;
+   }
+   else
+   {
+    b = trace_get_register(before, inst->reg, w);
+    result = stored;
+    a_known = false;
+   }
+   break;
+  }
+
+  case FORM_IMMEDIATE_REG_MEM:
+  {
+   b = inst->s && w ? (U16)(S8)inst->data : inst->data;
+   if(memory)
+   {
+    result = stored;
+    a_known = false;
+   }
+   else
+   {
+    a = trace_get_register(before, inst->rm, w);
+   }
+   break;
+  }
+
+  case FORM_IMMEDIATE_ACCUMULATOR:
+  {
+   a = trace_get_register(before, 0, w);
+   b = inst->data;
+   break;
+  }
+ }
+
+ if(!a_known)
+ {
+  a = op == SIM_OP_ADD ? (U16)(result - b) : (U16)(result + b);
+ }
+ else if(!b_known)
+ {
+  b = op == SIM_OP_ADD ? (U16)(result - a) : (U16)(a - result);
+ }
+ else
+ {
+  result = op == SIM_OP_ADD ? (U16)(a + b) : (U16)(a - b);
+ }
+
+ U16 mask = w ? 0xFFFF : 0xFF;
+ LazyFlags last = {op, w, a & mask, b & mask, result & mask};
+ *flags = sim_compute_flags(&last);
+ return true;
+}
+
+// Finds the keyframe to start from for the step from, by the index at the
+// end of the trace. Returns the offset of the first record when there is
+// no index or no keyframe before from.
+USIZE trace_seek(TraceReader *reader, USIZE records, U64 from)
+{
+ USIZE size = reader->size;
+ if(size < records + 16 || memcmp(reader->bytes + size - 8, TRACE_INDEX_MAGIC, 8) != 0)
+ {
+  return records;
+ }
+ U64 index = trace_read_u64_at(reader, size - 16);
+ TraceReader end = {reader->bytes, size - 16, (USIZE)index, false};
+ if(index < records || trace_read_u8(&end) != TRACE_END)
+ {
+  return records;
+ }
+ trace_read_varint(&end);
+ U64 count = trace_read_u64_at(reader, end.pos);
+ U64 first_step = trace_read_u64_at(reader, end.pos + 8);
+ if(!count || from < first_step || count > (size - end.pos) / 8)
+ {
+  return records;
+ }
+ U64 keyframe = (from - first_step) / TRACE_KEYFRAME_INTERVAL;
+ keyframe = keyframe < count ? keyframe : count - 1;
+ U64 offset = trace_read_u64_at(reader, end.pos + 16 + keyframe * 8);
+ return offset >= records && offset < index ? (USIZE)offset : records;
+}
+
+// Prints the trace in bytes, the steps from on.
+int run_read_trace(U8 *bytes, USIZE size, U64 from, bool output_stats)
+{
+ TraceReader reader = {bytes, size, 0, false};
+ if(size < 12 || memcmp(bytes, TRACE_MAGIC, 8) != 0)
+ {
+  fprintf(stderr, "Error: Not a trace file\n");
+  return 1;
+ }
+ U32 code_size = 0;
+ memcpy(&code_size, bytes + 8, 4);
+ if(code_size > SIM_MEMORY_SIZE || size - 12 < code_size)
+ {
+  fprintf(stderr, "Error: Trace truncated in the code\n");
+  return 1;
+ }
+
+ Output out;
+ if(!output_open(&out, STDOUT_FILENO))
+ {
+  return 1;
+ }
+
+ // The reader's view of memory: the code and the stores.
+ U8 *memory = calloc(1, SIM_MEMORY_SIZE + INPUT_TAIL_PADDING);
+ memcpy(memory, bytes + 12, code_size);
+ U8 *original = bytes + 12;
+
+ U16 registers[8] = {0};
+ U16 ip = 0;
+ U8 flags = 0;
+ U16 store_address = 0;
+ U64 step = 0;
+ U64 printed = 0;
+ U64 keyframes = 0;
+ bool ended = false;
+ Instruction inst = {0};
+
+ U64 start = now_ns();
+ reader.pos = trace_seek(&reader, 12 + code_size, from);
+ while(!reader.failed && reader.pos < reader.size)
+ {
+  U8 header = trace_read_u8(&reader);
+  if(header == TRACE_KEYFRAME)
+  {
+   keyframes++;
+   step = trace_read_varint(&reader);
+   ip = trace_read_u16(&reader);
+   for(int i = 0; i < 8; i++)
+   {
+    registers[i] = trace_read_u16(&reader);
+   }
+   flags = trace_read_u8(&reader);
+   store_address = 0;
+
+   // Code pages not listed hold the code as loaded.
+   USIZE pages = (code_size + MAX_INSTRUCTION_LENGTH + SIM_PAGE_SIZE - 1) / SIM_PAGE_SIZE;
+   pages = pages < SIM_PAGE_COUNT ? pages : SIM_PAGE_COUNT;
+   memset(memory, 0, pages * SIM_PAGE_SIZE);
+   memcpy(memory, original, code_size);
+   U64 count = trace_read_varint(&reader);
+   for(U64 i = 0; i < count && !reader.failed; i++)
+   {
+    U8 page = trace_read_u8(&reader);
+    if(reader.pos + SIM_PAGE_SIZE > reader.size)
+    {
+     reader.failed = true;
+     break;
+    }
+    memcpy(memory + page * SIM_PAGE_SIZE, reader.bytes + reader.pos, SIM_PAGE_SIZE);
+    reader.pos += SIM_PAGE_SIZE;
+   }
+   memory[SIM_MEMORY_SIZE] = memory[0];
+   continue;
+  }
+  if(header == TRACE_END)
+  {
+   ended = true;
+   break;
+  }
+  if(header & 0x80)
+  {
+   reader.failed = true;
+   break;
+  }
+
+  decode_instruction(memory, ip, &inst);
+  inst.offset = ip;
+
+  U16 before[8];
+  memcpy(before, registers, sizeof(before));
+  U8 mask = header & 0x0F;
+  if(mask == TRACE_REGISTER_MASK)
+  {
+   mask = trace_read_u8(&reader);
+  }
+  else
+  {
+   mask = mask ? (U8)(1 << (mask - 1)) : 0;
+  }
+  for(U8 left = mask; left; left &= (U8)(left - 1))
+  {
+   int i = __builtin_ctz(left);
+   registers[i] = (U16)(registers[i] + trace_unzigzag((U32)trace_read_varint(&reader)));
+  }
+
+  U8 new_flags = flags;
+  if(header & TRACE_FLAGS)
+  {
+   new_flags = trace_read_u8(&reader);
+  }
+
+  bool w = false;
+  U16 stored = 0;
+  if(header & TRACE_STORE)
+  {
+   U64 value = trace_read_varint(&reader);
+   w = value & 1;
+   store_address = (U16)(store_address + trace_unzigzag((U32)(value >> 1)));
+   stored = trace_read_u8(&reader);
+   memory[store_address] = (U8)stored;
+   if(w)
+   {
+    U8 high = trace_read_u8(&reader);
+    memory[(U16)(store_address + 1)] = high;
+    stored |= (U16)(high << 8);
+   }
+   memory[SIM_MEMORY_SIZE] = memory[0];
+  }
+
+  U16 derived = 0;
+  if(!(header & TRACE_FLAGS) && trace_derive_flags(&inst, before, registers, stored, &derived))
+  {
+   new_flags = trace_pack_flags(derived);
+  }
+
+  U16 next = (U16)(ip + inst.length);
+  if(header & TRACE_JUMP)
+  {
+   next = (U16)(next + trace_unzigzag((U32)trace_read_varint(&reader)));
+  }
+
+  if(step >= from)
+  {
+   char *line = output_reserve(&out, MAX_LINE_LENGTH + 160);
+   char *text = trace_emit_decimal(line, step);
+   *text++ = ' ';
+   text = trace_emit_hex(text, ip);
+   *text++ = ':';
+   *text++ = ' ';
+   text += format_instruction(&inst, text) - 1; // Without the newline
+   char *changes = text;
+   *text++ = ' ';
+   *text++ = ';';
+
+   for(U8 left = mask; left; left &= (U8)(left - 1))
+   {
+    int i = __builtin_ctz(left);
+    *text++ = ' ';
+    memcpy(text, sim_register_names[i], 2);
+    text[2] = '=';
+    text = trace_emit_hex(text + 3, registers[i]);
+   }
+   if(new_flags != flags)
+   {
+    char letters[8];
+    USIZE length = sim_flag_letters(trace_unpack_flags(new_flags), letters);
+    memcpy(text, " flags=", 7);
+    text += 7;
+    memcpy(text, length ? letters : "-", length ? length : 1);
+    text += length ? length : 1;
+   }
+   if(header & TRACE_STORE)
+   {
+    *text++ = ' ';
+    *text++ = '[';
+    text = trace_emit_hex(text, store_address);
+    *text++ = ']';
+    *text++ = '=';
+    text = trace_emit_hex(text, stored);
+    if(!w)
+    {
+     // A byte: 0x00XX to 0xXX.
+     memmove(text - 4, text - 2, 2);
+     text -= 2;
+    }
+   }
+
+   // Drop the " ;" of a step that changed nothing.
+   text = text == changes + 2 ? changes : text;
+   *text++ = '\n';
+   output_commit(&out, (USIZE)(text - line));
+   printed++;
+  }
+  flags = new_flags;
+  ip = next;
+  step++;
+ }
+ U64 read_ns = now_ns() - start;
+ output_close(&out, output_stats);
+
+ if(output_stats)
+ {
+  double seconds = (double)read_ns / 1e9;
+  fprintf(stderr, "read-trace: %llu steps printed, %llu keyframes read, %.3f s, %.1f M steps/s\n",
+          (unsigned long long)printed, (unsigned long long)keyframes, seconds,
+          seconds > 0 ? (double)printed / 1e6 / seconds : 0.0);
+ }
+
+ free(memory);
+ if(!ended)
+ {
+  fprintf(stderr, "Error: Trace %s at offset %zu\n", reader.failed ? "corrupt or truncated" : "has no end record",
+          reader.pos);
+  return 1;
+ }
+ return 0;
+}
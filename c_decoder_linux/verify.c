@@ -0,0 +1,313 @@
+// Round-trip verifier: every instruction is decoded, re-encoded with
+// encode_instruction() and compared against the bytes it came from.
+// Included at the bottom of main.c.
+//
+//   --verify                 checks the input file
+//   --verify-random <size>   checks size generated random bytes, no file
+//                            needed. Takes K, M and G suffixes.
+//   --seed <n>               seed for --verify-random, 0 if not given
+//
+// Like --stats, an undecodable byte is skipped and decoding resumes at the
+// next one, so random bytes exercise every decode path. Work is split
+// across all cores: ranges of the file, or VERIFY_CHUNK sized chunks of the
+// generated stream. Chunk c is generated from the seed and c alone, so a
+// reported offset can be reproduced with the same seed.
+//
+// File ranges are stitched at a shared instruction boundary like the
+// ranges of --stats: every range but the first logs the instructions of its
+// first STATS_SYNC_WINDOW bytes, and the merge checks those from the
+// boundary the previous range ended on. The counts and offsets are those of
+// one pass from the start of the file, whatever the core count.
+//
+// Prints the first mismatches by offset, then a summary, and fails when
+// there were any.
+//
+// Example: mismatch at 1644: bytes 82 85 2f 87, encoded 82 85 2f 00 87 (add [di + 47], 135)
+
+#include <pthread.h>
+
+#define VERIFY_MAX_THREADS 64
+#define VERIFY_MIN_RANGE (1024 * 1024) // Smallest file range worth a thread
+#define VERIFY_CHUNK (1024 * 1024)
+#define VERIFY_MAX_REPORTED 16
+
+typedef struct
+{
+ Instruction inst; // Offset within the whole input
+ U8 bytes[MAX_INSTRUCTION_LENGTH];
+ U8 encoded[MAX_INSTRUCTION_LENGTH];
+ U8 encoded_length;
+} VerifyMismatch;
+
+typedef struct
+{
+ U8 *bytes; // 0 when generating
+ USIZE size;
+ USIZE begin;
+ USIZE end;
+ USIZE next; // First instruction boundary at or after end
+
+ // Instructions in [begin, begin + STATS_SYNC_WINDOW) of a file range, not
+ // yet checked.
+ Instruction *window;
+ USIZE window_count;
+
+ // Generated chunks index, index + thread_count, ...
+ USIZE index;
+ USIZE thread_count;
+ U64 seed;
+
+ USIZE instructions;
+ USIZE invalid;
+ USIZE mismatch_count;
+ VerifyMismatch mismatches[VERIFY_MAX_REPORTED];
+} VerifyRange;
+
+// Example: 4G, 512M, 1048576
+// Returns 0 for anything else, such as "4X", "G", "-1" or a size past
+// SIZE_MAX.
+USIZE parse_size(char *text)
+{
+ char *end;
+ errno = 0;
+ USIZE size = strtoull(text, &end, 0);
+ unsigned shift = 0;
+ if(end == text || errno == ERANGE || *text == '-')
+ {
+  return 0;
+ }
+ switch(*end)
+ {
+  case 'G': case 'g': shift += 10; // fallthrough
+  case 'M': case 'm': shift += 10; // fallthrough
+  case 'K': case 'k': shift += 10; end++;
+ }
+ if(*end || size > SIZE_MAX >> shift)
+ {
+  return 0;
+ }
+ return size << shift;
+}
+
+U64 splitmix64(U64 *state)
+{
+ U64 z = (*state += 0x9E3779B97F4A7C15ull);
+ z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+ z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+ return z ^ (z >> 31);
+}
+
+void verify_generate(U8 *bytes, USIZE size, U64 seed, USIZE chunk)
+{
+ U64 state = seed ^ ((U64)chunk * 0xD1B54A32D192ED03ull);
+ for(USIZE i = 0; i < size; i += sizeof(U64))
+ {
+  U64 value = splitmix64(&state);
+  memcpy(bytes + i, &value, sizeof(U64));
+ }
+}
+
+// Counts the instruction stats_step() gave for bytes, and records it when
+// it does not encode back to its bytes. base is the offset of bytes[0] in
+// the whole input.
+void verify_instruction(VerifyRange *range, U8 *bytes, Instruction *inst, USIZE base)
+{
+ if(inst->form == FORM_UNKNOWN_OPCODE)
+ {
+  range->invalid++;
+  return;
+ }
+
+ range->instructions++;
+ U8 encoded[MAX_INSTRUCTION_LENGTH];
+ USIZE length = encode_instruction(inst, encoded);
+ if(length == inst->length && memcmp(encoded, bytes + inst->offset, length) == 0)
+ {
+  return;
+ }
+
+ if(range->mismatch_count < VERIFY_MAX_REPORTED)
+ {
+  VerifyMismatch *mismatch = &range->mismatches[range->mismatch_count];
+  mismatch->inst = *inst;
+  mismatch->inst.offset += base;
+  memcpy(mismatch->bytes, bytes + inst->offset, inst->length);
+  memcpy(mismatch->encoded, encoded, length);
+  mismatch->encoded_length = (U8)length;
+ }
+ range->mismatch_count++;
+}
+
+// Checks the instructions starting in [begin, end) of bytes. Returns the
+// first instruction boundary at or after end.
+USIZE verify_block(VerifyRange *range, U8 *bytes, USIZE size, USIZE begin, USIZE end, USIZE base)
+{
+ Instruction inst;
+ USIZE pos = begin;
+ while(pos < end)
+ {
+  pos = stats_step(bytes, size, pos, &inst);
+  verify_instruction(range, bytes, &inst, base);
+ }
+ return pos;
+}
+
+void *verify_range(void *arg)
+{
+ VerifyRange *range = arg;
+ if(range->bytes)
+ {
+  USIZE pos = range->begin;
+  if(range->window)
+  {
+   USIZE window_end = range->begin + STATS_SYNC_WINDOW;
+   while(pos < range->end && pos < window_end)
+   {
+    pos = stats_step(range->bytes, range->size, pos, &range->window[range->window_count++]);
+   }
+  }
+  range->next = verify_block(range, range->bytes, range->size, pos, range->end, 0);
+  return 0;
+ }
+
+ U8 *chunk = malloc(VERIFY_CHUNK + INPUT_TAIL_PADDING);
+ for(USIZE c = range->index; c * VERIFY_CHUNK < range->size; c += range->thread_count)
+ {
+  USIZE chunk_size = range->size - c * VERIFY_CHUNK < VERIFY_CHUNK ? range->size - c * VERIFY_CHUNK : VERIFY_CHUNK;
+  verify_generate(chunk, VERIFY_CHUNK, range->seed, c);
+  memset(chunk + chunk_size, 0, VERIFY_CHUNK + INPUT_TAIL_PADDING - chunk_size);
+  verify_block(range, chunk, chunk_size, 0, chunk_size, c * VERIFY_CHUNK);
+ }
+ free(chunk);
+ return 0;
+}
+
+int verify_compare_mismatches(const void *a, const void *b)
+{
+ USIZE x = ((const VerifyMismatch *)a)->inst.offset;
+ USIZE y = ((const VerifyMismatch *)b)->inst.offset;
+ return (x > y) - (x < y);
+}
+
+void verify_print_bytes(char *label, U8 *bytes, USIZE length)
+{
+ printf("%s", label);
+ for(USIZE i = 0; i < length; i++)
+ {
+  printf(" %02x", bytes[i]);
+ }
+}
+
+// bytes 0 generates size bytes from seed instead.
+int run_verify(U8 *bytes, USIZE size, U64 seed, bool output_stats)
+{
+ long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+ USIZE thread_count = cpus > 0 ? (USIZE)cpus : 1;
+ if(thread_count > VERIFY_MAX_THREADS)
+ {
+  thread_count = VERIFY_MAX_THREADS;
+ }
+ if(thread_count > size / VERIFY_MIN_RANGE)
+ {
+  thread_count = size / VERIFY_MIN_RANGE ? size / VERIFY_MIN_RANGE : 1;
+ }
+
+ VerifyRange *ranges = calloc(thread_count, sizeof(VerifyRange));
+ pthread_t threads[VERIFY_MAX_THREADS];
+
+ U64 start = now_ns();
+ for(USIZE i = 0; i < thread_count; i++)
+ {
+  VerifyRange *range = &ranges[i];
+  range->bytes = bytes;
+  range->size = size;
+  range->begin = size * i / thread_count;
+  range->end = size * (i + 1) / thread_count;
+  range->index = i;
+  range->thread_count = thread_count;
+  range->seed = seed;
+  if(bytes && i)
+  {
+   range->window = malloc(STATS_SYNC_WINDOW * sizeof(Instruction));
+  }
+  pthread_create(&threads[i], 0, verify_range, range);
+ }
+ for(USIZE i = 0; i < thread_count; i++)
+ {
+  pthread_join(threads[i], 0);
+ }
+
+ // Stitch the file ranges together, as run_stats() does. The logged
+ // instructions from the shared boundary on, and the ranges decoded again,
+ // are checked into stitched, in offset order like a range of its own.
+ VerifyRange stitched = {0};
+ USIZE resyncs = 0;
+ USIZE pos = ranges[0].next;
+ for(USIZE i = 1; bytes && i < thread_count; i++)
+ {
+  VerifyRange *range = &ranges[i];
+  long sync = stats_find_sync(range->window, range->window_count, pos);
+  if(sync >= 0)
+  {
+   for(USIZE j = (USIZE)sync; j < range->window_count; j++)
+   {
+    verify_instruction(&stitched, bytes, &range->window[j], 0);
+   }
+   pos = range->next;
+  }
+  else
+  {
+   // No shared boundary in the window, check the range again from pos.
+   resyncs++;
+   range->instructions = 0;
+   range->invalid = 0;
+   range->mismatch_count = 0;
+   pos = verify_block(&stitched, bytes, size, pos, range->end, 0);
+  }
+  free(range->window);
+ }
+
+ USIZE instructions = 0;
+ USIZE invalid = 0;
+ USIZE mismatch_count = 0;
+ VerifyMismatch mismatches[(VERIFY_MAX_THREADS + 1) * VERIFY_MAX_REPORTED];
+ USIZE reported = 0;
+ for(USIZE i = 0; i <= thread_count; i++)
+ {
+  VerifyRange *range = i < thread_count ? &ranges[i] : &stitched;
+  instructions += range->instructions;
+  invalid += range->invalid;
+  mismatch_count += range->mismatch_count;
+  USIZE count = range->mismatch_count < VERIFY_MAX_REPORTED ? range->mismatch_count : VERIFY_MAX_REPORTED;
+  memcpy(&mismatches[reported], range->mismatches, count * sizeof(VerifyMismatch));
+  reported += count;
+ }
+ U64 verify_ns = now_ns() - start;
+
+ qsort(mismatches, reported, sizeof(VerifyMismatch), verify_compare_mismatches);
+ if(reported > VERIFY_MAX_REPORTED)
+ {
+  reported = VERIFY_MAX_REPORTED;
+ }
+ for(USIZE i = 0; i < reported; i++)
+ {
+  char line[MAX_LINE_LENGTH];
+  USIZE length = format_instruction(&mismatches[i].inst, line);
+  printf("mismatch at %zu:", mismatches[i].inst.offset);
+  verify_print_bytes(" bytes", mismatches[i].bytes, mismatches[i].inst.length);
+  verify_print_bytes(", encoded", mismatches[i].encoded, mismatches[i].encoded_length);
+  printf(" (%.*s)\n", (int)length - 1, line);
+ }
+ printf("verify: %zu bytes, %zu instructions, %zu invalid bytes, %zu mismatches\n",
+        size, instructions, invalid, mismatch_count);
+
+ if(output_stats)
+ {
+  double seconds = (double)verify_ns / 1e9;
+  fprintf(stderr, "verify: %zu threads, %zu resyncs, %.3f s, %.1f MB/s\n",
+          thread_count, resyncs, seconds, seconds > 0 ? (double)size / 1e6 / seconds : 0.0);
+ }
+
+ free(ranges);
+ return mismatch_count ? 1 : 0;
+}
@@ -1,6 +1,7 @@
 package main
 
 import "core:fmt"
+import "core:strings"
 
 bit_is_set :: proc(byte: u8, mask: u8) -> bool {
     if (byte & mask) > 0 {
@@ -10,28 +11,24 @@ bit_is_set :: proc(byte: u8, mask: u8) -> bool {
     }
 }
 
-parse_dest_src_displacement :: proc(reg_holds_destination: bool, reg_register: string, rm_register: string, value: u16 = 0) -> string {
-    dest, src: string
+// Appends the operands straight to out instead of building a new string.
+write_dest_src_displacement :: proc(out: ^strings.Builder, reg_holds_destination: bool, reg_register: string, rm_register: string, value: u16 = 0) {
     if reg_holds_destination {
-        dest = reg_register
         if (value > 0) {
-            src = fmt.aprintf("[%s + %d]", rm_register, value)
+            fmt.sbprintf(out, "%s, [%s + %d]", reg_register, rm_register, value)
         } else {
-            src = fmt.aprintf("[%s]", rm_register)
+            fmt.sbprintf(out, "%s, [%s]", reg_register, rm_register)
         }
     } else {
-        src = reg_register
         if (value > 0) {
-            dest = fmt.aprintf("[%s + %d]", rm_register, value)
+            fmt.sbprintf(out, "[%s + %d], %s", rm_register, value, reg_register)
         } else {
-            dest = fmt.aprintf("[%s]", rm_register)
+            fmt.sbprintf(out, "[%s], %s", rm_register, reg_register)
         }
     }
-
-    return fmt.aprintf("%s, %s", dest, src)
 }
 
-common_disp :: proc(name: string, bytes: []u8, pos: int) -> int {
+common_disp :: proc(name: string, bytes: []u8, pos: int, out: ^strings.Builder) -> int {
     bytes_read := 0
     i := pos
 
@@ -62,7 +59,7 @@ common_disp :: proc(name: string, bytes: []u8, pos: int) -> int {
 
         direct_address: u16 = u16(low_data) | (u16(high_data) << 8)
 
-        fmt.printf("%s %s, [%d]\n", name, reg_register, direct_address)
+        fmt.sbprintf(out, "%s %s, [%d]\n", name, reg_register, direct_address)
         bytes_read += 1
         return bytes_read
 
@@ -72,8 +69,9 @@ common_disp :: proc(name: string, bytes: []u8, pos: int) -> int {
         reg_register := word_registers[reg_field] if is_word_operation else byte_registers[reg_field]
         rm_register := eac_table[rm_field]
 
-        operands := parse_dest_src_displacement(reg_holds_destination, reg_register, rm_register)
-        fmt.printf("%s %s\n", name, operands)
+        fmt.sbprintf(out, "%s ", name)
+        write_dest_src_displacement(out, reg_holds_destination, reg_register, rm_register)
+        strings.write_byte(out, '\n')
         bytes_read += 1
         return bytes_read
     }
@@ -87,12 +85,13 @@ common_disp :: proc(name: string, bytes: []u8, pos: int) -> int {
         bytes_read += 1
         byte_value := bytes[i]
 
-        operands := parse_dest_src_displacement(reg_holds_destination, reg_register, rm_register, u16(byte_value))
-        fmt.printf("%s %s\n", name, operands)
+        fmt.sbprintf(out, "%s ", name)
+        write_dest_src_displacement(out, reg_holds_destination, reg_register, rm_register, u16(byte_value))
+        strings.write_byte(out, '\n')
         bytes_read += 1
         return bytes_read
     }
-    
+
     if mod_field == 0b10 {
         reg_register := word_registers[reg_field] if is_word_operation else byte_registers[reg_field]
         rm_register := eac_table[rm_field]
@@ -107,9 +106,10 @@ common_disp :: proc(name: string, bytes: []u8, pos: int) -> int {
         high_data := bytes[i]
 
         word_value: u16 = u16(low_data) | (u16(high_data) << 8)
-    
-        operands := parse_dest_src_displacement(reg_holds_destination, reg_register, rm_register, word_value)
-        fmt.printf("%s %s\n", name, operands)
+
+        fmt.sbprintf(out, "%s ", name)
+        write_dest_src_displacement(out, reg_holds_destination, reg_register, rm_register, word_value)
+        strings.write_byte(out, '\n')
         bytes_read += 1
         return bytes_read
     }
@@ -127,7 +127,7 @@ common_disp :: proc(name: string, bytes: []u8, pos: int) -> int {
             src = reg_register
         }
 
-        fmt.printf("%s %s, %s\n", name, dest, src)
+        fmt.sbprintf(out, "%s %s, %s\n", name, dest, src)
         bytes_read += 1
         return bytes_read
     }
@@ -135,8 +135,149 @@ common_disp :: proc(name: string, bytes: []u8, pos: int) -> int {
     return bytes_read
 }
 
+mov_immediate_to_reg :: proc(name: string, bytes: []u8, pos: int, out: ^strings.Builder) -> int {
+    i := pos
+
+    is_word_operation := bit_is_set(bytes[i], 0b0000_1000)
+    reg_field: u8 = (bytes[i] & 0b0000_0111)
+    if is_word_operation {
+        // next bytes
+        i += 1
+        low_data := bytes[i]
+
+        i += 1
+        high_data := bytes[i]
+
+        word_value: u16 = u16(low_data) | (u16(high_data) << 8)
+        fmt.sbprintf(out, "%s %s, %d\n", name, word_registers[reg_field], word_value)
+    } else {
+        i += 1
+        byte_value := bytes[i]
+        fmt.sbprintf(out, "%s %s, %d\n", name, byte_registers[reg_field], byte_value)
+    }
+
+    i += 1
+    return i - pos
+}
+
+// Forms not handled here consume only the opcode, so decoding resumes at the
+// [MOD REG R/M] byte.
+common_immediate :: proc(_: string, bytes: []u8, pos: int, out: ^strings.Builder) -> int {
+    i := pos
+
+    has_sign_extension := bit_is_set(bytes[i], 0b0000_0010)
+    is_word_operation := bit_is_set(bytes[i], 0b0000_0001)
+
+    // [MOD REG R/M] byte
+    i += 1
+
+    mod_field: u8 = (bytes[i] >> 6)
+    reg_field: u8 = (bytes[i] & 0b0011_1000) >> 3
+    rm_field: u8 = (bytes[i] & 0b0000_0111)
+
+    name: string
+    switch reg_field {
+        case 0b000:
+            name = "add"
+        case 0b101:
+            name = "sub"
+        case 0b111:
+            name = "cmp"
+    }
+
+    if (mod_field == 0b00 && rm_field == 0b110) {
+
+        // Next bytes
+        i += 1
+        low_data := bytes[i]
+
+        i += 1
+        high_data := bytes[i]
+
+        direct_address: u16 = u16(low_data) | (u16(high_data) << 8)
+
+        i += 1
+        data := bytes[i]
+
+        fmt.sbprintf(out, "%s [%d], %d\n", name, direct_address, data)
+
+        i += 1
+        return i - pos
+    }
+
+    if (mod_field == 0b00) {
+        rm_register := eac_table[rm_field]
+
+        i += 1
+        data := bytes[i]
+
+        fmt.sbprintf(out, "%s [%s], %d\n", name, rm_register, data)
+
+        i += 1
+        return i - pos
+    }
+
+    if (mod_field == 0b10) {
+        rm_register := eac_table[rm_field]
+
+        disp_value: u16
+        if (is_word_operation) {
+            i += 1
+            disp_low := bytes[i]
+
+            i += 1
+            disp_high := bytes[i]
+
+            disp_value = u16(disp_low) | (u16(disp_high) << 8)
+
+        } else {
+            i += 1
+            disp_value := bytes[i]
+        }
+
+        i += 1
+        data := bytes[i]
+
+        fmt.sbprintf(out, "%s [%s + %d], %d\n", name, rm_register, disp_value, data)
+
+        i += 1
+        return i - pos
+
+    }
+
+    if (mod_field == 0b11) {
+        rm_register := word_registers[rm_field] if is_word_operation else byte_registers[rm_field]
+
+        if (!has_sign_extension && is_word_operation) {
+            i += 1
+            data_one := bytes[i]
 
-parse_arithmetic_immediate_to_accumulator :: proc(name: string, bytes: []u8, pos: int) -> int {
+            i += 1
+            data_two := bytes[i]
+
+            value: u16 = u16(data_one) | (u16(data_two) << 8)
+
+            fmt.sbprintf(out, "%s %s, %d\n", name, rm_register, value)
+
+            i += 1
+            return i - pos
+        }
+
+        if (has_sign_extension) {
+            i += 1
+            value := bytes[i]
+
+            fmt.sbprintf(out, "%s %s, %d\n", name, rm_register, value)
+
+            i += 1
+            return i - pos
+        }
+    }
+
+    return 1
+}
+
+parse_arithmetic_immediate_to_accumulator :: proc(name: string, bytes: []u8, pos: int, out: ^strings.Builder) -> int {
     bytes_read := 0
     i := pos
 
@@ -155,7 +296,7 @@ parse_arithmetic_immediate_to_accumulator :: proc(name: string, bytes: []u8, pos
 
         value: u16 = u16(data_one) | (u16(data_two) << 8)
 
-        fmt.printf("%s ax, %d\n", name, value)
+        fmt.sbprintf(out, "%s ax, %d\n", name, value)
 
         i += 1
         bytes_read += 1
@@ -165,7 +306,7 @@ parse_arithmetic_immediate_to_accumulator :: proc(name: string, bytes: []u8, pos
         value := bytes[i]
         bytes_read += 1
 
-        fmt.printf("%s al, %d\n", name, value)
+        fmt.sbprintf(out, "%s al, %d\n", name, value)
 
         i += 1
         bytes_read += 1
@@ -174,14 +315,8 @@ parse_arithmetic_immediate_to_accumulator :: proc(name: string, bytes: []u8, pos
     return bytes_read
 }
 
-
-
-
-
-
-
-
-
-
-
-
+short_jump :: proc(name: string, bytes: []u8, pos: int, out: ^strings.Builder) -> int {
+    value := i8(bytes[pos + 1])
+    fmt.sbprintf(out, "%s %d\n", name, value)
+    return 2
+}
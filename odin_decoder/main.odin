@@ -1,7 +1,9 @@
 package main
 
 import "core:fmt"
+import "core:mem"
 import "core:os"
+import "core:strings"
 
 eac_table := [8]string{
     "bx + si",
@@ -48,388 +50,155 @@ LOOPZ: u8 = 0b1110_0001
 LOOPNZ: u8 = 0b1110_0000
 JCXZ: u8 = 0b1110_0011
 
+// Input is read CHUNK_SIZE bytes at a time into one reused buffer.
+CHUNK_SIZE :: 64 * 1024
 
-main :: proc() {
-
-    // Read instructions file
-    bytes, ok := os.read_entire_file_from_filename("instructions")
-    if !ok {
-        fmt.println("Error opening file.")
-        return
-    }
-    
-    // Debug print bytes and bits
-    // fmt.printf("------------------------------\n\n")
-    // for byte, index in bytes {
-    //     fmt.printf("byte_%03d: 0x%02X, bits: %08b\n", index, byte, byte)
-    // }
-    // fmt.printf("------------------------------\n\n")
-
-    fmt.printf("\n------------- 8086 Decoder -----------------\n")
-
-    // Decode
-    i := 0
-    for i < len(bytes) {
-        if (bytes[i] >> 2) == MOV_REG_MEM_TO_FROM_REG {
-            bytes_read := common_disp("mov", bytes, i)
-            i += bytes_read
-            continue
-        }
-
-        if (bytes[i] >> 2) == ADD_REG_MEM_WITH_REG_TO_EITHER {
-            bytes_read := common_disp("add", bytes, i)
-            i += bytes_read
-            continue
-        }
-
-        if (bytes[i] >> 2) == SUB_REG_MEM_WITH_REG_TO_EITHER {
-            bytes_read := common_disp("sub", bytes, i)
-            i += bytes_read
-            continue
-        }
-
-        if (bytes[i] >> 2) == CMP_REG_MEM_WITH_REG_TO_EITHER {
-            bytes_read := common_disp("cmp", bytes, i)
-            i += bytes_read
-            continue
-        }
+// Longest instruction decoded: opcode, [MOD REG R/M], two displacement and
+// two data bytes.
+MAX_INSTRUCTION_LENGTH :: 6
 
-        if (bytes[i] >> 4) == MOV_IMMEDIATE_TO_REG {
-            is_word_operation := bit_is_set(bytes[i], 0b0000_1000)
-            reg_field: u8 = (bytes[i] & 0b0000_0111)
-            dest, src: string
-            if is_word_operation {
-                // next bytes
-                i += 1
-                low_data := bytes[i]
+// Zeroed bytes after the data so the last, possibly truncated, instruction
+// never indexes past the buffer.
+TAIL_PADDING :: 8
 
-                i += 1
-                high_data := bytes[i]
+// Decodes the instruction at bytes[pos], appends its text to out and returns
+// the number of bytes consumed.
+Decode_Proc :: #type proc(name: string, bytes: []u8, pos: int, out: ^strings.Builder) -> int
 
-                word_value: u16 = u16(low_data) | (u16(high_data) << 8)
-                dest = word_registers[reg_field]
-                src = fmt.aprintf("%d", word_value)
-            } else {
-                i += 1
-                dest = byte_registers[reg_field]
-                byte_value:= bytes[i]
-                src = fmt.aprintf("%d", byte_value)
-            }
+Decode_Entry :: struct {
+    decode: Decode_Proc,
+    name: string,
+}
 
-            fmt.printf("mov %s, %s\n", dest, src)
-            i += 1
-            continue
+// One entry per opcode byte, filled by build_decode_table.
+decode_table: [256]Decode_Entry
+
+build_decode_table :: proc() {
+    for op in 0..<256 {
+        byte := u8(op)
+        entry := &decode_table[op]
+
+        // Same order as the opcode checks this table replaces.
+        switch {
+        case (byte >> 2) == MOV_REG_MEM_TO_FROM_REG:
+            entry^ = {common_disp, "mov"}
+        case (byte >> 2) == ADD_REG_MEM_WITH_REG_TO_EITHER:
+            entry^ = {common_disp, "add"}
+        case (byte >> 2) == SUB_REG_MEM_WITH_REG_TO_EITHER:
+            entry^ = {common_disp, "sub"}
+        case (byte >> 2) == CMP_REG_MEM_WITH_REG_TO_EITHER:
+            entry^ = {common_disp, "cmp"}
+        case (byte >> 4) == MOV_IMMEDIATE_TO_REG:
+            entry^ = {mov_immediate_to_reg, "mov"}
+        case (byte >> 2) == COMMON_IMMEDIATE_REG_MEM:
+            entry^ = {common_immediate, ""}
+        case (byte >> 1) == ADD_IMMEDIATE_TO_ACCUMULATOR:
+            entry^ = {parse_arithmetic_immediate_to_accumulator, "add"}
+        case (byte >> 1) == SUB_IMMEDIATE_TO_ACCUMULATOR:
+            entry^ = {parse_arithmetic_immediate_to_accumulator, "sub"}
+        case (byte >> 1) == CMP_IMMEDIATE_TO_ACCUMULATOR:
+            entry^ = {parse_arithmetic_immediate_to_accumulator, "cmp"}
+        case byte == JNE:
+            entry^ = {short_jump, "jne"}
+        case byte == JE:
+            entry^ = {short_jump, "je"}
+        case byte == JL:
+            entry^ = {short_jump, "jl"}
+        case byte == JLE:
+            entry^ = {short_jump, "jle"}
+        case byte == JB:
+            entry^ = {short_jump, "jb"}
+        case byte == JBE:
+            entry^ = {short_jump, "jbe"}
+        case byte == JP:
+            entry^ = {short_jump, "jp"}
+        case byte == JO:
+            entry^ = {short_jump, "jo"}
+        case byte == JS:
+            entry^ = {short_jump, "js"}
+        case byte == JNL:
+            entry^ = {short_jump, "jnl"}
+        case byte == JG:
+            entry^ = {short_jump, "jg"}
+        case byte == JNB:
+            entry^ = {short_jump, "jnb"}
+        case byte == JA:
+            entry^ = {short_jump, "ja"}
+        case byte == JNP:
+            entry^ = {short_jump, "jnp"}
+        case byte == JNO:
+            entry^ = {short_jump, "jno"}
+        case byte == JNS:
+            entry^ = {short_jump, "jns"}
+        case byte == LOOP:
+            entry^ = {short_jump, "loop"}
+        case byte == LOOPZ:
+            entry^ = {short_jump, "loopz"}
+        case byte == LOOPNZ:
+            entry^ = {short_jump, "loopnz"}
+        case byte == JCXZ:
+            entry^ = {short_jump, "jcxz"}
         }
-        
-        if (bytes[i] >> 2) == COMMON_IMMEDIATE_REG_MEM {
-
-            has_sign_extension := bit_is_set(bytes[i], 0b0000_0010)
-            is_word_operation := bit_is_set(bytes[i], 0b0000_0001)
-
-            // [MOD REG R/M] byte
-            i += 1
-
-            mod_field: u8 = (bytes[i] >> 6)
-            reg_field: u8 = (bytes[i] & 0b0011_1000) >> 3
-            rm_field: u8 = (bytes[i] & 0b0000_0111)
-
-            name: string
-            switch reg_field {
-                case 0b000:
-                    name = "add"
-                case 0b101:
-                    name = "sub"
-                case 0b111:
-                    name = "cmp"
-            }
-
-            if (mod_field == 0b00 && rm_field == 0b110) {
-
-                // Next bytes
-                i += 1
-                low_data := bytes[i]
-
-                i += 1
-                high_data := bytes[i]
-
-                direct_address: u16 = u16(low_data) | (u16(high_data) << 8)
-
-                i += 1
-                data := bytes[i]
-
-                fmt.printf("%s [%d], %d\n", name, direct_address, data)
-
-                i += 1
-                continue
-            }
-
-            if (mod_field == 0b00) {
-                rm_register := eac_table[rm_field]
-
-                i += 1
-                data := bytes[i]
-
-                fmt.printf("%s [%s], %d\n", name, rm_register, data)
-
-                i += 1
-                continue
-            }
-
-            if (mod_field == 0b10) {
-                rm_register := eac_table[rm_field]
-
-                disp_value: u16
-                if (is_word_operation) {
-                    i += 1
-                    disp_low := bytes[i]
-
-                    i += 1
-                    disp_high := bytes[i]
-
-                    disp_value = u16(disp_low) | (u16(disp_high) << 8)
-
-                } else {
-                    i += 1
-                    disp_value := bytes[i]
-                }
+    }
+}
 
-                i += 1
-                data := bytes[i]
+main :: proc() {
+    build_decode_table()
 
-                fmt.printf("%s [%s + %d], %d\n", name, rm_register, disp_value, data)
+    // Open instructions file
+    fd, err := os.open("instructions")
+    if err != os.ERROR_NONE {
+        fmt.println("Error opening file.")
+        return
+    }
+    defer os.close(fd)
 
-                i += 1
-                continue
+    fmt.printf("\n------------- 8086 Decoder -----------------\n")
 
+    // The partial instruction left at the end of a read is moved to the
+    // front of the buffer and the next chunk is read in behind it.
+    buffer := make([]u8, MAX_INSTRUCTION_LENGTH + CHUNK_SIZE + TAIL_PADDING)
+    defer delete(buffer)
+
+    // Reset per chunk, so it stops growing once it fits one chunk of output.
+    out := strings.builder_make()
+    defer strings.builder_destroy(&out)
+
+    carry := 0
+    for {
+        bytes_read, read_err := os.read(fd, buffer[carry:carry + CHUNK_SIZE])
+        if read_err != os.ERROR_NONE {
+            fmt.println("Error reading file.")
+            return
+        }
+
+        at_end := bytes_read == 0
+        end := carry + bytes_read
+        mem.zero_slice(buffer[end:end + TAIL_PADDING])
+
+        // Decode
+        strings.builder_reset(&out)
+        i := 0
+        for i < end {
+            if !at_end && i + MAX_INSTRUCTION_LENGTH > end {
+                break
             }
 
-            if (mod_field == 0b11) {
-                rm_register := word_registers[rm_field] if is_word_operation else byte_registers[rm_field]
-
-                if (!has_sign_extension && is_word_operation) {
-                    i += 1
-                    data_one := bytes[i]
-
-                    i += 1
-                    data_two := bytes[i]
-
-                    value: u16 = u16(data_one) | (u16(data_two) << 8)
-
-                    fmt.printf("%s %s, %d\n", name, rm_register, value)
-
-                    i += 1
-                    continue
-                }
-
-                if (has_sign_extension) {
-                    i += 1
-                    value := bytes[i]
-
-                    fmt.printf("%s %s, %d\n", name, rm_register, value)
-
-                    i += 1
-                    continue
-                }
+            entry := decode_table[buffer[i]]
+            if entry.decode == nil {
+                fmt.sbprintf(&out, "Error: unknown opcode 0x%02X\n", buffer[i])
+                os.write_string(os.stdout, strings.to_string(out))
+                return
             }
+            i += entry.decode(entry.name, buffer, i, &out)
         }
+        os.write_string(os.stdout, strings.to_string(out))
 
-        if (bytes[i] >> 1) == ADD_IMMEDIATE_TO_ACCUMULATOR {
-            bytes_read := parse_arithmetic_immediate_to_accumulator("add", bytes, i)
-            i += bytes_read
-            continue
-        }
-
-        if (bytes[i] >> 1) == SUB_IMMEDIATE_TO_ACCUMULATOR {
-            bytes_read := parse_arithmetic_immediate_to_accumulator("sub", bytes, i)
-            i += bytes_read
-            continue
+        if at_end {
+            break
         }
 
-        if (bytes[i] >> 1) == CMP_IMMEDIATE_TO_ACCUMULATOR {
-            bytes_read := parse_arithmetic_immediate_to_accumulator("cmp", bytes, i)
-            i += bytes_read
-            continue
-        }
-
-        if (bytes[i]) == JNE {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("jne %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JE {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("je %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JL {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("jl %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JLE {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("jle %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JB {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("jb %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JBE {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("jbe %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JP {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("jp %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JO {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("jo %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JS {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("js %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JNL {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("jnl %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JG {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("jg %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JNB {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("jnb %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JA {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("ja %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JNP {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("jnp %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JNO {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("jno %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JNS {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("jns %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == LOOP {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("loop %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == LOOPZ {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("loopz %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == LOOPNZ {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("loopnz %d\n", value)
-
-            i += 1
-            continue
-        }
-
-        if (bytes[i]) == JCXZ {
-            i += 1
-            value := i8(bytes[i])
-            fmt.printf("jcxz %d\n", value)
-
-            i += 1
-            continue
-        }
+        carry = end - i
+        copy(buffer[:carry], buffer[i:end])
     }
 }
-
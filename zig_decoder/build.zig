@@ -11,9 +11,16 @@ pub fn build(b: *std.build.Builder) void {
     // between Debug, ReleaseSafe, ReleaseFast, and ReleaseSmall.
     const mode = b.standardReleaseOptions();
 
+    // -Ddump-bytes=false leaves out the listing of every input byte on
+    // stderr, for bench/compare_decoders.py.
+    const dump_bytes = b.option(bool, "dump-bytes", "Print every input byte to stderr (default: true)") orelse true;
+    const options = b.addOptions();
+    options.addOption(bool, "dump_bytes", dump_bytes);
+
     const exe = b.addExecutable("zig_decoder", "src/main.zig");
     exe.setTarget(target);
     exe.setBuildMode(mode);
+    exe.addOptions("build_options", options);
     exe.install();
 
     const run_cmd = exe.run();
@@ -28,7 +35,18 @@ pub fn build(b: *std.build.Builder) void {
     const exe_tests = b.addTest("src/main.zig");
     exe_tests.setTarget(target);
     exe_tests.setBuildMode(mode);
+    exe_tests.addOptions("build_options", options);
 
     const test_step = b.step("test", "Run unit tests");
     test_step.dependOn(&exe_tests.step);
+
+    // Always optimized, timings from a debug build say nothing.
+    const bench = b.addExecutable("bench", "src/bench.zig");
+    bench.setTarget(target);
+    bench.setBuildMode(.ReleaseFast);
+    bench.addOptions("build_options", options);
+
+    const bench_cmd = bench.run();
+    const bench_step = b.step("bench", "Compare table dispatch against the sequential opcode checks");
+    bench_step.dependOn(&bench_cmd.step);
 }
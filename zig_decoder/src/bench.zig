@@ -0,0 +1,96 @@
+const std = @import("std");
+const decoder = @import("main.zig");
+
+const input_size: usize = 16 * 1024 * 1024;
+const runs: usize = 5;
+
+const Engine = enum {
+    sequential,
+    table,
+};
+
+pub fn main() !void {
+    const allocator = std.heap.page_allocator;
+
+    var input = std.ArrayList(u8).init(allocator);
+    defer input.deinit();
+    try generateInput(&input, input_size);
+
+    std.debug.print("Decoding {d} bytes, best of {d} runs\n", .{ input.items.len, runs });
+    const sequential_ns = try bestRun(.sequential, allocator, input.items);
+    const table_ns = try bestRun(.table, allocator, input.items);
+
+    report("sequential checks", sequential_ns, input.items.len);
+    report("comptime table", table_ns, input.items.len);
+    std.debug.print("speedup: {d:.2}x\n", .{@intToFloat(f64, sequential_ns) / @intToFloat(f64, table_ns)});
+}
+
+fn bestRun(engine: Engine, allocator: std.mem.Allocator, input_bytes: []const u8) !u64 {
+    var best: u64 = std.math.maxInt(u64);
+    var run: usize = 0;
+    while (run < runs) : (run += 1) {
+        var writer = std.io.countingWriter(std.io.null_writer);
+        var timer = try std.time.Timer.start();
+        switch (engine) {
+            .sequential => try decoder.decodeSequential(allocator, input_bytes, writer.writer()),
+            .table => try decoder.decode(allocator, input_bytes, writer.writer()),
+        }
+        best = std.math.min(best, timer.read());
+    }
+    return best;
+}
+
+fn report(name: []const u8, ns: u64, bytes: usize) void {
+    const seconds = @intToFloat(f64, ns) / 1e9;
+    std.debug.print("{s: <18} {d:.3} s  {d:.1} MB/s\n", .{ name, seconds, @intToFloat(f64, bytes) / 1e6 / seconds });
+}
+
+// Random stream of the forms both engines decode the same way: reg/mem
+// mov/add/sub/cmp, immediate to register, immediate to accumulator and
+// the short jumps.
+fn generateInput(input: *std.ArrayList(u8), size: usize) !void {
+    var prng = std.rand.DefaultPrng.init(0x8086);
+    const random = prng.random();
+
+    const reg_mem_opcodes = [_]u8{ 0x88, 0x00, 0x28, 0x38 };
+    const accumulator_opcodes = [_]u8{ 0x04, 0x2C, 0x3C };
+    const jump_opcodes = [_]u8{ 0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x7B, 0x7C, 0x7D, 0x7E, 0x7F, 0xE0, 0xE1, 0xE2, 0xE3 };
+
+    try input.ensureTotalCapacity(size);
+    while (input.items.len + 6 <= size) {
+        switch (random.uintLessThan(u8, 4)) {
+            0 => {
+                const modrm = random.int(u8);
+                const mod = modrm >> 6;
+                const rm = modrm & 0b111;
+                try input.append(reg_mem_opcodes[random.uintLessThan(usize, reg_mem_opcodes.len)] | random.uintLessThan(u8, 4));
+                try input.append(modrm);
+                const displacement_bytes: usize = if ((mod == 0b00 and rm == 0b110) or mod == 0b10) 2 else if (mod == 0b01) 1 else 0;
+                var i: usize = 0;
+                while (i < displacement_bytes) : (i += 1) {
+                    try input.append(random.int(u8));
+                }
+            },
+            1 => {
+                const opcode = 0b1011_0000 | random.uintLessThan(u8, 16);
+                try input.append(opcode);
+                try input.append(random.int(u8));
+                if (opcode & 0b0000_1000 != 0) {
+                    try input.append(random.int(u8));
+                }
+            },
+            2 => {
+                const opcode = accumulator_opcodes[random.uintLessThan(usize, accumulator_opcodes.len)] | random.uintLessThan(u8, 2);
+                try input.append(opcode);
+                try input.append(random.int(u8));
+                if (opcode & 0b0000_0001 != 0) {
+                    try input.append(random.int(u8));
+                }
+            },
+            else => {
+                try input.append(jump_opcodes[random.uintLessThan(usize, jump_opcodes.len)]);
+                try input.append(random.int(u8));
+            },
+        }
+    }
+}
@@ -1,5 +1,6 @@
 const std = @import("std");
 const print = std.debug.print;
+const build_options = @import("build_options");
 
 const eac_table: [8][]const u8 = [_][]const u8{
     "bx + si",
@@ -47,6 +48,109 @@ const LOOPZ: u8 = 0b1110_0001;
 const LOOPNZ: u8 = 0b1110_0000;
 const JCXZ: u8 = 0b1110_0011;
 
+const InstructionKind = enum {
+    unknown,
+    reg_mem,
+    immediate_to_reg,
+    immediate_reg_mem,
+    immediate_to_accumulator,
+    jump,
+};
+
+const OpcodeSpec = struct {
+    bits: u8,
+    mask: u8,
+    kind: InstructionKind,
+    name: []const u8,
+};
+
+// Every opcode byte where (byte & mask) == bits decodes as kind. The first
+// matching spec wins, in the same order as the checks in decodeSequential.
+const opcode_specs = [_]OpcodeSpec{
+    .{ .bits = MOV_REG_MEM_TO_FROM_REG << 2, .mask = 0b1111_1100, .kind = .reg_mem, .name = "mov" },
+    .{ .bits = ADD_REG_MEM_WITH_REG_TO_EITHER << 2, .mask = 0b1111_1100, .kind = .reg_mem, .name = "add" },
+    .{ .bits = SUB_REG_MEM_WITH_REG_TO_EITHER << 2, .mask = 0b1111_1100, .kind = .reg_mem, .name = "sub" },
+    .{ .bits = CMP_REG_MEM_WITH_REG_TO_EITHER << 2, .mask = 0b1111_1100, .kind = .reg_mem, .name = "cmp" },
+    .{ .bits = MOV_IMMEDIATE_TO_REG << 4, .mask = 0b1111_0000, .kind = .immediate_to_reg, .name = "mov" },
+    .{ .bits = COMMON_IMMEDIATE_REG_MEM << 2, .mask = 0b1111_1100, .kind = .immediate_reg_mem, .name = "" },
+    .{ .bits = ADD_IMMEDIATE_TO_ACCUMULATOR << 1, .mask = 0b1111_1110, .kind = .immediate_to_accumulator, .name = "add" },
+    .{ .bits = SUB_IMMEDIATE_TO_ACCUMULATOR << 1, .mask = 0b1111_1110, .kind = .immediate_to_accumulator, .name = "sub" },
+    .{ .bits = CMP_IMMEDIATE_TO_ACCUMULATOR << 1, .mask = 0b1111_1110, .kind = .immediate_to_accumulator, .name = "cmp" },
+    .{ .bits = JNE, .mask = 0xFF, .kind = .jump, .name = "jne" },
+    .{ .bits = JE, .mask = 0xFF, .kind = .jump, .name = "je" },
+    .{ .bits = JL, .mask = 0xFF, .kind = .jump, .name = "jl" },
+    .{ .bits = JLE, .mask = 0xFF, .kind = .jump, .name = "jle" },
+    .{ .bits = JB, .mask = 0xFF, .kind = .jump, .name = "jb" },
+    .{ .bits = JBE, .mask = 0xFF, .kind = .jump, .name = "jbe" },
+    .{ .bits = JP, .mask = 0xFF, .kind = .jump, .name = "jp" },
+    .{ .bits = JO, .mask = 0xFF, .kind = .jump, .name = "jo" },
+    .{ .bits = JS, .mask = 0xFF, .kind = .jump, .name = "js" },
+    .{ .bits = JNL, .mask = 0xFF, .kind = .jump, .name = "jnl" },
+    .{ .bits = JG, .mask = 0xFF, .kind = .jump, .name = "jg" },
+    .{ .bits = JNB, .mask = 0xFF, .kind = .jump, .name = "jnb" },
+    .{ .bits = JA, .mask = 0xFF, .kind = .jump, .name = "ja" },
+    .{ .bits = JNP, .mask = 0xFF, .kind = .jump, .name = "jnp" },
+    .{ .bits = JNO, .mask = 0xFF, .kind = .jump, .name = "jno" },
+    .{ .bits = JNS, .mask = 0xFF, .kind = .jump, .name = "jns" },
+    .{ .bits = LOOP, .mask = 0xFF, .kind = .jump, .name = "loop" },
+    .{ .bits = LOOPZ, .mask = 0xFF, .kind = .jump, .name = "loopz" },
+    .{ .bits = LOOPNZ, .mask = 0xFF, .kind = .jump, .name = "loopnz" },
+    .{ .bits = JCXZ, .mask = 0xFF, .kind = .jump, .name = "jcxz" },
+};
+
+const OpcodeEntry = struct {
+    kind: InstructionKind = .unknown,
+    name: []const u8 = "",
+};
+
+// One entry per opcode byte, generated from opcode_specs at compile time.
+const opcode_table: [256]OpcodeEntry = blk: {
+    @setEvalBranchQuota(20000);
+    var table = [_]OpcodeEntry{.{}} ** 256;
+    for (table) |*entry, byte| {
+        for (opcode_specs) |spec| {
+            if ((byte & spec.mask) == spec.bits) {
+                entry.* = .{ .kind = spec.kind, .name = spec.name };
+                break;
+            }
+        }
+    }
+    break :blk table;
+};
+
+const ModrmShape = struct {
+    mod: u8,
+    reg: u8,
+    rm: u8,
+    displacement_bytes: u8,
+    // mod 00 with rm 110: a 16-bit address and no base register.
+    direct_address: bool,
+    register_mode: bool,
+};
+
+// One entry per [MOD REG R/M] byte, generated at compile time.
+const modrm_shapes: [256]ModrmShape = blk: {
+    @setEvalBranchQuota(10000);
+    var shapes: [256]ModrmShape = undefined;
+    for (shapes) |*shape, byte| {
+        const mod = @intCast(u8, byte >> 6);
+        const rm = @intCast(u8, byte & 0b0000_0111);
+        const direct_address = mod == 0b00 and rm == 0b110;
+        shape.* = .{
+            .mod = mod,
+            .reg = @intCast(u8, (byte & 0b0011_1000) >> 3),
+            .rm = rm,
+            .displacement_bytes = if (direct_address or mod == 0b10) 2 else if (mod == 0b01) 1 else 0,
+            .direct_address = direct_address,
+            .register_mode = mod == 0b11,
+        };
+    }
+    break :blk shapes;
+};
+
+// Longest operand text parseDestSrcDisplacement writes, e.g. "[bx + si + 65535], ax".
+const max_operands_length: usize = 64;
+
 pub fn main() !void {
     var current_dir = try std.fs.cwd().openDir(".", .{});
     defer current_dir.close();
@@ -54,37 +158,76 @@ pub fn main() !void {
     var file = try current_dir.openFile("instruction_list", .{});
     defer file.close();
 
-    var input_bytes: [1024]u8 = undefined;
+    // Everything decoding needs is allocated from this arena once per run.
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
 
-    const bytes_read = try file.readAll(&input_bytes);
-    debugPrint(&input_bytes, bytes_read);
-    print("Read {d} bytes\n\n", .{bytes_read});
+    const input_bytes = try file.readToEndAlloc(allocator, std.math.maxInt(usize));
+    if (build_options.dump_bytes) {
+        debugPrint(input_bytes, input_bytes.len);
+    }
+    print("Read {d} bytes\n\n", .{input_bytes.len});
+
+    var buffered_stdout = std.io.bufferedWriter(std.io.getStdOut().writer());
+    try decode(allocator, input_bytes, buffered_stdout.writer());
+    try buffered_stdout.flush();
+}
+
+// Decodes input_bytes and writes one line per instruction to writer. The only
+// allocation is the operand buffer, made once per call. Dispatch is a single
+// lookup in opcode_table.
+pub fn decode(allocator: std.mem.Allocator, input_bytes: []const u8, writer: anytype) !void {
+    const operands_buffer = try allocator.alloc(u8, max_operands_length);
+    defer allocator.free(operands_buffer);
+
+    var i: usize = 0;
+    while (i < input_bytes.len) {
+        const entry = opcode_table[input_bytes[i]];
+        const byte_count: usize = switch (entry.kind) {
+            .reg_mem => try regMemFromShape(operands_buffer, entry.name, input_bytes, i, writer),
+            .immediate_to_reg => try movImmediateToReg(input_bytes, i, writer),
+            .immediate_reg_mem => try commonImmediate(input_bytes, i, writer),
+            .immediate_to_accumulator => try parseArithmeticImmediateToAccumulator(entry.name, input_bytes, i, writer),
+            .jump => try shortJump(entry.name, input_bytes, i, writer),
+            .unknown => return error.UnknownOpcode,
+        };
+        i += byte_count;
+        i += 1;
+    }
+}
+
+// The original chain of opcode checks, kept for the benchmark in bench.zig.
+pub fn decodeSequential(allocator: std.mem.Allocator, input_bytes: []const u8, writer: anytype) !void {
+    const operands_buffer = try allocator.alloc(u8, max_operands_length);
+    defer allocator.free(operands_buffer);
 
+    const bytes_read = input_bytes.len;
     var i: usize = 0;
     while (i < bytes_read) {
         if ((input_bytes[i] >> 2) == MOV_REG_MEM_TO_FROM_REG) {
-            var byte_count: usize = try commonDisplacement("mov", &input_bytes, i);
+            var byte_count: usize = try commonDisplacement(operands_buffer, "mov", input_bytes, i, writer);
             i += byte_count;
             i += 1;
             continue;
         }
 
         if ((input_bytes[i] >> 2) == ADD_REG_MEM_WITH_REG_TO_EITHER) {
-            var byte_count: usize = try commonDisplacement("add", &input_bytes, i);
+            var byte_count: usize = try commonDisplacement(operands_buffer, "add", input_bytes, i, writer);
             i += byte_count;
             i += 1;
             continue;
         }
 
         if ((input_bytes[i] >> 2) == SUB_REG_MEM_WITH_REG_TO_EITHER) {
-            var byte_count: usize = try commonDisplacement("sub", &input_bytes, i);
+            var byte_count: usize = try commonDisplacement(operands_buffer, "sub", input_bytes, i, writer);
             i += byte_count;
             i += 1;
             continue;
         }
 
         if ((input_bytes[i] >> 2) == CMP_REG_MEM_WITH_REG_TO_EITHER) {
-            var byte_count: usize = try commonDisplacement("cmp", &input_bytes, i);
+            var byte_count: usize = try commonDisplacement(operands_buffer, "cmp", input_bytes, i, writer);
             i += byte_count;
             i += 1;
             continue;
@@ -101,39 +244,39 @@ pub fn main() !void {
                 var high_data: u16 = input_bytes[i];
 
                 var value: u16 = low_data | (high_data << 8);
-                print("mov {s}, {d}\n", .{ word_registers[reg_field], value });
+                try writer.print("mov {s}, {d}\n", .{ word_registers[reg_field], value });
             } else {
                 i += 1;
                 var value: u8 = input_bytes[i];
-                print("mov {s}, {d}\n", .{ byte_registers[reg_field], value });
+                try writer.print("mov {s}, {d}\n", .{ byte_registers[reg_field], value });
             }
             i += 1;
             continue;
         }
 
         if ((input_bytes[i] >> 2) == COMMON_IMMEDIATE_REG_MEM) {
-            var byte_count: usize = commonImmediate(&input_bytes, i);
+            var byte_count: usize = try commonImmediate(input_bytes, i, writer);
             i += byte_count;
             i += 1;
             continue;
         }
 
         if ((input_bytes[i] >> 1) == ADD_IMMEDIATE_TO_ACCUMULATOR) {
-            var byte_count: usize = parseArithmeticImmediateToAccumulator("add", &input_bytes, i);
+            var byte_count: usize = try parseArithmeticImmediateToAccumulator("add", input_bytes, i, writer);
             i += byte_count;
             i += 1;
             continue;
         }
 
         if ((input_bytes[i] >> 1) == SUB_IMMEDIATE_TO_ACCUMULATOR) {
-            var byte_count: usize = parseArithmeticImmediateToAccumulator("sub", &input_bytes, i);
+            var byte_count: usize = try parseArithmeticImmediateToAccumulator("sub", input_bytes, i, writer);
             i += byte_count;
             i += 1;
             continue;
         }
 
         if ((input_bytes[i] >> 1) == CMP_IMMEDIATE_TO_ACCUMULATOR) {
-            var byte_count: usize = parseArithmeticImmediateToAccumulator("cmp", &input_bytes, i);
+            var byte_count: usize = try parseArithmeticImmediateToAccumulator("cmp", input_bytes, i, writer);
             i += byte_count;
             i += 1;
             continue;
@@ -142,7 +285,7 @@ pub fn main() !void {
         if (input_bytes[i] == JNE) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("jne {d}\n", .{value});
+            try writer.print("jne {d}\n", .{value});
 
             i += 1;
             continue;
@@ -151,7 +294,7 @@ pub fn main() !void {
         if (input_bytes[i] == JE) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("je {d}\n", .{value});
+            try writer.print("je {d}\n", .{value});
 
             i += 1;
             continue;
@@ -160,7 +303,7 @@ pub fn main() !void {
         if (input_bytes[i] == JL) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("jl {d}\n", .{value});
+            try writer.print("jl {d}\n", .{value});
 
             i += 1;
             continue;
@@ -169,7 +312,7 @@ pub fn main() !void {
         if (input_bytes[i] == JLE) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("jle {d}\n", .{value});
+            try writer.print("jle {d}\n", .{value});
 
             i += 1;
             continue;
@@ -178,7 +321,7 @@ pub fn main() !void {
         if (input_bytes[i] == JB) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("jb {d}\n", .{value});
+            try writer.print("jb {d}\n", .{value});
 
             i += 1;
             continue;
@@ -187,7 +330,7 @@ pub fn main() !void {
         if (input_bytes[i] == JBE) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("jbe {d}\n", .{value});
+            try writer.print("jbe {d}\n", .{value});
 
             i += 1;
             continue;
@@ -196,7 +339,7 @@ pub fn main() !void {
         if (input_bytes[i] == JP) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("jp {d}\n", .{value});
+            try writer.print("jp {d}\n", .{value});
 
             i += 1;
             continue;
@@ -205,7 +348,7 @@ pub fn main() !void {
         if (input_bytes[i] == JO) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("jo {d}\n", .{value});
+            try writer.print("jo {d}\n", .{value});
 
             i += 1;
             continue;
@@ -214,7 +357,7 @@ pub fn main() !void {
         if (input_bytes[i] == JS) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("js {d}\n", .{value});
+            try writer.print("js {d}\n", .{value});
 
             i += 1;
             continue;
@@ -223,7 +366,7 @@ pub fn main() !void {
         if (input_bytes[i] == JNL) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("jnl {d}\n", .{value});
+            try writer.print("jnl {d}\n", .{value});
 
             i += 1;
             continue;
@@ -232,7 +375,7 @@ pub fn main() !void {
         if (input_bytes[i] == JG) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("jg {d}\n", .{value});
+            try writer.print("jg {d}\n", .{value});
 
             i += 1;
             continue;
@@ -241,7 +384,7 @@ pub fn main() !void {
         if (input_bytes[i] == JNB) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("jnb {d}\n", .{value});
+            try writer.print("jnb {d}\n", .{value});
 
             i += 1;
             continue;
@@ -250,7 +393,7 @@ pub fn main() !void {
         if (input_bytes[i] == JA) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("ja {d}\n", .{value});
+            try writer.print("ja {d}\n", .{value});
 
             i += 1;
             continue;
@@ -259,7 +402,7 @@ pub fn main() !void {
         if (input_bytes[i] == JNP) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("jnp {d}\n", .{value});
+            try writer.print("jnp {d}\n", .{value});
 
             i += 1;
             continue;
@@ -268,7 +411,7 @@ pub fn main() !void {
         if (input_bytes[i] == JNO) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("jno {d}\n", .{value});
+            try writer.print("jno {d}\n", .{value});
 
             i += 1;
             continue;
@@ -277,7 +420,7 @@ pub fn main() !void {
         if (input_bytes[i] == JNS) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("jns {d}\n", .{value});
+            try writer.print("jns {d}\n", .{value});
 
             i += 1;
             continue;
@@ -286,7 +429,7 @@ pub fn main() !void {
         if (input_bytes[i] == LOOP) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("loop {d}\n", .{value});
+            try writer.print("loop {d}\n", .{value});
 
             i += 1;
             continue;
@@ -295,7 +438,7 @@ pub fn main() !void {
         if (input_bytes[i] == LOOPZ) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("loopz {d}\n", .{value});
+            try writer.print("loopz {d}\n", .{value});
 
             i += 1;
             continue;
@@ -304,7 +447,7 @@ pub fn main() !void {
         if (input_bytes[i] == LOOPNZ) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("loopnz {d}\n", .{value});
+            try writer.print("loopnz {d}\n", .{value});
 
             i += 1;
             continue;
@@ -313,7 +456,7 @@ pub fn main() !void {
         if (input_bytes[i] == JCXZ) {
             i += 1;
             const value: i8 = @bitCast(i8, input_bytes[i]);
-            print("jcxz {d}\n", .{value});
+            try writer.print("jcxz {d}\n", .{value});
 
             i += 1;
             continue;
@@ -321,7 +464,68 @@ pub fn main() !void {
     }
 }
 
-fn parseArithmeticImmediateToAccumulator(name: []const u8, input_bytes: []u8, pos: usize) usize {
+fn regMemFromShape(operands_buffer: []u8, name: []const u8, input_bytes: []const u8, pos: usize, writer: anytype) !usize {
+    // OPCODE byte
+    const reg_is_dest: bool = bitIsSet(input_bytes[pos], 0b0000_0010);
+    const word_data: bool = bitIsSet(input_bytes[pos], 0b0000_0001);
+
+    // [MOD REG R/M] byte
+    const shape = modrm_shapes[input_bytes[pos + 1]];
+
+    var value: u16 = 0;
+    if (shape.displacement_bytes >= 1) {
+        value = input_bytes[pos + 2];
+    }
+    if (shape.displacement_bytes == 2) {
+        value |= @as(u16, input_bytes[pos + 3]) << 8;
+    }
+
+    const byte_count: usize = 1 + shape.displacement_bytes;
+
+    if (shape.direct_address) {
+        try writer.print("{s} {s}, [{d}]\n", .{ name, word_registers[shape.reg], value });
+        return byte_count;
+    }
+
+    const registers = if (word_data) word_registers else byte_registers;
+    const reg_register: []const u8 = registers[shape.reg];
+
+    if (shape.register_mode) {
+        const rm_register: []const u8 = registers[shape.rm];
+        if (reg_is_dest) {
+            try writer.print("{s} {s}, {s}\n", .{ name, reg_register, rm_register });
+        } else {
+            try writer.print("{s} {s}, {s}\n", .{ name, rm_register, reg_register });
+        }
+        return byte_count;
+    }
+
+    const dest_src_str = try parseDestSrcDisplacement(operands_buffer, reg_is_dest, reg_register, eac_table[shape.rm], value);
+    try writer.print("{s} {s}\n", .{ name, dest_src_str });
+    return byte_count;
+}
+
+fn movImmediateToReg(input_bytes: []const u8, pos: usize, writer: anytype) !usize {
+    const word_data: bool = bitIsSet(input_bytes[pos], 0b0000_1000);
+    const reg_field: u8 = (input_bytes[pos] & 0b0000_0111);
+    if (word_data) {
+        const value: u16 = input_bytes[pos + 1] | (@as(u16, input_bytes[pos + 2]) << 8);
+        try writer.print("mov {s}, {d}\n", .{ word_registers[reg_field], value });
+        return 2;
+    } else {
+        const value: u8 = input_bytes[pos + 1];
+        try writer.print("mov {s}, {d}\n", .{ byte_registers[reg_field], value });
+        return 1;
+    }
+}
+
+fn shortJump(name: []const u8, input_bytes: []const u8, pos: usize, writer: anytype) !usize {
+    const value: i8 = @bitCast(i8, input_bytes[pos + 1]);
+    try writer.print("{s} {d}\n", .{ name, value });
+    return 1;
+}
+
+fn parseArithmeticImmediateToAccumulator(name: []const u8, input_bytes: []const u8, pos: usize, writer: anytype) !usize {
     var i: usize = pos;
     var byte_count: usize = 0;
 
@@ -338,18 +542,18 @@ fn parseArithmeticImmediateToAccumulator(name: []const u8, input_bytes: []u8, po
 
         const value: u16 = data_one | (data_two << 8);
 
-        print("{s} ax, {d}\n", .{ name, value });
+        try writer.print("{s} ax, {d}\n", .{ name, value });
         return byte_count;
     } else {
         i += 1;
         byte_count += 1;
         const value: u8 = input_bytes[i];
-        print("{s} al, {d}\n", .{ name, value });
+        try writer.print("{s} al, {d}\n", .{ name, value });
         return byte_count;
     }
 }
 
-fn commonImmediate(input_bytes: []u8, pos: usize) usize {
+fn commonImmediate(input_bytes: []const u8, pos: usize, writer: anytype) !usize {
     var i: usize = pos;
     var byte_count: usize = 0;
 
@@ -384,7 +588,7 @@ fn commonImmediate(input_bytes: []u8, pos: usize) usize {
         byte_count += 1;
         const data: u8 = input_bytes[i];
 
-        print("{s} [{d}], {d}\n", .{ name, direct_address, data });
+        try writer.print("{s} [{d}], {d}\n", .{ name, direct_address, data });
         return byte_count;
     }
 
@@ -393,7 +597,7 @@ fn commonImmediate(input_bytes: []u8, pos: usize) usize {
         i += 1;
         byte_count += 1;
         const value: u8 = input_bytes[i];
-        print("{s} [{s}], {d}\n", .{ name, rm_register, value });
+        try writer.print("{s} [{s}], {d}\n", .{ name, rm_register, value });
         return byte_count;
     }
 
@@ -420,7 +624,7 @@ fn commonImmediate(input_bytes: []u8, pos: usize) usize {
         byte_count += 1;
         const data: u8 = input_bytes[i];
 
-        print("{s} [{s} + {d}], {d}\n", .{ name, rm_register, disp_value, data });
+        try writer.print("{s} [{s} + {d}], {d}\n", .{ name, rm_register, disp_value, data });
 
         return byte_count;
     }
@@ -438,7 +642,7 @@ fn commonImmediate(input_bytes: []u8, pos: usize) usize {
             const high_data: u16 = input_bytes[i];
             const value: u16 = low_data | (high_data << 8);
 
-            print("{s} {s}, {d}\n", .{ name, rm_register, value });
+            try writer.print("{s} {s}, {d}\n", .{ name, rm_register, value });
 
             return byte_count;
         }
@@ -448,7 +652,7 @@ fn commonImmediate(input_bytes: []u8, pos: usize) usize {
             byte_count += 1;
             const value: u8 = input_bytes[i];
 
-            print("{s} {s}, {d}\n", .{ name, rm_register, value });
+            try writer.print("{s} {s}, {d}\n", .{ name, rm_register, value });
 
             return byte_count;
         }
@@ -457,7 +661,7 @@ fn commonImmediate(input_bytes: []u8, pos: usize) usize {
     return byte_count;
 }
 
-fn commonDisplacement(name: []const u8, input_bytes: []u8, pos: usize) !usize {
+fn commonDisplacement(operands_buffer: []u8, name: []const u8, input_bytes: []const u8, pos: usize, writer: anytype) !usize {
     var i: usize = pos;
     var byte_count: usize = 0;
 
@@ -485,7 +689,7 @@ fn commonDisplacement(name: []const u8, input_bytes: []u8, pos: usize) !usize {
 
         const direct_address: u16 = low_data | (high_data << 8);
 
-        print("{s} {s}, [{d}]\n", .{ name, reg_register, direct_address });
+        try writer.print("{s} {s}, [{d}]\n", .{ name, reg_register, direct_address });
         return byte_count;
     }
 
@@ -494,14 +698,9 @@ fn commonDisplacement(name: []const u8, input_bytes: []u8, pos: usize) !usize {
         const rm_register: []const u8 = eac_table[rm_field];
         const value: u16 = 0;
 
-        var gpa = std.heap.GeneralPurposeAllocator(.{}){};
-        defer _ = gpa.deinit();
-        const allocator = gpa.allocator();
+        const dest_src_str = try parseDestSrcDisplacement(operands_buffer, reg_is_dest, reg_register, rm_register, value);
 
-        const dest_src_str = try parseDestSrcDisplacement(allocator, reg_is_dest, reg_register, rm_register, value);
-        defer allocator.free(dest_src_str);
-
-        print("{s} {s}\n", .{ name, dest_src_str });
+        try writer.print("{s} {s}\n", .{ name, dest_src_str });
         return byte_count;
     }
 
@@ -513,14 +712,9 @@ fn commonDisplacement(name: []const u8, input_bytes: []u8, pos: usize) !usize {
         byte_count += 1;
         const value: u16 = input_bytes[i];
 
-        var gpa = std.heap.GeneralPurposeAllocator(.{}){};
-        defer _ = gpa.deinit();
-        const allocator = gpa.allocator();
-
-        const dest_src_str = try parseDestSrcDisplacement(allocator, reg_is_dest, reg_register, rm_register, value);
-        defer allocator.free(dest_src_str);
+        const dest_src_str = try parseDestSrcDisplacement(operands_buffer, reg_is_dest, reg_register, rm_register, value);
 
-        print("{s} {s}\n", .{ name, dest_src_str });
+        try writer.print("{s} {s}\n", .{ name, dest_src_str });
         return byte_count;
     }
 
@@ -537,14 +731,9 @@ fn commonDisplacement(name: []const u8, input_bytes: []u8, pos: usize) !usize {
         const high_data: u16 = input_bytes[i];
         const value: u16 = low_data | (high_data << 8);
 
-        var gpa = std.heap.GeneralPurposeAllocator(.{}){};
-        defer _ = gpa.deinit();
-        const allocator = gpa.allocator();
-
-        const dest_src_str = try parseDestSrcDisplacement(allocator, reg_is_dest, reg_register, rm_register, value);
-        defer allocator.free(dest_src_str);
+        const dest_src_str = try parseDestSrcDisplacement(operands_buffer, reg_is_dest, reg_register, rm_register, value);
 
-        print("{s} {s}\n", .{ name, dest_src_str });
+        try writer.print("{s} {s}\n", .{ name, dest_src_str });
         return byte_count;
     }
 
@@ -553,9 +742,9 @@ fn commonDisplacement(name: []const u8, input_bytes: []u8, pos: usize) !usize {
         const rm_register: []const u8 = if (word_data) word_registers[rm_field] else byte_registers[rm_field];
 
         if (reg_is_dest) {
-            print("{s} {s}, {s}\n", .{ name, reg_register, rm_register });
+            try writer.print("{s} {s}, {s}\n", .{ name, reg_register, rm_register });
         } else {
-            print("{s} {s}, {s}\n", .{ name, rm_register, reg_register });
+            try writer.print("{s} {s}, {s}\n", .{ name, rm_register, reg_register });
         }
         return byte_count;
     }
@@ -563,7 +752,7 @@ fn commonDisplacement(name: []const u8, input_bytes: []u8, pos: usize) !usize {
     return byte_count;
 }
 
-fn parseDestSrcDisplacement(allocator: std.mem.Allocator, reg_is_dest: bool, reg_register: []const u8, rm_register: []const u8, value: u16) ![]const u8 {
+fn parseDestSrcDisplacement(operands_buffer: []u8, reg_is_dest: bool, reg_register: []const u8, rm_register: []const u8, value: u16) ![]const u8 {
     var src_buffer: [64]u8 = undefined;
     var dest_buffer: [64]u8 = undefined;
 
@@ -586,14 +775,10 @@ fn parseDestSrcDisplacement(allocator: std.mem.Allocator, reg_is_dest: bool, reg
         }
     }
 
-    const size = dest.len + src.len + 2;
-    var result = try allocator.alloc(u8, size);
-    _ = try std.fmt.bufPrint(result, "{s}, {s}", .{ dest, src });
-
-    return result;
+    return std.fmt.bufPrint(operands_buffer, "{s}, {s}", .{ dest, src });
 }
 
-fn debugPrint(input_bytes: []u8, bytes_read: usize) void {
+fn debugPrint(input_bytes: []const u8, bytes_read: usize) void {
     var i: u32 = 0;
     while (i < bytes_read) : (i += 1) {
         print("{d:0>2}: 0x{X:0>2} - 0b{b:0>8}\n", .{ i, input_bytes[i], input_bytes[i] });
@@ -607,3 +792,54 @@ fn bitIsSet(byte: u8, mask: u8) bool {
         return false;
     }
 }
+
+test "decoding allocates once per run, not once per instruction" {
+    // mov [bx + si + 4], cx
+    const instruction = [_]u8{ 0x89, 0x48, 0x04 };
+    var input_bytes: [instruction.len * 1000]u8 = undefined;
+    var i: usize = 0;
+    while (i < input_bytes.len) : (i += instruction.len) {
+        std.mem.copy(u8, input_bytes[i..], &instruction);
+    }
+
+    var output: [64 * 1000]u8 = undefined;
+
+    var one_stream = std.io.fixedBufferStream(&output);
+    var one_counter = std.testing.FailingAllocator.init(std.testing.allocator, std.math.maxInt(usize));
+    try decode(one_counter.allocator(), &instruction, one_stream.writer());
+    try std.testing.expectEqualStrings("mov [bx + si + 4], cx\n", one_stream.getWritten());
+
+    var many_stream = std.io.fixedBufferStream(&output);
+    var many_counter = std.testing.FailingAllocator.init(std.testing.allocator, std.math.maxInt(usize));
+    try decode(many_counter.allocator(), &input_bytes, many_stream.writer());
+
+    try std.testing.expectEqual(one_counter.allocations, many_counter.allocations);
+    try std.testing.expectEqual(many_counter.allocations, many_counter.deallocations);
+}
+
+test "table dispatch matches the sequential opcode checks" {
+    const input_bytes = [_]u8{
+        0x89, 0xD9, // mov cx, bx
+        0x8A, 0x40, 0x04, // mov al, [bx + si + 4]
+        0x89, 0x87, 0x87, 0x13, // mov [bx + 4999], ax
+        0x8B, 0x2E, 0x05, 0x00, // mov bp, [5]
+        0xB9, 0x0C, 0x00, // mov cx, 12
+        0xB1, 0xF4, // mov cl, -12
+        0x03, 0x18, // add bx, [bx + si]
+        0x83, 0xC6, 0x02, // add si, 2
+        0x2D, 0xE8, 0x03, // sub ax, 1000
+        0x3C, 0x09, // cmp al, 9
+        0x75, 0xFE, // jne -2
+        0xE3, 0x02, // jcxz 2
+    };
+
+    var sequential_output: [1024]u8 = undefined;
+    var sequential_stream = std.io.fixedBufferStream(&sequential_output);
+    try decodeSequential(std.testing.allocator, &input_bytes, sequential_stream.writer());
+
+    var table_output: [1024]u8 = undefined;
+    var table_stream = std.io.fixedBufferStream(&table_output);
+    try decode(std.testing.allocator, &input_bytes, table_stream.writer());
+
+    try std.testing.expectEqualStrings(sequential_stream.getWritten(), table_stream.getWritten());
+}